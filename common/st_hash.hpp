@@ -0,0 +1,119 @@
+// Stack trace hash used for compressing stack traces. Shared by wrap2trace,
+// which computes it while collecting stack traces, and st_reconst, which
+// recomputes it while searching the call graph for matching stack traces.
+//
+// The hash has two parts. The lower 32 bits are the CRC32 of the whole
+// stack trace (top of the stack first). The upper 32 bits hold up to
+// ST_HASH_MAX_CHECKPOINTS "checkpoint" hashes, one per checkpoint depth D:
+// the low bits of the CRC32 of the first D frames, which lets the search
+// prune a branch as soon as it reaches depth D. With K checkpoints, each
+// one has 32 / K bits, the first one in the lowest bits. A single
+// checkpoint at depth kMedHashIdx is the original "medium" hash.
+//
+// Requires SSE4.2 (compile with -msse4.2).
+
+#ifndef __ST_HASH_H__
+#define __ST_HASH_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#define ST_HASH_MAX_CHECKPOINTS 8
+#define ST_HASH_MAX_CHECKPOINT_DEPTH 255
+
+// Checkpoint depths of the hash, and where their hashes are.
+struct STHashLayout {
+  unsigned NumCheckpoints;
+  unsigned Bits; // Bits per checkpoint.
+  unsigned Depths[ST_HASH_MAX_CHECKPOINTS]; // Increasing.
+  // Checkpoint at each depth, or -1.
+  int8_t CheckpointAt[ST_HASH_MAX_CHECKPOINT_DEPTH + 1];
+};
+
+// Set the checkpoint depths of L. Returns false if they are not increasing
+// or too many or too deep.
+static inline bool
+SetHashCheckpoints(STHashLayout &L, const unsigned *Depths, size_t Num) {
+  if (!Num || Num > ST_HASH_MAX_CHECKPOINTS)
+    return false;
+  L.NumCheckpoints = Num;
+  L.Bits = 32 / Num;
+  for (size_t D = 0; D <= ST_HASH_MAX_CHECKPOINT_DEPTH; D++)
+    L.CheckpointAt[D] = -1;
+  for (size_t I = 0; I < Num; I++) {
+    if (Depths[I] > ST_HASH_MAX_CHECKPOINT_DEPTH ||
+        (I && Depths[I] <= Depths[I - 1]))
+      return false;
+    L.Depths[I] = Depths[I];
+    L.CheckpointAt[Depths[I]] = I;
+  }
+  return true;
+}
+
+// Parse checkpoint depths "D1,D2,...", e.g., "8,16,24,32" for a checkpoint
+// every 8 frames. Returns false if Str is malformed.
+static inline bool ParseHashLayout(const char *Str, STHashLayout &L) {
+  unsigned Depths[ST_HASH_MAX_CHECKPOINTS];
+  size_t Num = 0;
+  for (;;) {
+    char *End;
+    unsigned long D = strtoul(Str, &End, 10);
+    if (End == Str || Num == ST_HASH_MAX_CHECKPOINTS ||
+        D > ST_HASH_MAX_CHECKPOINT_DEPTH)
+      return false;
+    Depths[Num++] = D;
+    if (!*End)
+      break;
+    if (*End != ',')
+      return false;
+    Str = End + 1;
+  }
+  return SetHashCheckpoints(L, Depths, Num);
+}
+
+static inline uint64_t HashCheckpointMask(const STHashLayout &L) {
+  return (1ULL << L.Bits) - 1;
+}
+
+// Hash of checkpoint I in Hash.
+static inline uint32_t
+HashCheckpoint(uintptr_t Hash, const STHashLayout &L, unsigned I) {
+  return (Hash >> (32 + I * L.Bits)) & HashCheckpointMask(L);
+}
+
+// CRC32 of the frames so far (in the lower 32 bits of CRC) and PC.
+static inline uint32_t CRCStep(uintptr_t CRC, uintptr_t PC) {
+  return __builtin_ia32_crc32di(CRC, PC);
+}
+
+// The CRC32 is linear, with no constant term: the CRC of frames X1..XN from
+// CRC is CRCShift(CRC, N) ^ the CRC of X1..XN from 0. So the hash of the
+// first frames of a stack trace and that of its last frames make up the
+// lower 32 bits of its hash.
+static inline uint32_t CRCShift(uintptr_t CRC, size_t N) {
+  while (N--)
+    CRC = CRCStep(CRC, 0);
+  return CRC;
+}
+
+static inline uintptr_t
+HashStep(uintptr_t Hash, uintptr_t PC, size_t Idx, const STHashLayout &L) {
+  uintptr_t CRC32 = CRCStep(Hash, PC);
+  uintptr_t Checkpoints = (Hash >> 32) << 32;
+  // TODO: is that the right approach to OR hashes? XOR instead?
+  if (Idx <= ST_HASH_MAX_CHECKPOINT_DEPTH && L.CheckpointAt[Idx] >= 0)
+    Checkpoints |= (Hash & HashCheckpointMask(L))
+                   << (32 + L.CheckpointAt[Idx] * L.Bits);
+  return CRC32 | Checkpoints;
+}
+
+static inline uintptr_t
+Hash(const uintptr_t *ST, size_t Size, const STHashLayout &L) {
+  uintptr_t Res = 0;
+  for (size_t I = 0; I < Size; I++)
+    Res = HashStep(Res, ST[I], I, L);
+  return Res;
+}
+
+#endif
@@ -2,12 +2,23 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <chrono>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
 #include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -21,111 +32,373 @@ static std::string utohexstr(const T &i) {
   return stream.str();
 }
 
-CallGraph::CallGraph(std::istream &In) {
-  std::string X;
-
-  // TODO: reuse code: readToList() etc.
-  while(std::getline(In, X)) {
-    if (!X.find("INDIRECT TARGETS TYPES")) {
-      assert (TypeIdToIndirTargets.empty() 
-              && "Multiple \"INDIRECT TARGETS TYPES\" sections.");
-      while (std::getline(In, X)) {
-        if (X == "") break;
-        std::stringstream Line(X);
-        // Read type id.
-        uintptr_t TypeId;
-        Line >> std::hex >> TypeId;
-        // Read function entry addresses.
-        do {
-          uintptr_t TargetAddr;
-          Line >> std::hex >> TargetAddr;
-          TypeIdToIndirTargets[TypeId].push_back(TargetAddr);
-        } while (Line.good());
-      }
-    }
-    if (!X.find("INDIRECT CALLS TYPES")) {
-      assert (TypeIdToIndirCalls.empty() 
-              && "Multiple \"INDIRECT CALLS TYPES\" sections.");
-      while (std::getline(In, X)) {
-        if (X == "") break;
-        std::stringstream Line(X);
-        // Read type id.
-        uintptr_t TypeId;
-        Line >> std::hex >> TypeId;
-        // Read indirect call site addresses.
-        do {
-          uintptr_t CallSiteAddr;
-          Line >> std::hex >> CallSiteAddr;
-          TypeIdToIndirCalls[TypeId].push_back(CallSiteAddr);
-        } while (Line.good());
-      }
-    }
-    if (!X.find("INDIRECT CALL SITES")) {
-      assert (FuncAddrToIndirCallSites.empty() 
-              && "Multiple \"INDIRECT CALL SITES\" sections.");
-      while (std::getline(In, X)) {  
-        if (X == "") break;
-        std::stringstream Line(X);
-        // Read caller address.
-        uintptr_t CallerAddr;
-        Line >> std::hex >> CallerAddr;
-        // Read indirect call site addresses.
-        do {
-          uintptr_t CallSiteAddr;
-          Line >> std::hex >> CallSiteAddr;
-          FuncAddrToIndirCallSites[CallerAddr].push_back(CallSiteAddr);
-          IndirCallSiteAddrs.insert(CallSiteAddr);
-        } while (Line.good());
+// Sections of the llvm-objdump output. Each one starts with a line
+// beginning with its name and ends with an empty line.
+enum CGSection {
+  kIndirTargetTypes, // TYPEID [FUNC_ADDR,]
+  kIndirCallTypes,   // TYPEID [CALL_SITE_ADDR,]
+  kIndirCallSites,   // CALLER_ADDR [CALL_SITE_ADDR,]
+  kDirCallSites,     // CALLER_ADDR [CALL_SITE_ADDR TARGET_ADDR,]
+  kFuncSymbols,      // FUNC_ADDR FUNC_NAME
+  kNumCGSections
+};
+
+static const char *const CGSectionNames[kNumCGSections] = {
+  "INDIRECT TARGETS TYPES",
+  "INDIRECT CALLS TYPES",
+  "INDIRECT CALL SITES",
+  "DIRECT CALL SITES",
+  "FUNCTION SYMBOLS",
+};
+
+// Lines of a section, without the header line.
+struct SectionRange {
+  const char *Begin = nullptr;
+  const char *End = nullptr;
+  size_t NumLines = 0;
+};
+
+// Scanner over the lines of a section. Values are hexadecimal, with or
+// without "0x", separated by blanks.
+class LineScanner {
+  const char *P, *LineEnd, *Next, *End;
+
+  static int HexDigit(char C) {
+    if (C >= '0' && C <= '9') return C - '0';
+    if (C >= 'a' && C <= 'f') return C - 'a' + 10;
+    if (C >= 'A' && C <= 'F') return C - 'A' + 10;
+    return -1;
+  }
+
+  void SkipBlanks() {
+    while (P < LineEnd && (*P == ' ' || *P == '\t' || *P == '\r' ||
+                           *P == ',' || *P == '(' || *P == ')'))
+      ++P;
+  }
+
+public:
+  LineScanner(const SectionRange &R)
+    : P(R.Begin), LineEnd(R.Begin), Next(R.Begin), End(R.End) {}
+
+  // Move to the next line. Returns false at the end of the section.
+  bool NextLine() {
+    if (Next >= End)
+      return false;
+    P = Next;
+    LineEnd = (const char *)memchr(P, '\n', End - P);
+    if (!LineEnd)
+      LineEnd = End;
+    Next = LineEnd + 1;
+    return true;
+  }
+
+  // Read the next value of the line. Returns false at the end of the line.
+  bool NextHex(uintptr_t &V) {
+    SkipBlanks();
+    if (LineEnd - P > 2 && P[0] == '0' && (P[1] == 'x' || P[1] == 'X'))
+      P += 2;
+    int D;
+    if (P == LineEnd || (D = HexDigit(*P)) < 0)
+      return false;
+    V = 0;
+    do {
+      V = (V << 4) | D;
+    } while (++P < LineEnd && (D = HexDigit(*P)) >= 0);
+    return true;
+  }
+
+  // Read the next blank-separated token of the line.
+  bool NextToken(std::string &Token) {
+    while (P < LineEnd && (*P == ' ' || *P == '\t' || *P == '\r'))
+      ++P;
+    const char *B = P;
+    while (P < LineEnd && *P != ' ' && *P != '\t' && *P != '\r')
+      ++P;
+    Token.assign(B, P);
+    return P != B;
+  }
+};
+
+// Find the sections. Returns false if a section appears twice.
+static bool FindSections(const char *Data, size_t Size,
+                         SectionRange (&Sections)[kNumCGSections]) {
+  const char *P = Data, *End = Data + Size;
+  while (P < End) {
+    const char *Eol = (const char *)memchr(P, '\n', End - P);
+    if (!Eol) Eol = End;
+    int Found = -1;
+    for (int S = 0; S < kNumCGSections; S++) {
+      size_t Len = strlen(CGSectionNames[S]);
+      // Match the whole name at the start of the line, e.g., don't take
+      // "DIRECT CALL SITESX" for "DIRECT CALL SITES".
+      if ((size_t)(Eol - P) >= Len && !memcmp(P, CGSectionNames[S], Len) &&
+          (P + Len == Eol || !isalnum((unsigned char)P[Len]))) {
+        Found = S;
+        break;
       }
     }
-    if (!X.find("DIRECT CALL SITES")) {
-      assert (FuncAddrToDirCallSites.empty() 
-              && "Multiple \"DIRECT CALL SITES\" sections.");
-      while (std::getline(In, X)) {
-        if (X == "") break;
-        std::stringstream Line(X);
-        // Read caller address.
-        uintptr_t CallerAddr;
-        Line >> std::hex >> CallerAddr;
-        // Read direct call site and target addresses.
-        do {
-          uintptr_t CallSiteAddr, TargetAddr;
-          Line >> std::hex >> CallSiteAddr >> TargetAddr;
-          FuncAddrToDirCallSites[CallerAddr].emplace_back(CallSiteAddr, TargetAddr);
-          DirCallSiteAddrs.insert(CallSiteAddr);
-        } while (Line.good());
-      }
+    P = Eol + 1;
+    if (Found < 0)
+      continue;
+    SectionRange &R = Sections[Found];
+    if (R.Begin) {
+      fprintf(stderr, "Error: multiple \"%s\" sections.\n",
+              CGSectionNames[Found]);
+      return false;
     }
-    if (!X.find("FUNCTION SYMBOLS")) {
-      assert (FuncAddrToName.empty() 
-              && "Multiple \"FUNCTION SYMBOLS\" sections.");
-      while (std::getline(In, X)) {
-        if (X == "") break;
-        std::stringstream Line(X);
-        uintptr_t FuncAddr;
-        std::string FuncName;
-        Line >> std::hex >> FuncAddr >> FuncName;
-        FuncAddrToName[FuncAddr] = FuncName;
-      }
+    // The section ends at the first empty line.
+    R.Begin = P < End ? P : End;
+    while (P < End) {
+      Eol = (const char *)memchr(P, '\n', End - P);
+      if (!Eol) Eol = End;
+      if (Eol == P || (Eol == P + 1 && *P == '\r'))
+        break;
+      ++R.NumLines;
+      P = Eol + 1;
     }
+    R.End = P < End ? P : End;
   }
- 
+  return true;
+}
+
+// TYPEID [ADDR,] lines.
+static void
+ParseTypeIdSection(const SectionRange &R,
+                   std::unordered_map<uintptr_t, std::vector<uintptr_t>> &Map) {
+  Map.reserve(R.NumLines);
+  LineScanner Scan(R);
+  uintptr_t Key, V;
+  while (Scan.NextLine()) {
+    if (!Scan.NextHex(Key)) continue;
+    auto &Vec = Map[Key];
+    while (Scan.NextHex(V))
+      Vec.push_back(V);
+  }
+}
+
+static void ParseIndirCallSites(
+    const SectionRange &R,
+    std::unordered_map<uintptr_t, std::vector<uintptr_t>> &Map,
+    std::unordered_set<uintptr_t> &CallSites) {
+  ParseTypeIdSection(R, Map);
+  size_t Total = 0;
+  for (const auto &El : Map)
+    Total += El.second.size();
+  CallSites.reserve(Total);
+  for (const auto &El : Map)
+    CallSites.insert(El.second.begin(), El.second.end());
+}
+
+static void ParseDirCallSites(
+    const SectionRange &R,
+    std::unordered_map<uintptr_t,
+                       std::vector<std::tuple<uintptr_t, uintptr_t>>> &Map,
+    std::unordered_set<uintptr_t> &CallSites) {
+  Map.reserve(R.NumLines);
+  LineScanner Scan(R);
+  uintptr_t Caller, CallSite, Target;
+  size_t Total = 0;
+  while (Scan.NextLine()) {
+    if (!Scan.NextHex(Caller)) continue;
+    auto &Vec = Map[Caller];
+    while (Scan.NextHex(CallSite) && Scan.NextHex(Target))
+      Vec.emplace_back(CallSite, Target);
+    Total += Vec.size();
+  }
+  CallSites.reserve(Total);
+  for (const auto &El : Map)
+    for (const auto &Call : El.second)
+      CallSites.insert(std::get<0>(Call));
+}
+
+static void ParseFuncSymbols(const SectionRange &R,
+                             std::unordered_map<uintptr_t, std::string> &Map) {
+  Map.reserve(R.NumLines);
+  LineScanner Scan(R);
+  uintptr_t Addr;
+  std::string Name;
+  while (Scan.NextLine())
+    if (Scan.NextHex(Addr) && Scan.NextToken(Name))
+      Map[Addr] = Name;
+}
+
+void CallGraph::Parse(const char *Data, size_t Size) {
+  SectionRange Sections[kNumCGSections];
+  if (!FindSections(Data, Size, Sections))
+    return;
+
+  // Each section fills its own containers, so they are parsed in parallel.
+  std::vector<std::thread> Threads;
+  auto Spawn = [&](CGSection S, std::function<void(const SectionRange &)> F) {
+    if (Sections[S].Begin)
+      Threads.emplace_back(F, std::cref(Sections[S]));
+  };
+  Spawn(kIndirTargetTypes, [this](const SectionRange &R) {
+    ParseTypeIdSection(R, TypeIdToIndirTargets);
+  });
+  Spawn(kIndirCallTypes, [this](const SectionRange &R) {
+    ParseTypeIdSection(R, TypeIdToIndirCalls);
+  });
+  Spawn(kIndirCallSites, [this](const SectionRange &R) {
+    ParseIndirCallSites(R, FuncAddrToIndirCallSites, IndirCallSiteAddrs);
+  });
+  Spawn(kDirCallSites, [this](const SectionRange &R) {
+    ParseDirCallSites(R, FuncAddrToDirCallSites, DirCallSiteAddrs);
+  });
+  Spawn(kFuncSymbols, [this](const SectionRange &R) {
+    ParseFuncSymbols(R, FuncAddrToName);
+  });
+  for (auto &T : Threads)
+    T.join();
+
   // Set FuncNameToAddr
+  FuncNameToAddr.reserve(FuncAddrToName.size());
   for (auto &El : FuncAddrToName)
     FuncNameToAddr[El.second] = El.first;
 
   // Compute and set TargetToCallers (reverse call graph) from raw call graph.
   UpdateTargetToCallers();
+  Loaded = true;
 }
 
+// Whether the input is the binary itself rather than llvm-objdump output.
+static bool IsElf(const char *Data, size_t Size) {
+  return Size >= 4 && !memcmp(Data, "\x7f" "ELF", 4);
+}
+
+CallGraph::CallGraph(std::istream &In) {
+  auto Start = std::chrono::steady_clock::now();
+  std::string Data((std::istreambuf_iterator<char>(In)),
+                   std::istreambuf_iterator<char>());
+  if (!In.bad() && IsElf(Data.data(), Data.size()))
+    ParseElf(Data.data(), Data.size(), "the input");
+  else if (!In.bad())
+    Parse(Data.data(), Data.size());
+  LoadSeconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - Start).count();
+}
+
+CallGraph::CallGraph(const char *Path) {
+  auto Start = std::chrono::steady_clock::now();
+  int Fd = open(Path, O_RDONLY);
+  struct stat St;
+  if (Fd < 0 || fstat(Fd, &St)) {
+    if (Fd >= 0) close(Fd);
+    return;
+  }
+  size_t Size = St.st_size;
+  const char *Data = Size ? (const char *)mmap(nullptr, Size, PROT_READ,
+                                               MAP_PRIVATE, Fd, 0)
+                          : "";
+  close(Fd);
+  if (Data == MAP_FAILED)
+    return;
+  // The sections are read in parallel, ask for the whole file at once.
+  if (Size)
+    madvise((void *)Data, Size, MADV_WILLNEED);
+  if (IsElf(Data, Size))
+    ParseElf(Data, Size, Path);
+  else
+    Parse(Data, Size);
+  if (Size)
+    munmap((void *)Data, Size);
+  LoadSeconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - Start).count();
+}
 
-// Use type ids to recover { Target (FuncPc) : {WhoMightCall (FuncPc) : Where(CallSitePc)} }
+CallGraph::CallGraph(std::vector<std::pair<uint32_t, CallGraph>> &&Modules) {
+  Loaded = !Modules.empty();
+  for (auto &Module : Modules) {
+    uintptr_t Base = (uintptr_t)Module.first << CG_MODULE_SHIFT;
+    CallGraph &G = Module.second;
+    Loaded &= G.Loaded;
+    LoadSeconds += G.LoadSeconds;
+    auto Reloc = [Base](uintptr_t Addr) {
+      assert(!(Addr >> CG_MODULE_SHIFT) && "Address out of the module range.");
+      return Base | Addr;
+    };
+    auto RelocAll = [&Reloc](std::vector<uintptr_t> &Addrs) {
+      for (auto &Addr : Addrs)
+        Addr = Reloc(Addr);
+    };
+
+    // Type ids are the same across modules, so indirect calls can target
+    // functions of other modules.
+    for (auto &El : G.TypeIdToIndirTargets) {
+      RelocAll(El.second);
+      auto &Vec = TypeIdToIndirTargets[El.first];
+      Vec.insert(Vec.end(), El.second.begin(), El.second.end());
+    }
+    for (auto &El : G.TypeIdToIndirCalls) {
+      RelocAll(El.second);
+      auto &Vec = TypeIdToIndirCalls[El.first];
+      Vec.insert(Vec.end(), El.second.begin(), El.second.end());
+    }
+    for (auto &El : G.FuncAddrToIndirCallSites) {
+      RelocAll(El.second);
+      FuncAddrToIndirCallSites[Reloc(El.first)] = std::move(El.second);
+    }
+    for (auto &El : G.FuncAddrToDirCallSites) {
+      for (auto &Call : El.second)
+        Call = std::make_tuple(Reloc(std::get<0>(Call)),
+                               Reloc(std::get<1>(Call)));
+      FuncAddrToDirCallSites[Reloc(El.first)] = std::move(El.second);
+    }
+    for (auto Addr : G.DirCallSiteAddrs)
+      DirCallSiteAddrs.insert(Reloc(Addr));
+    for (auto Addr : G.IndirCallSiteAddrs)
+      IndirCallSiteAddrs.insert(Reloc(Addr));
+    for (auto &El : G.FuncAddrToName)
+      FuncAddrToName.emplace(Reloc(El.first), std::move(El.second));
+    G = CallGraph(); // Release the module's call graph.
+  }
+
+  // Names defined by several modules refer to the first one, as with the
+  // dynamic linker's symbol lookup.
+  FuncNameToAddr.reserve(FuncAddrToName.size());
+  for (auto &El : FuncAddrToName) {
+    auto It = FuncNameToAddr.emplace(El.second, El.first).first;
+    if (El.first < It->second)
+      It->second = El.first;
+  }
+
+  ResolvePltCalls();
+  UpdateTargetToCallers();
+}
+
+void CallGraph::ResolvePltCalls() {
+  static const char kPltSuffix[] = "@plt";
+  const size_t kPltSuffixLen = sizeof(kPltSuffix) - 1;
+  std::unordered_map<uintptr_t /* stub */, uintptr_t /* target */> Stubs;
+  for (const auto &El : FuncAddrToName) {
+    const std::string &Name = El.second;
+    if (Name.size() <= kPltSuffixLen ||
+        Name.compare(Name.size() - kPltSuffixLen, kPltSuffixLen, kPltSuffix))
+      continue;
+    auto It = FuncNameToAddr.find(Name.substr(0, Name.size() - kPltSuffixLen));
+    if (It != FuncNameToAddr.end())
+      Stubs[El.first] = It->second;
+  }
+  if (Stubs.empty())
+    return;
+  // The stub jumps to the function without a frame of its own, so the
+  // return address in the caller is the call site of the function.
+  for (auto &El : FuncAddrToDirCallSites)
+    for (auto &Call : El.second) {
+      auto It = Stubs.find(std::get<1>(Call));
+      if (It != Stubs.end())
+        std::get<1>(Call) = It->second;
+    }
+}
+
+// Use type ids to recover { TypeId : [WhoMightCall (FuncPc), Where (CallSitePc)] }
 std::unordered_map<uintptr_t, std::vector<CallSite>>
 CallGraph::GetIndirectCalls() {
-  auto Res = std::unordered_map<uintptr_t /* TargetFuncPc */, std::vector<CallSite> /* potential calls to it */>();
+  auto Res = std::unordered_map<uintptr_t /* TypeId */, std::vector<CallSite> /* potential calls to its targets */>();
 
   // Reverse TypeIdToIndirectCalls: mapping from indirect call site pc to type id
   std::unordered_map<uintptr_t, uintptr_t> ICallSitePcToTypeId;
+  ICallSitePcToTypeId.reserve(IndirCallSiteAddrs.size());
   for (const auto &El : TypeIdToIndirCalls) {
     const auto &TypeId = El.first;
     const auto &ICallSiteAddrs = El.second;
@@ -140,18 +413,10 @@ CallGraph::GetIndirectCalls() {
 
     for (const auto &ICallSiteAddr : ICallSiteAddrs) {
       // Only relevant indirect calls that appears in the stack trace.
-      if (ICallSitePcToTypeId.count(ICallSiteAddr)) {
-        const auto &TypeId = ICallSitePcToTypeId[ICallSiteAddr];
-
-        // Get the potential indirect targets.
-        const auto &PotentialTargets = TypeIdToIndirTargets[TypeId];
-
-        // FuncPc might call any one of PotentialTargets at ICallSitePc
-        for (const auto &PotentialTarget : PotentialTargets) {   
-          // { Target(FuncPc) : {WhereMightBeCalled(CallSitePc) : Who(FuncPc)} }       
-          Res[PotentialTarget].emplace_back(FuncAddr, ICallSiteAddr);
-        }
-      }
+      auto It = ICallSitePcToTypeId.find(ICallSiteAddr);
+      // FuncPc might call any one of the targets of the type at ICallSitePc
+      if (It != ICallSitePcToTypeId.end() && TypeIdToIndirTargets.count(It->second))
+        Res[It->second].emplace_back(FuncAddr, ICallSiteAddr);
     }
   }
 
@@ -160,9 +425,7 @@ CallGraph::GetIndirectCalls() {
 
 void CallGraph::UpdateTargetToCallers() {
   TargetsToCallers.clear();
-  
-  // Get mappings for indirect calls.
-  auto TargetsToCallers = GetIndirectCalls();
+  TargetsToCallers.reserve(FuncAddrToName.size());
 
   // Add mappings for direct calls.
   for (auto const &El : FuncAddrToDirCallSites) {
@@ -176,16 +439,14 @@ void CallGraph::UpdateTargetToCallers() {
     }
   }
 
-  // Set TargetsToCallers.
-  this->TargetsToCallers = TargetsToCallers;
+  // Get mappings for indirect calls, by type.
+  TypeIdToIndirCallers = GetIndirectCalls();
 }
 
 // Format: Target, CallSitePc, PotentialCaller
 void CallGraph::PrintReverseCG(std::ostream &Out, bool demangle) const {
-  for (auto const &TargetToCaller : TargetsToCallers) {
-    auto const &TargetFuncPc = TargetToCaller.first;
-    auto const &PotentialCallers = TargetToCaller.second;
-
+  auto PrintCalls = [&](uintptr_t TargetFuncPc,
+                        const std::vector<CallSite> &PotentialCallers) {
     for (auto const &Caller : PotentialCallers) {
       std::string TargetFuncStr = demangle && FuncAddrToName.count(TargetFuncPc)
                                   ? FuncAddrToName.find(TargetFuncPc)->second
@@ -196,7 +457,16 @@ void CallGraph::PrintReverseCG(std::ostream &Out, bool demangle) const {
       
       Out << CallerFuncStr << " calls " << TargetFuncStr << " at " << utohexstr(Caller.CallSitePc) << "\n";
     }
-  }
+  };
+
+  for (auto const &TargetToCaller : TargetsToCallers)
+    PrintCalls(TargetToCaller.first, TargetToCaller.second);
+
+  // Expand the indirect calls of each type to each of its targets.
+  for (auto const &TypeToCallers : TypeIdToIndirCallers)
+    for (auto const &TargetFuncPc :
+         TypeIdToIndirTargets.find(TypeToCallers.first)->second)
+      PrintCalls(TargetFuncPc, TypeToCallers.second);
 }
 
 void CallGraph::Print(std::ostream &Out) const {
@@ -7,6 +7,13 @@
 #include <vector>
 #include <tuple>
 #include <string>
+#include <utility>
+
+// Addresses in a call graph merged from several modules are encoded as
+// (module id << CG_MODULE_SHIFT | address in the module), as wrap2trace
+// encodes frames (see W2T_MODULE_SHIFT in wrap2trace/trace_format.hpp).
+// Module 0 is the executable, so its addresses are unchanged.
+#define CG_MODULE_SHIFT 48
 
 struct CallSite {
   uintptr_t CallerPc;
@@ -43,17 +50,51 @@ struct CallGraph {
 
   // Computed from raw info
   std::unordered_map<std::string, uintptr_t> FuncNameToAddr;
-  std::unordered_map<uintptr_t /* TargetFuncPc */, std::vector<CallSite> /* potential calls to it */ > TargetsToCallers;
+  std::unordered_map<uintptr_t /* TargetFuncPc */, std::vector<CallSite> /* direct calls to it */ > TargetsToCallers;
+
+  // Indirect calls by type: { TypeId: [CallSite,] }. Each one is a
+  // potential call to each target of the type, in TypeIdToIndirTargets;
+  // the pairs are not expanded, as there are as many as the targets times
+  // the call sites.
+  std::unordered_map<uintptr_t, std::vector<CallSite>> TypeIdToIndirCallers;
+
+  // Whether the call graph was read successfully.
+  bool Loaded = false;
+
+  // Time taken to read the call graph and build the reverse call graph.
+  double LoadSeconds = 0;
 
   private:
+    CallGraph() = default;
+
     void UpdateTargetToCallers();    
 
-    std::unordered_map<uintptr_t /* TargetFuncPc */, std::vector<CallSite>> GetIndirectCalls();
+    // Redirect direct calls to PLT stubs ("NAME@plt") to the function NAME,
+    // looked up in the modules in order.
+    void ResolvePltCalls();
+
+    std::unordered_map<uintptr_t /* TypeId */, std::vector<CallSite>> GetIndirectCalls();
+
+    // Parse llvm-objdump output held in memory.
+    void Parse(const char *Data, size_t Size);
+
+    // Read the call graph section and the symbols of an ELF binary held in
+    // memory (see cg_elf.cpp). Name is used in messages.
+    void ParseElf(const char *Data, size_t Size, const char *Name);
 
   public:
     // Read from llvm-objdump output
     CallGraph(std::istream &In);
 
+    // Read from a file mapped in memory: either llvm-objdump output, or the
+    // ELF binary itself.
+    CallGraph(const char *Path);
+
+    // Merge the call graphs of several modules, given with their module ids
+    // in load order (the executable first). Calls across modules through
+    // the PLT become calls to the function in the module defining it.
+    CallGraph(std::vector<std::pair<uint32_t, CallGraph>> &&Modules);
+
     void Print(std::ostream &Out) const;
 
     void PrintReverseCG(std::ostream &Out, bool demagle) const;
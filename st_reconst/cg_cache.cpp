@@ -0,0 +1,697 @@
+#include "cg_cache.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+static_assert(sizeof(CallerEdge) == 16, "CallerEdge is stored as is");
+static_assert(sizeof(FuncReach) == 8, "FuncReach is stored as is");
+static_assert(sizeof(CGCacheHeader) % 8 == 0, "Arrays are 8-byte aligned");
+
+// Appends arrays to an image of the cache file, each padded to 8 bytes.
+class ImageWriter {
+  std::vector<uint64_t> &Buf;
+  size_t Bytes = 0;
+
+public:
+  ImageWriter(std::vector<uint64_t> &Buf) : Buf(Buf) { Buf.clear(); }
+
+  template <typename T> void Append(const T *Data, size_t N) {
+    size_t Size = N * sizeof(T);
+    Buf.resize(Buf.size() + (Size + 7) / 8);
+    if (Size)
+      memcpy((char *)Buf.data() + Bytes, Data, Size);
+    Bytes = Buf.size() * 8;
+  }
+
+  template <typename T> void Append(const std::vector<T> &V) {
+    Append(V.data(), V.size());
+  }
+};
+
+// Reads the arrays of an image of the cache file, checking the bounds.
+class ImageReader {
+  const char *Data;
+  size_t Size;
+  size_t Off = 0;
+
+public:
+  ImageReader(const void *Data, size_t Size)
+    : Data((const char *)Data), Size(Size) {}
+
+  template <typename T> bool Read(FlatArray<T> &A, uint64_t N) {
+    uint64_t Bytes = N * sizeof(T);
+    if (N > Size / sizeof(T) || Bytes > Size - Off)
+      return false;
+    A.Data = (const T *)(Data + Off);
+    A.Size = N;
+    Off += (Bytes + 7) & ~(uint64_t)7;
+    Off = Off < Size ? Off : Size;
+    return true;
+  }
+};
+
+// Sorted keys and CSR arrays of a { Key: [Value,] } map.
+static void
+FlattenMap(const std::unordered_map<uintptr_t, std::vector<uintptr_t>> &Map,
+           std::vector<uint64_t> &Keys, std::vector<uint64_t> &Offsets,
+           std::vector<uint64_t> &Values) {
+  Keys.clear();
+  for (const auto &El : Map)
+    Keys.push_back(El.first);
+  std::sort(Keys.begin(), Keys.end());
+  Offsets.assign(1, 0);
+  Values.clear();
+  for (uint64_t Key : Keys) {
+    const auto &V = Map.find(Key)->second;
+    Values.insert(Values.end(), V.begin(), V.end());
+    Offsets.push_back(Values.size());
+  }
+}
+
+// Order of the callers of a function.
+static bool EdgeLess(const CallerEdge &A, const CallerEdge &B) {
+  return A.CallSitePc < B.CallSitePc ||
+         (A.CallSitePc == B.CallSitePc && A.CallerId < B.CallerId);
+}
+
+// Lay out the sorted Keys as an implicit binary tree, in breadth-first
+// order from index 1 (see FlatCallGraph::FuncIndex). Ids holds the index of
+// each key in Keys, and Ids[0] the number of keys.
+static void BuildEytzinger(const std::vector<uint64_t> &Keys,
+                           std::vector<uint64_t> &Tree,
+                           std::vector<uint32_t> &Ids) {
+  size_t N = Keys.size(), I = 0;
+  Tree[0] = 0;
+  Ids[0] = N;
+  // In-order traversal of the tree, without recursion.
+  size_t K = 1;
+  while (I < N) {
+    while (K <= N)
+      K *= 2;
+    // K is past a leaf: go up while coming from a right child.
+    K >>= __builtin_ffsll(~K);
+    Tree[K] = Keys[I];
+    Ids[K] = I++;
+    K = 2 * K + 1;
+  }
+}
+
+// Saturating length of a path one edge longer than one of length Len.
+static uint32_t Longer(uint32_t Len) {
+  const uint32_t kUnbounded = FuncReach::kUnbounded;
+  return Len < kUnbounded ? Len + 1 : kUnbounded;
+}
+
+// Depth summaries of the functions (see FuncReach). The type classes are
+// nodes of the graph too, between a function and the callers of its types:
+// the edges to a class are not calls, and don't add to the lengths, so the
+// indirect calls are not expanded. Shortest paths to the roots are found
+// with a breadth-first search from the roots, down the call graph. Longest
+// paths are computed on the strongly connected components, found with
+// Tarjan's algorithm, which completes a component after all the components
+// it reaches: their longest paths are known.
+static void ComputeReach(const std::vector<FuncNode> &Nodes,
+                         const std::vector<TypeClass> &Classes,
+                         const std::vector<uint32_t> &FuncClasses,
+                         const std::vector<CallerEdge> &Callers,
+                         const std::vector<bool> &IsRoot,
+                         std::vector<FuncReach> &Reach) {
+  const uint32_t kNone = UINT32_MAX;
+  size_t N = Nodes.size(), M = N + Classes.size();
+  Reach.assign(N, FuncReach{FuncReach::kUnbounded, 0, 0, 0});
+
+  // Edges of the graph (CSR), from a function to its callers and classes
+  // (N + class), and from a class to its callers. Only the edges to
+  // functions are calls.
+  std::vector<uint32_t> EdgeOffsets(M + 1, 0), Edges;
+  Edges.reserve(Callers.size() + FuncClasses.size());
+  for (uint32_t V = 0; V < M; V++) {
+    uint32_t First = V < N ? Nodes[V].FirstCaller : Classes[V - N].FirstCaller;
+    uint32_t Num = V < N ? Nodes[V].NumCallers : Classes[V - N].NumCallers;
+    for (uint32_t I = First; I < First + Num; I++)
+      Edges.push_back(Callers[I].CallerId);
+    if (V < N)
+      for (uint32_t I = 0; I < Nodes[V].NumClasses; I++)
+        Edges.push_back(N + FuncClasses[Nodes[V].FirstClass + I]);
+    EdgeOffsets[V + 1] = Edges.size();
+  }
+  auto IsCall = [N](uint32_t U) { return U < N; };
+
+  // Reverse edges (CSR), for the breadth-first search.
+  std::vector<uint32_t> RevOffsets(M + 1, 0), RevEdges(Edges.size());
+  for (uint32_t U : Edges)
+    RevOffsets[U + 1]++;
+  for (size_t I = 0; I < M; I++)
+    RevOffsets[I + 1] += RevOffsets[I];
+  {
+    std::vector<uint32_t> Pos(RevOffsets.begin(), RevOffsets.end() - 1);
+    for (uint32_t V = 0; V < M; V++)
+      for (uint32_t I = EdgeOffsets[V]; I < EdgeOffsets[V + 1]; I++)
+        RevEdges[Pos[Edges[I]]++] = V;
+  }
+  // Edges to a class have length 0: a 0-1 breadth-first search, which
+  // visits the functions of a class right after the class.
+  std::vector<uint32_t> Dist(M, kNone);
+  std::vector<bool> Done(M);
+  std::deque<uint32_t> Queue;
+  for (uint32_t V = 0; V < N; V++)
+    if (IsRoot[V]) {
+      Dist[V] = 0;
+      Queue.push_back(V);
+    }
+  while (!Queue.empty()) {
+    uint32_t U = Queue.front();
+    Queue.pop_front();
+    if (Done[U])
+      continue;
+    Done[U] = true;
+    uint32_t D = Dist[U] + IsCall(U);
+    for (uint32_t I = RevOffsets[U]; I < RevOffsets[U + 1]; I++) {
+      uint32_t V = RevEdges[I];
+      if (Dist[V] <= D)
+        continue;
+      Dist[V] = D;
+      if (IsCall(U))
+        Queue.push_back(V);
+      else
+        Queue.push_front(V);
+    }
+  }
+  for (uint32_t V = 0; V < N; V++)
+    Reach[V].MinRootDist =
+        std::min<uint32_t>(Dist[V], FuncReach::kUnbounded);
+
+  // Tarjan's algorithm, iterative, on the edges above.
+  std::vector<uint32_t> Index(M, kNone), Low(M), Comp(M, kNone);
+  std::vector<uint32_t> Stack, Members;
+  std::vector<std::pair<uint32_t, uint32_t>> Path; // (node, next edge)
+  // Longest paths of the completed components; kNone if no root reached.
+  std::vector<uint32_t> MaxRoot, MaxWalk;
+  uint32_t NextIndex = 0;
+  for (uint32_t Start = 0; Start < M; Start++) {
+    if (Index[Start] != kNone)
+      continue;
+    Path.push_back({Start, EdgeOffsets[Start]});
+    Index[Start] = Low[Start] = NextIndex++;
+    Stack.push_back(Start);
+    while (!Path.empty()) {
+      uint32_t V = Path.back().first;
+      uint32_t &Next = Path.back().second;
+      if (Next < EdgeOffsets[V + 1]) {
+        uint32_t U = Edges[Next++];
+        if (Index[U] == kNone) {
+          Index[U] = Low[U] = NextIndex++;
+          Stack.push_back(U);
+          Path.push_back({U, EdgeOffsets[U]});
+        } else if (Comp[U] == kNone) {
+          Low[V] = std::min(Low[V], Index[U]); // On the stack.
+        }
+        continue;
+      }
+      Path.pop_back();
+      if (!Path.empty())
+        Low[Path.back().first] = std::min(Low[Path.back().first], Low[V]);
+      if (Low[V] != Index[V])
+        continue;
+
+      // V is the first node of a component: complete it. A cycle has at
+      // least one call, as classes only lead to calls.
+      uint32_t C = MaxRoot.size();
+      Members.clear();
+      do {
+        Members.push_back(Stack.back());
+        Comp[Stack.back()] = C;
+        Stack.pop_back();
+      } while (Members.back() != V);
+      bool Cyclic = Members.size() > 1;
+      uint32_t CMaxRoot = kNone, CMaxWalk = 0;
+      for (uint32_t W : Members) {
+        if (W < N && IsRoot[W])
+          CMaxRoot = 0;
+        for (uint32_t I = EdgeOffsets[W]; I < EdgeOffsets[W + 1]; I++) {
+          uint32_t U = Edges[I], D = Comp[U];
+          if (D == C) {
+            Cyclic = true;
+            continue;
+          }
+          CMaxWalk = std::max(CMaxWalk,
+                              IsCall(U) ? Longer(MaxWalk[D]) : MaxWalk[D]);
+          if (MaxRoot[D] != kNone)
+            CMaxRoot = std::max(CMaxRoot == kNone ? 0 : CMaxRoot,
+                                IsCall(U) ? Longer(MaxRoot[D]) : MaxRoot[D]);
+        }
+      }
+      if (Cyclic) {
+        CMaxWalk = FuncReach::kUnbounded;
+        if (CMaxRoot != kNone)
+          CMaxRoot = FuncReach::kUnbounded;
+      }
+      MaxRoot.push_back(CMaxRoot);
+      MaxWalk.push_back(CMaxWalk);
+      for (uint32_t W : Members) {
+        if (W >= N)
+          continue;
+        Reach[W].MaxWalk = CMaxWalk;
+        Reach[W].MaxRootDist = CMaxRoot == kNone ? 0 : CMaxRoot;
+      }
+    }
+  }
+}
+
+static std::vector<uint64_t>
+SortedSet(const std::unordered_set<uintptr_t> &Set) {
+  std::vector<uint64_t> Res(Set.begin(), Set.end());
+  std::sort(Res.begin(), Res.end());
+  return Res;
+}
+
+void FlatCallGraph::Build(const CallGraph &CG, uint64_t DumpHash,
+                          uint64_t DumpSize) {
+  // Functions: the ones with a symbol, and the ones seen in calls.
+  std::vector<uint64_t> Funcs;
+  Funcs.reserve(CG.FuncAddrToName.size() + CG.TargetsToCallers.size());
+  for (const auto &El : CG.FuncAddrToName)
+    Funcs.push_back(El.first);
+  for (const auto &El : CG.TargetsToCallers) {
+    Funcs.push_back(El.first);
+    for (const auto &Caller : El.second)
+      Funcs.push_back(Caller.CallerPc);
+  }
+  for (const auto &El : CG.TypeIdToIndirTargets)
+    Funcs.insert(Funcs.end(), El.second.begin(), El.second.end());
+  for (const auto &El : CG.TypeIdToIndirCallers)
+    for (const auto &Caller : El.second)
+      Funcs.push_back(Caller.CallerPc);
+  std::sort(Funcs.begin(), Funcs.end());
+  Funcs.erase(std::unique(Funcs.begin(), Funcs.end()), Funcs.end());
+
+  std::vector<uint32_t> NameOffsets;
+  std::vector<char> Names;
+  assert(Funcs.size() < kNoFunc && "Too many functions for 32-bit ids.");
+  auto IdOf = [&Funcs](uintptr_t Pc) {
+    return (uint32_t)(std::lower_bound(Funcs.begin(), Funcs.end(), Pc) -
+                      Funcs.begin());
+  };
+
+  // Type classes: the indirect call types with callers, by type id, and
+  // the (function, class) pairs of their targets.
+  std::vector<uint64_t> ClassTypeIds;
+  for (const auto &El : CG.TypeIdToIndirCallers)
+    ClassTypeIds.push_back(El.first);
+  std::sort(ClassTypeIds.begin(), ClassTypeIds.end());
+  std::vector<std::pair<uint32_t, uint32_t>> Members;
+  for (uint32_t C = 0; C < ClassTypeIds.size(); C++)
+    for (uintptr_t Target : CG.TypeIdToIndirTargets.at(ClassTypeIds[C]))
+      Members.push_back({IdOf(Target), C});
+  std::sort(Members.begin(), Members.end());
+  Members.erase(std::unique(Members.begin(), Members.end()), Members.end());
+
+  std::vector<FuncNode> Nodes;
+  std::vector<CallerEdge> Callers;
+  std::vector<uint32_t> FuncClasses;
+  NameOffsets.reserve(Funcs.size());
+  Nodes.reserve(Funcs.size());
+  FuncClasses.reserve(Members.size());
+  auto Member = Members.begin();
+  for (uint64_t Pc : Funcs) {
+    auto Name = CG.FuncAddrToName.find(Pc);
+    if (Name != CG.FuncAddrToName.end()) {
+      NameOffsets.push_back(Names.size());
+      Names.insert(Names.end(), Name->second.begin(), Name->second.end());
+      Names.push_back('\0');
+    } else {
+      NameOffsets.push_back(kNoName);
+    }
+    // Callers are sorted by call site, so that an edge is found with a
+    // binary search (see ValidateStackTrace). The search finds the same
+    // stack traces in any order.
+    FuncNode Node = {(uint32_t)Callers.size(), 0,
+                     (uint32_t)FuncClasses.size(), 0};
+    auto It = CG.TargetsToCallers.find(Pc);
+    if (It != CG.TargetsToCallers.end())
+      for (const auto &Caller : It->second)
+        Callers.push_back({Caller.CallSitePc, IdOf(Caller.CallerPc), 0});
+    Node.NumCallers = Callers.size() - Node.FirstCaller;
+    std::sort(Callers.begin() + Node.FirstCaller, Callers.end(), EdgeLess);
+    for (; Member != Members.end() && Member->first == Nodes.size(); ++Member)
+      FuncClasses.push_back(Member->second);
+    Node.NumClasses = FuncClasses.size() - Node.FirstClass;
+    Nodes.push_back(Node);
+  }
+  std::vector<TypeClass> Classes;
+  Classes.reserve(ClassTypeIds.size());
+  for (uint64_t TypeId : ClassTypeIds) {
+    TypeClass Class = {(uint32_t)Callers.size(), 0};
+    for (const auto &Caller : CG.TypeIdToIndirCallers.at(TypeId))
+      Callers.push_back({Caller.CallSitePc, IdOf(Caller.CallerPc), 0});
+    Class.NumCallers = Callers.size() - Class.FirstCaller;
+    std::sort(Callers.begin() + Class.FirstCaller, Callers.end(), EdgeLess);
+    Classes.push_back(Class);
+  }
+  assert(Callers.size() <= UINT32_MAX && "Too many edges for 32-bit offsets.");
+
+  // Roots: see FuncReach.
+  std::vector<bool> IsRoot(Funcs.size());
+  for (size_t I = 0; I < Funcs.size(); I++)
+    IsRoot[I] = !Nodes[I].NumCallers ||
+                (NameOffsets[I] != kNoName &&
+                 !strcmp(&Names[NameOffsets[I]], "main"));
+  for (const auto &El : CG.TypeIdToIndirTargets)
+    for (uintptr_t Target : El.second)
+      IsRoot[IdOf(Target)] = true;
+  std::vector<FuncReach> Reach;
+  ComputeReach(Nodes, Classes, FuncClasses, Callers, IsRoot, Reach);
+
+  std::vector<uint64_t> FuncIndex(Funcs.size() + 1);
+  std::vector<uint32_t> FuncIndexIds(Funcs.size() + 1);
+  BuildEytzinger(Funcs, FuncIndex, FuncIndexIds);
+
+  std::vector<uint64_t> TargetTypeIds, TargetTypeOffsets, TargetTypeFuncs;
+  FlattenMap(CG.TypeIdToIndirTargets, TargetTypeIds, TargetTypeOffsets,
+             TargetTypeFuncs);
+  std::vector<uint64_t> CallTypeIds, CallTypeOffsets, CallTypeSites;
+  FlattenMap(CG.TypeIdToIndirCalls, CallTypeIds, CallTypeOffsets,
+             CallTypeSites);
+  std::vector<uint64_t> DirCallSites = SortedSet(CG.DirCallSiteAddrs);
+  std::vector<uint64_t> IndirCallSites = SortedSet(CG.IndirCallSiteAddrs);
+
+  CGCacheHeader H = {};
+  memcpy(H.Magic, CG_CACHE_MAGIC, sizeof(H.Magic));
+  H.Version = CG_CACHE_VERSION;
+  H.DumpHash = DumpHash;
+  H.DumpSize = DumpSize;
+  H.NumFuncs = Funcs.size();
+  H.NumCallers = Callers.size();
+  H.NumClasses = Classes.size();
+  H.NumFuncClasses = FuncClasses.size();
+  H.NumTargetTypes = TargetTypeIds.size();
+  H.NumTargetTypeFuncs = TargetTypeFuncs.size();
+  H.NumCallTypes = CallTypeIds.size();
+  H.NumCallTypeSites = CallTypeSites.size();
+  H.NumDirCallSites = DirCallSites.size();
+  H.NumIndirCallSites = IndirCallSites.size();
+  H.NamesSize = Names.size();
+
+  ImageWriter W(Owned);
+  W.Append(&H, 1);
+  W.Append(Funcs);
+  W.Append(NameOffsets);
+  W.Append(FuncIndex);
+  W.Append(FuncIndexIds);
+  W.Append(Nodes);
+  W.Append(Reach);
+  W.Append(Callers);
+  W.Append(Classes);
+  W.Append(FuncClasses);
+  W.Append(TargetTypeIds);
+  W.Append(TargetTypeOffsets);
+  W.Append(TargetTypeFuncs);
+  W.Append(CallTypeIds);
+  W.Append(CallTypeOffsets);
+  W.Append(CallTypeSites);
+  W.Append(DirCallSites);
+  W.Append(IndirCallSites);
+  W.Append(Names);
+  bool Ok = Attach(Owned.data(), Owned.size() * sizeof(uint64_t));
+  (void)Ok;
+  assert(Ok && "Malformed call graph image.");
+  FromCache = false;
+}
+
+bool FlatCallGraph::Attach(const void *Image, size_t Size) {
+  if (Size < sizeof(CGCacheHeader))
+    return false;
+  const CGCacheHeader &H = *(const CGCacheHeader *)Image;
+  if (memcmp(H.Magic, CG_CACHE_MAGIC, sizeof(H.Magic)) ||
+      H.Version != CG_CACHE_VERSION)
+    return false;
+  ImageReader R(Image, Size);
+  FlatArray<CGCacheHeader> Header;
+  if (!R.Read(Header, 1) ||
+      !R.Read(FuncPcs, H.NumFuncs) ||
+      !R.Read(NameOffsets, H.NumFuncs) ||
+      !R.Read(FuncIndex, H.NumFuncs + 1) ||
+      !R.Read(FuncIndexIds, H.NumFuncs + 1) ||
+      !R.Read(Nodes, H.NumFuncs) ||
+      !R.Read(Reach, H.NumFuncs) ||
+      !R.Read(Callers, H.NumCallers) ||
+      !R.Read(Classes, H.NumClasses) ||
+      !R.Read(FuncClasses, H.NumFuncClasses) ||
+      !R.Read(TargetTypeIds, H.NumTargetTypes) ||
+      !R.Read(TargetTypeOffsets, H.NumTargetTypes + 1) ||
+      !R.Read(TargetTypeFuncs, H.NumTargetTypeFuncs) ||
+      !R.Read(CallTypeIds, H.NumCallTypes) ||
+      !R.Read(CallTypeOffsets, H.NumCallTypes + 1) ||
+      !R.Read(CallTypeSites, H.NumCallTypeSites) ||
+      !R.Read(DirCallSites, H.NumDirCallSites) ||
+      !R.Read(IndirCallSites, H.NumIndirCallSites) ||
+      !R.Read(Names, H.NamesSize))
+    return false;
+  // The offsets are used without checks afterwards. Nodes and edges are
+  // not checked one by one, which would take as long as building them.
+  if (TargetTypeOffsets[H.NumTargetTypes] != H.NumTargetTypeFuncs ||
+      CallTypeOffsets[H.NumCallTypes] != H.NumCallTypeSites ||
+      FuncIndexIds[0] != H.NumFuncs ||
+      (H.NamesSize && Names[H.NamesSize - 1]))
+    return false;
+  return true;
+}
+
+bool FlatCallGraph::Map(const char *Path, uint64_t DumpHash,
+                        uint64_t DumpSize) {
+  int Fd = open(Path, O_RDONLY);
+  struct stat St;
+  if (Fd < 0 || fstat(Fd, &St) ||
+      (size_t)St.st_size < sizeof(CGCacheHeader)) {
+    if (Fd >= 0) close(Fd);
+    return false;
+  }
+  size_t Size = St.st_size;
+  void *Data = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+  close(Fd);
+  if (Data == MAP_FAILED)
+    return false;
+  const CGCacheHeader &H = *(const CGCacheHeader *)Data;
+  if (H.DumpHash != DumpHash || H.DumpSize != DumpSize ||
+      !Attach(Data, Size)) {
+    munmap(Data, Size);
+    return false;
+  }
+  if (Mapping)
+    munmap((void *)Mapping, MappingSize);
+  Mapping = Data;
+  MappingSize = Size;
+  Owned.clear();
+  FromCache = true;
+  return true;
+}
+
+bool FlatCallGraph::Write(const char *Path) const {
+  const char *Image = (const char *)(Mapping ? Mapping : Owned.data());
+  size_t Size = Mapping ? MappingSize : Owned.size() * sizeof(uint64_t);
+  return WriteFileAtomically(Path, Image, Size);
+}
+
+uint64_t FlatCallGraph::Fingerprint() const {
+  const char *Image = (const char *)(Mapping ? Mapping : Owned.data());
+  size_t Size = Mapping ? MappingSize : Owned.size() * sizeof(uint64_t);
+  // The same graph, whether built or mapped, from whichever dump.
+  CGCacheHeader H = *(const CGCacheHeader *)Image;
+  H.DumpHash = H.DumpSize = 0;
+  uint64_t Keys[] = {HashDump((const char *)&H, sizeof(H)),
+                     HashDump(Image + sizeof(H), Size - sizeof(H))};
+  return HashDump((const char *)Keys, sizeof(Keys));
+}
+
+bool WriteFileAtomically(const char *Path, const void *Data, size_t Size) {
+  // Write to a temporary file first, so that concurrent runs never map a
+  // partially written file.
+  std::string Tmp = std::string(Path) + ".tmp." + std::to_string(getpid());
+  int Fd = open(Tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (Fd < 0)
+    return false;
+  for (size_t Off = 0; Off < Size;) {
+    ssize_t N = write(Fd, (const char *)Data + Off, Size - Off);
+    if (N <= 0) {
+      close(Fd);
+      unlink(Tmp.c_str());
+      return false;
+    }
+    Off += N;
+  }
+  if (close(Fd) || rename(Tmp.c_str(), Path)) {
+    unlink(Tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+FlatCallGraph::~FlatCallGraph() {
+  if (Mapping)
+    munmap((void *)Mapping, MappingSize);
+}
+
+uint32_t FlatCallGraph::FindFunc(uintptr_t Pc) const {
+  uint32_t Id = FindFuncContaining(Pc);
+  return Id != kNoFunc && FuncPcs[Id] == Pc ? Id : kNoFunc;
+}
+
+std::string FlatCallGraph::Symbolize(uintptr_t Pc) const {
+  char Buf[64];
+  uint32_t Id = FindFuncContaining(Pc);
+  if (Id == kNoFunc) {
+    snprintf(Buf, sizeof(Buf), "0x%lx", (unsigned long)Pc);
+    return Buf;
+  }
+  snprintf(Buf, sizeof(Buf), "+0x%lx", (unsigned long)(Pc - FuncPcs[Id]));
+  if (NameOffsets[Id] != kNoName)
+    return &Names[NameOffsets[Id]] + std::string(Buf);
+  char Start[32];
+  snprintf(Start, sizeof(Start), "0x%lx", (unsigned long)FuncPcs[Id]);
+  return Start + std::string(Buf);
+}
+
+bool FlatCallGraph::IsCaller(uint32_t Func, const CallerEdge &Edge) const {
+  // Each list of callers is sorted: the direct ones, and those of each
+  // type class.
+  const FuncNode &Node = Nodes[Func];
+  const CallerEdge *First = Callers.Data + Node.FirstCaller;
+  if (std::binary_search(First, First + Node.NumCallers, Edge, EdgeLess))
+    return true;
+  for (uint32_t I = 0; I < Node.NumClasses; I++) {
+    const TypeClass &C = Classes[FuncClasses[Node.FirstClass + I]];
+    First = Callers.Data + C.FirstCaller;
+    if (std::binary_search(First, First + C.NumCallers, Edge, EdgeLess))
+      return true;
+  }
+  return false;
+}
+
+size_t FlatCallGraph::ValidateStackTrace(uint32_t Func, const uintptr_t *ST,
+                                         size_t Size) const {
+  for (size_t I = 0; I < Size; I++) {
+    uint32_t Caller = ST[I] ? FindFuncContaining(ST[I] - 1) : kNoFunc;
+    if (Func == kNoFunc || Caller == kNoFunc)
+      return I;
+    if (!IsCaller(Func, {ST[I], Caller, 0}))
+      return I;
+    Func = Caller;
+  }
+  return Size;
+}
+
+uint32_t FlatCallGraph::FindFuncByName(const std::string &Name) const {
+  // Only done once per function of the stack traces.
+  for (size_t I = 0; I < FuncPcs.Size; I++)
+    if (NameOffsets[I] != kNoName && Name == &Names[NameOffsets[I]])
+      return I;
+  return kNoFunc;
+}
+
+bool FlatCallGraph::IsDirCallSite(uintptr_t Pc) const {
+  return std::binary_search(DirCallSites.begin(), DirCallSites.end(), Pc);
+}
+
+bool FlatCallGraph::IsIndirCallSite(uintptr_t Pc) const {
+  return std::binary_search(IndirCallSites.begin(), IndirCallSites.end(), Pc);
+}
+
+uint64_t HashDump(const char *Data, size_t Size) {
+  // Two CRC32 lanes, as for the stack trace hash (see common/st_hash.hpp).
+  uint64_t Lo = Size, Hi = ~(uint64_t)Size;
+  size_t I = 0;
+  for (; I + 8 <= Size; I += 8) {
+    uint64_t W;
+    memcpy(&W, Data + I, sizeof(W));
+    Lo = __builtin_ia32_crc32di(Lo, W);
+    Hi = __builtin_ia32_crc32di(Hi, W * 0x9e3779b97f4a7c15ULL);
+  }
+  uint64_t Tail = 0;
+  memcpy(&Tail, Data + I, Size - I);
+  Lo = __builtin_ia32_crc32di(Lo, Tail);
+  Hi = __builtin_ia32_crc32di(Hi, Tail * 0x9e3779b97f4a7c15ULL);
+  return (Hi << 32) | Lo;
+}
+
+// Hash of the file at Path; false if it can't be read.
+static bool HashFile(const char *Path, uint64_t &Hash, uint64_t &Size) {
+  int Fd = open(Path, O_RDONLY);
+  struct stat St;
+  if (Fd < 0 || fstat(Fd, &St)) {
+    if (Fd >= 0) close(Fd);
+    return false;
+  }
+  Size = St.st_size;
+  const char *Data = Size ? (const char *)mmap(nullptr, Size, PROT_READ,
+                                               MAP_PRIVATE, Fd, 0)
+                          : "";
+  close(Fd);
+  if (Data == MAP_FAILED)
+    return false;
+  Hash = HashDump(Data, Size);
+  if (Size)
+    munmap((void *)Data, Size);
+  return true;
+}
+
+bool LoadCallGraph(const std::vector<ModuleSource> &Modules,
+                   const char *CachePath, FlatCallGraph &Res) {
+  bool Single = Modules.size() == 1 && !Modules[0].Id;
+  uint64_t Hash = 0, Size = 0;
+  if (CachePath) {
+    // The key of several modules is the hash of their ids, hashes and sizes.
+    std::vector<uint64_t> Keys;
+    for (const auto &M : Modules) {
+      uint64_t H, S;
+      if (!HashFile(M.Path.c_str(), H, S))
+        return false;
+      Keys.insert(Keys.end(), {M.Id, H, S});
+      Size += S;
+    }
+    Hash = Single ? Keys[1]
+                  : HashDump((const char *)Keys.data(),
+                             Keys.size() * sizeof(uint64_t));
+    if (Res.Map(CachePath, Hash, Size))
+      return true;
+  }
+
+  std::unique_ptr<CallGraph> CG;
+  if (Single) {
+    CG.reset(new CallGraph(Modules[0].Path.c_str()));
+  } else {
+    std::vector<std::pair<uint32_t, CallGraph>> Graphs;
+    for (const auto &M : Modules) {
+      Graphs.emplace_back(M.Id, CallGraph(M.Path.c_str()));
+      if (!Graphs.back().second.Loaded) {
+        fprintf(stderr, "Error: can't read the call graph of module %u "
+                        "from \"%s\".\n", M.Id, M.Path.c_str());
+        return false;
+      }
+    }
+    CG.reset(new CallGraph(std::move(Graphs)));
+  }
+  if (!CG->Loaded)
+    return false;
+  Res.Build(*CG, Hash, Size);
+  if (CachePath && !Res.Write(CachePath))
+    fprintf(stderr, "WARNING: can't write the call graph cache \"%s\".\n",
+            CachePath);
+  return true;
+}
+
+bool LoadCallGraph(const char *DumpPath, const char *CachePath,
+                   FlatCallGraph &Res) {
+  return LoadCallGraph({{0, DumpPath}}, CachePath, Res);
+}
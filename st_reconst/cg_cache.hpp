@@ -0,0 +1,297 @@
+// Flat form of the reverse call graph, and its on-disk cache.
+//
+// Parsing the llvm-objdump output and building the reverse call graph
+// takes seconds for large binaries. FlatCallGraph holds the result in a
+// few flat arrays, laid out exactly as in the cache file, so that a later
+// run maps the file and uses the arrays in place, with no parsing:
+//
+//   CGCacheHeader
+//   FuncPcs[NumFuncs]            u64, sorted; callers and targets included
+//   NameOffsets[NumFuncs]        u32, into Names; kNoName if no symbol
+//   FuncIndex[NumFuncs + 1]      u64, FuncPcs in Eytzinger order, from 1
+//   FuncIndexIds[NumFuncs + 1]   u32, function id of each FuncIndex entry
+//   Nodes[NumFuncs]              FuncNode, callers of each function
+//   Reach[NumFuncs]              FuncReach, depth summaries of each function
+//   Callers[NumCallers]          CallerEdge, direct calls to each function,
+//                                then indirect calls of each type class,
+//                                sorted by call site
+//   Classes[NumClasses]          TypeClass, indirect calls of each type
+//   FuncClasses[NumFuncClasses]  u32, type classes of each function
+//   TargetTypeIds[NumTargetTypes], TargetTypeOffsets[NumTargetTypes + 1],
+//   TargetTypeFuncs[..]          type id -> indirect targets (CSR)
+//   CallTypeIds[NumCallTypes], CallTypeOffsets[NumCallTypes + 1],
+//   CallTypeSites[..]            type id -> indirect call sites (CSR)
+//   DirCallSites[NumDirCallSites]     u64, sorted
+//   IndirCallSites[NumIndirCallSites] u64, sorted
+//   Names[NamesSize]             NUL-terminated function names
+//
+// Functions are identified by dense 32-bit ids, their index in FuncPcs, so
+// that the search walks the reverse call graph from edge to node without
+// looking addresses up. The indirect calls of a type are potential calls
+// to each of its targets; they are stored once, in a type class that the
+// targets refer to, and expanded as the callers are iterated, so that the
+// graph is linear in the size of the call graph info, not in the targets
+// times the call sites of each type. Each array starts at a multiple of 8
+// bytes. The header records the hash and size of the llvm-objdump output
+// the graph was built from; the cache is rebuilt when they don't match.
+
+#ifndef __CG_CACHE_H__
+#define __CG_CACHE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cg.hpp"
+
+#define CG_CACHE_MAGIC "STCGCACH"
+#define CG_CACHE_VERSION 5
+
+struct CGCacheHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t Reserved;
+  uint64_t DumpHash;
+  uint64_t DumpSize;
+  uint64_t NumFuncs;
+  uint64_t NumCallers;
+  uint64_t NumClasses;
+  uint64_t NumFuncClasses;
+  uint64_t NumTargetTypes;
+  uint64_t NumTargetTypeFuncs;
+  uint64_t NumCallTypes;
+  uint64_t NumCallTypeSites;
+  uint64_t NumDirCallSites;
+  uint64_t NumIndirCallSites;
+  uint64_t NamesSize;
+};
+
+// Potential call of a function by function CallerId, at CallSitePc.
+struct CallerEdge {
+  uint64_t CallSitePc;
+  uint32_t CallerId;
+  uint32_t Reserved;
+};
+
+// The direct callers of a function are Callers[FirstCaller, FirstCaller +
+// NumCallers), and its indirect callers those of the type classes
+// FuncClasses[FirstClass, FirstClass + NumClasses).
+struct FuncNode {
+  uint32_t FirstCaller;
+  uint32_t NumCallers;
+  uint32_t FirstClass;
+  uint32_t NumClasses;
+};
+
+// Indirect calls of a type, Callers[FirstCaller, FirstCaller + NumCallers):
+// potential calls to each function of the type.
+struct TypeClass {
+  uint32_t FirstCaller;
+  uint32_t NumCallers;
+};
+
+// Lengths of the paths from a function up the reverse call graph, i.e.,
+// through its callers, callers of callers, and so on. Root functions are
+// where stack traces can end: main, the functions with no callers, and the
+// indirect call targets (e.g., thread entries and callbacks). Lengths are
+// computed on the condensation of the graph into strongly connected
+// components: a path through a cycle can be as long as needed, which is
+// kUnbounded. Lengths saturate at kUnbounded.
+struct FuncReach {
+  enum : uint16_t { kUnbounded = UINT16_MAX };
+  // Shortest and longest path to a root; MinRootDist > MaxRootDist if no
+  // root can be reached.
+  uint16_t MinRootDist;
+  uint16_t MaxRootDist;
+  // Longest path.
+  uint16_t MaxWalk;
+  uint16_t Reserved;
+};
+
+// Read-only view of an array in the flat call graph.
+template <typename T> struct FlatArray {
+  const T *Data = nullptr;
+  size_t Size = 0;
+
+  const T *begin() const { return Data; }
+  const T *end() const { return Data + Size; }
+  const T &operator[](size_t I) const { return Data[I]; }
+};
+
+struct FlatCallGraph {
+  // Name offset of the functions without a symbol.
+  enum : uint32_t { kNoName = UINT32_MAX };
+  // Id of functions not in the call graph.
+  enum : uint32_t { kNoFunc = UINT32_MAX };
+
+  FlatArray<uint64_t> FuncPcs;
+  FlatArray<uint32_t> NameOffsets;
+  // Function starts laid out as an implicit binary tree: the children of
+  // entry K are 2K and 2K + 1, so the first levels of the search share a
+  // few cache lines. FuncIndexIds[0] is NumFuncs.
+  FlatArray<uint64_t> FuncIndex;
+  FlatArray<uint32_t> FuncIndexIds;
+  FlatArray<FuncNode> Nodes;
+  FlatArray<FuncReach> Reach;
+  FlatArray<CallerEdge> Callers;
+  FlatArray<TypeClass> Classes;
+  FlatArray<uint32_t> FuncClasses;
+  FlatArray<uint64_t> TargetTypeIds, TargetTypeOffsets, TargetTypeFuncs;
+  FlatArray<uint64_t> CallTypeIds, CallTypeOffsets, CallTypeSites;
+  FlatArray<uint64_t> DirCallSites, IndirCallSites;
+  FlatArray<char> Names;
+
+  // Whether the graph was mapped from the cache file.
+  bool FromCache = false;
+
+  FlatCallGraph() = default;
+  FlatCallGraph(const FlatCallGraph &) = delete;
+  FlatCallGraph &operator=(const FlatCallGraph &) = delete;
+  ~FlatCallGraph();
+
+  // Iterates the potential calls to a function: its direct callers, then
+  // the callers of each of its type classes, in place in Callers.
+  class CallerIterator {
+    const FlatCallGraph *CG = nullptr;
+    const CallerEdge *Cur = nullptr, *End = nullptr;
+    const uint32_t *Class = nullptr, *ClassEnd = nullptr;
+
+    // Move to the next non-empty list of callers, or to the end (null).
+    void Skip() {
+      while (Cur == End && Class != ClassEnd) {
+        const TypeClass &C = CG->Classes[*Class++];
+        Cur = CG->Callers.Data + C.FirstCaller;
+        End = Cur + C.NumCallers;
+      }
+      if (Cur == End)
+        Cur = End = nullptr;
+    }
+
+  public:
+    CallerIterator() = default;
+    CallerIterator(const FlatCallGraph &G, const FuncNode &Node)
+      : CG(&G), Cur(G.Callers.Data + Node.FirstCaller),
+        End(Cur + Node.NumCallers),
+        Class(G.FuncClasses.Data + Node.FirstClass),
+        ClassEnd(Class + Node.NumClasses) {
+      Skip();
+    }
+
+    const CallerEdge &operator*() const { return *Cur; }
+    const CallerEdge *operator->() const { return Cur; }
+    CallerIterator &operator++() {
+      ++Cur;
+      Skip();
+      return *this;
+    }
+    bool operator==(const CallerIterator &O) const { return Cur == O.Cur; }
+    bool operator!=(const CallerIterator &O) const { return Cur != O.Cur; }
+  };
+
+  struct CallerRange {
+    CallerIterator Begin, End;
+    CallerIterator begin() const { return Begin; }
+    CallerIterator end() const { return End; }
+  };
+
+  // Potential calls to function Id, i.e., its callers in the reverse call
+  // graph.
+  CallerRange GetCallers(uint32_t Id) const {
+    CallerRange Res;
+    if (Id != kNoFunc)
+      Res.Begin = CallerIterator(*this, Nodes[Id]);
+    return Res;
+  }
+
+  // Id of the function at Pc; kNoFunc if there is none.
+  uint32_t FindFunc(uintptr_t Pc) const;
+
+  // Id of the function containing Pc, i.e., the last one starting at or
+  // before Pc; kNoFunc if there is none. Pc of a call site is the return
+  // address, so use Pc - 1 for call sites, as the call might end the
+  // function.
+  uint32_t FindFuncContaining(uintptr_t Pc) const {
+    // Branchless descent to the first entry above Pc, prefetching the
+    // entries three levels down (eight per cache line).
+    size_t K = 1, N = FuncIndex.Size - 1;
+    while (K <= N) {
+      __builtin_prefetch(FuncIndex.Data + K * 8);
+      K = 2 * K + (FuncIndex[K] <= Pc);
+    }
+    // Undo the right turns taken after the last left turn.
+    K >>= __builtin_ffsll(~K);
+    uint32_t Above = FuncIndexIds[K];
+    return Above ? Above - 1 : kNoFunc;
+  }
+
+  // "NAME+0xOFFSET" for the function containing Pc, or "0xPC".
+  std::string Symbolize(uintptr_t Pc) const;
+
+  // Whether Edge is a potential call to Func.
+  bool IsCaller(uint32_t Func, const CallerEdge &Edge) const;
+
+  // Number of frames of the stack trace ST (call sites, innermost first) of
+  // a call to Func that match the call graph: the function containing each
+  // call site must be a potential caller of the previous function at that
+  // call site. The search can only find stack traces that match entirely.
+  size_t ValidateStackTrace(uint32_t Func, const uintptr_t *ST,
+                            size_t Size) const;
+
+  // Id of the function named Name; kNoFunc if there is none.
+  uint32_t FindFuncByName(const std::string &Name) const;
+
+  bool IsDirCallSite(uintptr_t Pc) const;
+  bool IsIndirCallSite(uintptr_t Pc) const;
+
+  // Build from a parsed call graph. DumpHash and DumpSize identify the
+  // llvm-objdump output it was parsed from.
+  void Build(const CallGraph &CG, uint64_t DumpHash, uint64_t DumpSize);
+
+  // Write the graph to a cache file. Returns false on error.
+  bool Write(const char *Path) const;
+
+  // Hash of the graph, the same whether built or mapped from the cache.
+  uint64_t Fingerprint() const;
+
+  // Map a cache file. Returns false if the file can't be read, or was built
+  // by another version or from another dump.
+  bool Map(const char *Path, uint64_t DumpHash, uint64_t DumpSize);
+
+private:
+  // Storage of the arrays: the mapped cache file, or Owned.
+  const void *Mapping = nullptr;
+  size_t MappingSize = 0;
+  std::vector<uint64_t> Owned;
+
+  // Point the arrays into an image of the cache file. Returns false if the
+  // image is malformed.
+  bool Attach(const void *Image, size_t Size);
+};
+
+// Hash of the llvm-objdump output, used as the cache key.
+uint64_t HashDump(const char *Data, size_t Size);
+
+// Write Size bytes at Data to the file at Path, replacing it at once.
+// Returns false on error.
+bool WriteFileAtomically(const char *Path, const void *Data, size_t Size);
+
+// Load the call graph from the llvm-objdump output at DumpPath. If
+// CachePath is set, use the cache file there if it matches the dump, and
+// (re)write it otherwise. Returns false if the call graph can't be read.
+bool LoadCallGraph(const char *DumpPath, const char *CachePath,
+                   FlatCallGraph &Res);
+
+// Call graph of a module: its id in the stack traces, and the llvm-objdump
+// output or binary it is read from.
+struct ModuleSource {
+  uint32_t Id;
+  std::string Path;
+};
+
+// Load the call graphs of several modules, in load order, and merge them
+// (see cg.hpp). The cache is keyed by all the files.
+bool LoadCallGraph(const std::vector<ModuleSource> &Modules,
+                   const char *CachePath, FlatCallGraph &Res);
+
+#endif
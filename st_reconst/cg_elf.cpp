@@ -0,0 +1,520 @@
+// Reading the call graph directly from an ELF binary, without going
+// through the llvm-objdump output.
+//
+// Binaries compiled with -fcall-graph-section carry a .callgraph section
+// with, for each function:
+//
+//   u64 format version (0)
+//   u64 function entry pc
+//   u64 function kind: 0 not an indirect target, 1 indirect target of
+//       unknown type, 2 indirect target of known type
+//   u64 type id (kind 2 only)
+//   u64 number of indirect call sites
+//   u64 type id, u64 call site pc (for each indirect call site)
+//
+// Call site pcs are return addresses, as in the stack traces. Direct calls
+// are not in the section; they are found by a linear sweep over the code of
+// each function symbol in .symtab, as llvm-objdump does.
+
+#include "cg.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <elf.h>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define CG_SECTION_NAME ".callgraph"
+#define CG_SECTION_VERSION 0
+
+// Code of a function symbol.
+struct FuncCode {
+  uint64_t Pc;
+  const uint8_t *Begin;
+  const uint8_t *End;
+  // Whether End comes from the symbol size, rather than the section end.
+  bool Sized;
+};
+
+// Bounds-checked view of the mapped ELF file.
+class ElfImage {
+  const char *Data;
+  size_t Size;
+
+public:
+  ElfImage(const char *Data, size_t Size) : Data(Data), Size(Size) {}
+
+  template <typename T> const T *At(uint64_t Off, uint64_t Count = 1) const {
+    if (Off > Size || Count > (Size - Off) / sizeof(T))
+      return nullptr;
+    return (const T *)(Data + Off);
+  }
+
+  const Elf64_Ehdr *Header() const {
+    const Elf64_Ehdr *H = At<Elf64_Ehdr>(0);
+    if (!H || memcmp(H->e_ident, ELFMAG, SELFMAG) ||
+        H->e_ident[EI_CLASS] != ELFCLASS64 ||
+        H->e_ident[EI_DATA] != ELFDATA2LSB || H->e_machine != EM_X86_64 ||
+        H->e_shentsize != sizeof(Elf64_Shdr))
+      return nullptr;
+    return H;
+  }
+
+  const char *Str(const Elf64_Shdr &StrTab, uint64_t Off) const {
+    if (Off >= StrTab.sh_size)
+      return nullptr;
+    const char *S = At<char>(StrTab.sh_offset + Off);
+    size_t Max = StrTab.sh_size - Off;
+    return S && memchr(S, '\0', Max) ? S : nullptr;
+  }
+};
+
+// Flags of an opcode for the length decoder.
+enum : uint8_t {
+  kModRM = 1,   // Followed by a ModRM byte.
+  kImm8 = 2,    // 8-bit immediate.
+  kImm16 = 4,   // 16-bit immediate.
+  kImmZ = 8,    // 16- or 32-bit immediate, with or without 0x66.
+  kImm32 = 16,  // 32-bit immediate or displacement, e.g., rel32.
+  kImmV = 32,   // 16-, 32- or 64-bit immediate (mov r, imm).
+  kMoffs = 64,  // 32- or 64-bit absolute address (mov al, moffs).
+  kGroup3 = 128 // Immediate only if ModRM.reg is 0 or 1 (test).
+};
+
+// Opcode flags of the one byte map, and of the 0F, 0F 38 and 0F 3A maps.
+struct OpcodeMaps {
+  uint8_t OneByte[256];
+  uint8_t Map0F[256];
+
+  OpcodeMaps() {
+    auto Set = [](uint8_t *Map, int First, int Last, uint8_t Flags) {
+      for (int Op = First; Op <= Last; Op++)
+        Map[Op] = Flags;
+    };
+    memset(OneByte, 0, sizeof(OneByte));
+    // ALU ops: 00-05, 08-0D, ..., 38-3D.
+    for (int Op = 0x00; Op < 0x40; Op += 8) {
+      Set(OneByte, Op, Op + 3, kModRM);
+      OneByte[Op + 4] = kImm8;
+      OneByte[Op + 5] = kImmZ;
+    }
+    OneByte[0x63] = kModRM;
+    OneByte[0x68] = kImmZ;
+    OneByte[0x69] = kModRM | kImmZ;
+    OneByte[0x6A] = kImm8;
+    OneByte[0x6B] = kModRM | kImm8;
+    Set(OneByte, 0x70, 0x7F, kImm8);
+    OneByte[0x80] = kModRM | kImm8;
+    OneByte[0x81] = kModRM | kImmZ;
+    OneByte[0x83] = kModRM | kImm8;
+    Set(OneByte, 0x84, 0x8F, kModRM);
+    Set(OneByte, 0xA0, 0xA3, kMoffs);
+    OneByte[0xA8] = kImm8;
+    OneByte[0xA9] = kImmZ;
+    Set(OneByte, 0xB0, 0xB7, kImm8);
+    Set(OneByte, 0xB8, 0xBF, kImmV);
+    Set(OneByte, 0xC0, 0xC1, kModRM | kImm8);
+    OneByte[0xC2] = kImm16;
+    OneByte[0xC6] = kModRM | kImm8;
+    OneByte[0xC7] = kModRM | kImmZ;
+    OneByte[0xC8] = kImm16 | kImm8;
+    OneByte[0xCA] = kImm16;
+    OneByte[0xCD] = kImm8;
+    Set(OneByte, 0xD0, 0xD3, kModRM);
+    Set(OneByte, 0xD8, 0xDF, kModRM);
+    Set(OneByte, 0xE0, 0xE7, kImm8);
+    Set(OneByte, 0xE8, 0xE9, kImm32);
+    OneByte[0xEB] = kImm8;
+    Set(OneByte, 0xF6, 0xF7, kModRM | kGroup3);
+    Set(OneByte, 0xFE, 0xFF, kModRM);
+
+    // Most of the 0F map takes a ModRM byte.
+    memset(Map0F, kModRM, sizeof(Map0F));
+    Set(Map0F, 0x04, 0x0C, 0);
+    Map0F[0x0D] = kModRM;
+    Map0F[0x0E] = 0;
+    Map0F[0x0F] = kModRM | kImm8; // 3DNow!
+    Set(Map0F, 0x30, 0x37, 0);
+    Set(Map0F, 0x70, 0x73, kModRM | kImm8);
+    Map0F[0x77] = 0;
+    Set(Map0F, 0x80, 0x8F, kImm32);
+    Set(Map0F, 0xA0, 0xA2, 0);
+    Map0F[0xA4] = kModRM | kImm8;
+    Set(Map0F, 0xA8, 0xAA, 0);
+    Map0F[0xAC] = kModRM | kImm8;
+    Map0F[0xBA] = kModRM | kImm8;
+    Map0F[0xC2] = kModRM | kImm8;
+    Set(Map0F, 0xC4, 0xC6, kModRM | kImm8);
+    Set(Map0F, 0xC8, 0xCF, 0);
+  }
+};
+
+static const OpcodeMaps Maps;
+
+// Length of the ModRM byte and what follows it (SIB, displacement), or 0 if
+// past End.
+static size_t ModRMLength(const uint8_t *P, const uint8_t *End) {
+  if (P >= End)
+    return 0;
+  uint8_t Mod = *P >> 6, Rm = *P & 7;
+  size_t Len = 1;
+  if (Mod == 3)
+    return Len;
+  if (Rm == 4) {
+    if (P + 1 >= End)
+      return 0;
+    // SIB with no base register.
+    if (Mod == 0 && (P[1] & 7) == 5)
+      Len += 4;
+    Len++;
+  } else if (Mod == 0 && Rm == 5) {
+    Len += 4; // RIP-relative.
+  }
+  if (Mod == 1)
+    Len += 1;
+  else if (Mod == 2)
+    Len += 4;
+  return Len;
+}
+
+// Length of the x86-64 instruction at P, or 0 if it can't be decoded.
+// Operands are not decoded; DirCall is set for call rel32, whose
+// displacement ends the instruction.
+static size_t InstrLength(const uint8_t *P, const uint8_t *End,
+                          bool &DirCall) {
+  const uint8_t *Start = P;
+  bool OpSize16 = false, AddrSize32 = false, RexW = false;
+  // Legacy prefixes, then REX.
+  for (; P < End; P++) {
+    if (*P == 0x66)
+      OpSize16 = true;
+    else if (*P == 0x67)
+      AddrSize32 = true;
+    else if (!(*P == 0xF0 || *P == 0xF2 || *P == 0xF3 || *P == 0x2E ||
+               *P == 0x36 || *P == 0x3E || *P == 0x26 || *P == 0x64 ||
+               *P == 0x65))
+      break;
+  }
+  if (P < End && (*P & 0xF0) == 0x40)
+    RexW = *P++ & 8;
+  if (P >= End)
+    return 0;
+
+  uint8_t Op = *P++, Flags;
+  if (Op == 0xC4 || Op == 0xC5 || Op == 0x62) {
+    // VEX and EVEX: the payload selects the map, and a ModRM byte follows
+    // the opcode (except for vzeroupper/vzeroall).
+    size_t Payload = Op == 0xC5 ? 1 : Op == 0xC4 ? 2 : 3;
+    if (P + Payload >= End)
+      return 0;
+    unsigned Map = Op == 0xC5 ? 1 : P[0] & (Op == 0xC4 ? 0x1F : 0x07);
+    P += Payload;
+    Op = *P++;
+    if (Map == 1 && Op == 0x77 && Payload < 3)
+      Flags = 0;
+    else if (Map == 1)
+      Flags = Maps.Map0F[Op] & kImm8 ? kModRM | kImm8 : kModRM;
+    else
+      Flags = Map == 3 ? kModRM | kImm8 : kModRM;
+  } else if (Op == 0x0F) {
+    if (P >= End)
+      return 0;
+    Op = *P++;
+    if (Op == 0x38 || Op == 0x3A) {
+      Flags = Op == 0x3A ? kModRM | kImm8 : kModRM;
+      if (P++ >= End)
+        return 0;
+    } else {
+      Flags = Maps.Map0F[Op];
+    }
+  } else {
+    Flags = Maps.OneByte[Op];
+    DirCall = Op == 0xE8;
+  }
+
+  if (Flags & kModRM) {
+    size_t Len = ModRMLength(P, End);
+    if (!Len)
+      return 0;
+    // test r/m, imm
+    if ((Flags & kGroup3) && ((*P >> 3) & 7) < 2)
+      Flags |= Op == 0xF6 ? kImm8 : kImmZ;
+    P += Len;
+  }
+  if (Flags & kImm8)
+    P += 1;
+  if (Flags & kImm16)
+    P += 2;
+  if (Flags & kImmZ)
+    P += OpSize16 ? 2 : 4;
+  if (Flags & kImm32)
+    P += 4;
+  if (Flags & kImmV)
+    P += RexW ? 8 : OpSize16 ? 2 : 4;
+  if (Flags & kMoffs)
+    P += AddrSize32 ? 4 : 8;
+  if (P > End || P - Start > 15)
+    return 0;
+  return P - Start;
+}
+
+// Function symbols of .symtab, or of .dynsym for stripped binaries, with
+// their code. Aliases are swept once.
+static bool ReadFuncSymbols(const ElfImage &Elf, const Elf64_Shdr *Sections,
+                            size_t NumSections,
+                            std::unordered_map<uintptr_t, std::string> &Names,
+                            std::vector<FuncCode> &Code) {
+  const Elf64_Shdr *SymTab = nullptr;
+  for (size_t I = 0; I < NumSections; I++)
+    if (Sections[I].sh_type == SHT_SYMTAB ||
+        (!SymTab && Sections[I].sh_type == SHT_DYNSYM))
+      SymTab = &Sections[I];
+  if (!SymTab || SymTab->sh_link >= NumSections)
+    return false;
+  const Elf64_Shdr &StrTab = Sections[SymTab->sh_link];
+  size_t NumSyms = SymTab->sh_size / sizeof(Elf64_Sym);
+  const Elf64_Sym *Syms = Elf.At<Elf64_Sym>(SymTab->sh_offset, NumSyms);
+  if (!Syms)
+    return false;
+
+  Names.reserve(NumSyms);
+  for (size_t I = 0; I < NumSyms; I++) {
+    const Elf64_Sym &Sym = Syms[I];
+    if (ELF64_ST_TYPE(Sym.st_info) != STT_FUNC || !Sym.st_value ||
+        Sym.st_shndx == SHN_UNDEF || Sym.st_shndx >= NumSections)
+      continue;
+    const char *Name = Elf.Str(StrTab, Sym.st_name);
+    if (!Name || !Names.emplace(Sym.st_value, Name).second)
+      continue;
+    const Elf64_Shdr &Text = Sections[Sym.st_shndx];
+    if (Text.sh_type != SHT_PROGBITS || !(Text.sh_flags & SHF_EXECINSTR) ||
+        Sym.st_value < Text.sh_addr ||
+        Sym.st_value - Text.sh_addr > Text.sh_size)
+      continue;
+    const uint8_t *SecBegin = Elf.At<uint8_t>(Text.sh_offset, Text.sh_size);
+    if (!SecBegin)
+      continue;
+    const uint8_t *Begin = SecBegin + (Sym.st_value - Text.sh_addr);
+    const uint8_t *SecEnd = SecBegin + Text.sh_size;
+    bool Sized = Sym.st_size && Sym.st_size <= (uint64_t)(SecEnd - Begin);
+    Code.push_back({Sym.st_value, Begin, Sized ? Begin + Sym.st_size : SecEnd,
+                    Sized});
+  }
+
+  // Symbols without a size (e.g., from assembly) end at the next function.
+  std::sort(Code.begin(), Code.end(),
+            [](const FuncCode &A, const FuncCode &B) { return A.Pc < B.Pc; });
+  for (size_t I = 0; I + 1 < Code.size(); I++) {
+    uint64_t Gap = Code[I + 1].Pc - Code[I].Pc;
+    if (!Code[I].Sized && Gap < (uint64_t)(Code[I].End - Code[I].Begin))
+      Code[I].End = Code[I].Begin + Gap;
+  }
+  return true;
+}
+
+// Name the PLT stubs "NAME@plt", as llvm-objdump does, so that calls
+// through them can be resolved across modules (see
+// CallGraph::ResolvePltCalls). Each stub jumps through a GOT slot, and the
+// dynamic relocation of the slot names the function.
+static void ReadPltStubs(const ElfImage &Elf, const Elf64_Shdr *Sections,
+                         size_t NumSections, const Elf64_Shdr &SecNames,
+                         std::unordered_map<uintptr_t, std::string> &Names) {
+  std::unordered_map<uint64_t /* GOT slot */, const char *> SlotNames;
+  for (size_t I = 0; I < NumSections; I++) {
+    const Elf64_Shdr &Rela = Sections[I];
+    if (Rela.sh_type != SHT_RELA || Rela.sh_link >= NumSections)
+      continue;
+    const Elf64_Shdr &SymTab = Sections[Rela.sh_link];
+    if (SymTab.sh_type != SHT_DYNSYM || SymTab.sh_link >= NumSections)
+      continue;
+    size_t NumRelas = Rela.sh_size / sizeof(Elf64_Rela);
+    size_t NumSyms = SymTab.sh_size / sizeof(Elf64_Sym);
+    const Elf64_Rela *Relas = Elf.At<Elf64_Rela>(Rela.sh_offset, NumRelas);
+    const Elf64_Sym *Syms = Elf.At<Elf64_Sym>(SymTab.sh_offset, NumSyms);
+    if (!Relas || !Syms)
+      continue;
+    for (size_t R = 0; R < NumRelas; R++) {
+      uint32_t Type = ELF64_R_TYPE(Relas[R].r_info);
+      uint32_t Sym = ELF64_R_SYM(Relas[R].r_info);
+      if ((Type != R_X86_64_JUMP_SLOT && Type != R_X86_64_GLOB_DAT) || !Sym ||
+          Sym >= NumSyms)
+        continue;
+      const char *Name =
+          Elf.Str(Sections[SymTab.sh_link], Syms[Sym].st_name);
+      if (Name && *Name)
+        SlotNames.emplace(Relas[R].r_offset, Name);
+    }
+  }
+  if (SlotNames.empty())
+    return;
+
+  for (size_t I = 0; I < NumSections; I++) {
+    const Elf64_Shdr &Plt = Sections[I];
+    const char *SecName = Elf.Str(SecNames, Plt.sh_name);
+    if (!SecName || (strcmp(SecName, ".plt") && strcmp(SecName, ".plt.sec") &&
+                     strcmp(SecName, ".plt.got")))
+      continue;
+    const uint8_t *Begin = Elf.At<uint8_t>(Plt.sh_offset, Plt.sh_size);
+    if (!Begin)
+      continue;
+    const uint8_t *End = Begin + Plt.sh_size;
+    uint64_t EntrySize = Plt.sh_entsize ? Plt.sh_entsize : 16;
+    for (const uint8_t *P = Begin; P < End;) {
+      bool DirCall = false;
+      size_t Len = InstrLength(P, End, DirCall);
+      if (!Len) {
+        ++P;
+        continue;
+      }
+      // jmp *disp32(%rip), possibly with a bnd prefix.
+      const uint8_t *Op = P[0] == 0xF2 ? P + 1 : P;
+      if (Op + 6 == P + Len && Op[0] == 0xFF && Op[1] == 0x25) {
+        int32_t Disp;
+        memcpy(&Disp, Op + 2, sizeof(Disp));
+        uint64_t Off = P - Begin;
+        uint64_t Slot = Plt.sh_addr + Off + Len + (int64_t)Disp;
+        auto It = SlotNames.find(Slot);
+        if (It != SlotNames.end())
+          Names.emplace(Plt.sh_addr + Off - Off % EntrySize,
+                        std::string(It->second) + "@plt");
+      }
+      P += Len;
+    }
+  }
+}
+
+// Direct calls (call rel32) of each function, by linear sweep. Call sites
+// are recorded as return addresses.
+static void SweepDirCalls(
+    const std::vector<FuncCode> &Code,
+    std::unordered_map<uintptr_t,
+                       std::vector<std::tuple<uintptr_t, uintptr_t>>> &Map,
+    std::unordered_set<uintptr_t> &CallSites) {
+  Map.reserve(Code.size());
+  for (const FuncCode &F : Code) {
+    std::vector<std::tuple<uintptr_t, uintptr_t>> Calls;
+    for (const uint8_t *P = F.Begin; P < F.End;) {
+      bool DirCall = false;
+      size_t Len = InstrLength(P, F.End, DirCall);
+      if (!Len) {
+        ++P; // Data or padding: resynchronize on the next byte.
+        continue;
+      }
+      if (DirCall) {
+        // Prefixes are allowed, e.g., in TLS sequences (66 66 48 e8).
+        int32_t Rel;
+        memcpy(&Rel, P + Len - sizeof(Rel), sizeof(Rel));
+        uintptr_t Ret = F.Pc + (P - F.Begin) + Len;
+        Calls.emplace_back(Ret, Ret + (int64_t)Rel);
+      }
+      P += Len;
+    }
+    if (Calls.empty())
+      continue;
+    for (const auto &Call : Calls)
+      CallSites.insert(std::get<0>(Call));
+    auto &Vec = Map[F.Pc];
+    Vec.insert(Vec.end(), Calls.begin(), Calls.end());
+  }
+}
+
+// Entries of the call graph section. Returns false if it is malformed.
+static bool ReadCallGraphSection(
+    const uint64_t *P, const uint64_t *End,
+    std::unordered_map<uintptr_t, std::vector<uintptr_t>> &TargetTypes,
+    std::unordered_map<uintptr_t, std::vector<uintptr_t>> &CallTypes,
+    std::unordered_map<uintptr_t, std::vector<uintptr_t>> &FuncCallSites,
+    std::unordered_set<uintptr_t> &CallSites) {
+  while (P < End) {
+    if (End - P < 4 || P[0] != CG_SECTION_VERSION)
+      return false;
+    uint64_t Entry = P[1], Kind = P[2];
+    P += 3;
+    if (Kind == 2)
+      TargetTypes[*P++].push_back(Entry);
+    else if (Kind != 0 && Kind != 1)
+      return false;
+    // Targets of unknown type can't be matched with call sites by type, and
+    // are left out like in the llvm-objdump output.
+    if (P >= End)
+      return false;
+    uint64_t NumSites = *P++;
+    if (NumSites > (uint64_t)(End - P) / 2)
+      return false;
+    if (!NumSites)
+      continue;
+    auto &Sites = FuncCallSites[Entry];
+    for (; NumSites; NumSites--, P += 2) {
+      CallTypes[P[0]].push_back(P[1]);
+      Sites.push_back(P[1]);
+      CallSites.insert(P[1]);
+    }
+  }
+  return true;
+}
+
+void CallGraph::ParseElf(const char *Data, size_t Size, const char *Name) {
+  ElfImage Elf(Data, Size);
+  const Elf64_Ehdr *H = Elf.Header();
+  if (!H) {
+    fprintf(stderr, "Error: %s is not an x86-64 ELF64 file.\n", Name);
+    return;
+  }
+  const Elf64_Shdr *Sections = Elf.At<Elf64_Shdr>(H->e_shoff, H->e_shnum);
+  if (!Sections || H->e_shstrndx >= H->e_shnum)
+    return;
+  const Elf64_Shdr &SecNames = Sections[H->e_shstrndx];
+
+  std::vector<FuncCode> Code;
+  if (!ReadFuncSymbols(Elf, Sections, H->e_shnum, FuncAddrToName, Code)) {
+    fprintf(stderr, "Error: %s has no symbol table.\n", Name);
+    return;
+  }
+
+  ReadPltStubs(Elf, Sections, H->e_shnum, SecNames, FuncAddrToName);
+
+  const uint64_t *CGBegin = nullptr, *CGEnd = nullptr;
+  for (size_t I = 0; I < H->e_shnum; I++) {
+    const char *SecName = Elf.Str(SecNames, Sections[I].sh_name);
+    if (SecName && !strcmp(SecName, CG_SECTION_NAME) &&
+        Sections[I].sh_type != SHT_NOBITS) {
+      size_t N = Sections[I].sh_size / sizeof(uint64_t);
+      CGBegin = Elf.At<uint64_t>(Sections[I].sh_offset, N);
+      CGEnd = CGBegin ? CGBegin + N : nullptr;
+    }
+  }
+  if (!CGBegin)
+    fprintf(stderr, "WARNING: %s has no " CG_SECTION_NAME " section, it "
+                    "was not compiled with -fcall-graph-section; indirect "
+                    "calls are left out.\n", Name);
+
+  // The sweep and the section fill separate containers, as in Parse.
+  bool CGValid = true;
+  std::thread Sweep(SweepDirCalls, std::cref(Code),
+                    std::ref(FuncAddrToDirCallSites),
+                    std::ref(DirCallSiteAddrs));
+  if (CGBegin)
+    CGValid = ReadCallGraphSection(CGBegin, CGEnd, TypeIdToIndirTargets,
+                                   TypeIdToIndirCalls,
+                                   FuncAddrToIndirCallSites,
+                                   IndirCallSiteAddrs);
+  Sweep.join();
+  if (!CGValid) {
+    fprintf(stderr, "Error: malformed " CG_SECTION_NAME " section in %s.\n",
+            Name);
+    return;
+  }
+
+  FuncNameToAddr.reserve(FuncAddrToName.size());
+  for (auto &El : FuncAddrToName)
+    FuncNameToAddr[El.second] = El.first;
+
+  UpdateTargetToCallers();
+  Loaded = true;
+}
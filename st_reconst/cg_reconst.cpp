@@ -1,165 +1,608 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
 #include <cstdint>
-#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <map>
-#include <sstream>
+#include <memory>
+#include <mutex>
 #include <iomanip>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <string>
+#include <functional>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "cg.hpp"
+#include "cg_cache.hpp"
+#include "hash_filter.hpp"
+#include "lru_cache.hpp"
+#include "module_index.hpp"
+#include "st_dict.hpp"
+#include "st_reader.hpp"
+#include "st_server.hpp"
+#include "task_pool.hpp"
+#include "../common/st_hash.hpp"
 
 // TODO: For better performance, consider using different data structures
 // (e.g., raw pointers instead of std::vectors). 
 
 typedef std::vector<uintptr_t> StackTrace;
-// Medium stack trace hashes used for pruning
-typedef std::unordered_set<uint32_t> MedSTSet;
-// TODO: Account for hash collisions in inputted stack traces (e.g., use
-// array of stack traces instead).
-typedef std::unordered_map<uintptr_t, StackTrace> STSet;
+// Unique stack traces by hash; those whose hashes collide are kept apart.
+typedef std::unordered_multimap<uintptr_t, StackTrace> STSet;
 
-// Used as inout to DFS
+// Compressed stack trace ("FUNCNAME !HASH DEPTH"), and the stack traces it
+// was decompressed to.
+struct CompressedST {
+  uintptr_t Hash;
+  size_t Depth;
+  bool FromDict = false; // Found in the dictionary rather than searched.
+  std::vector<StackTrace> Matches;
+};
+
+// Used as inout to DFS. The outputs are updated with atomic operations, as
+// the parallel search finds matches on several threads.
 struct STInfo {
-  /* in  */ StackTrace ST;
+  /* in  */ StackTrace ST; // Empty if only compressed.
   /* in  */ uintptr_t Hash = 0; 
   /* out */ uintptr_t NumHashMatches = 0;
   /* out */ bool FoundCorrectMatch = false;
+  /* in  */ size_t NumValidFrames = 0; // See ValidateStackTrace().
+  /* in  */ size_t Depth = 0; // Length of the stack trace.
+  /* in  */ bool Compressed = false; // Whether to collect the matches.
+  /* out */ std::vector<StackTrace> Matches; // Of length Depth.
+
+  // Whether the stack trace is evaluated, i.e., given with its frames.
+  bool HasFrames() const { return !Compressed || !ST.empty(); }
 };
 
-// TODO: Account for hash collisions in inputted stack traces (e.g., use
-// array of stack traces instead).
-typedef std::unordered_map<uintptr_t, STInfo> STInfoSet;
+// Guards STInfo::Matches in the parallel search.
+static std::mutex MatchesLock;
+
+// By hash. Stack traces whose hashes collide, and compressed stack traces
+// of other depths, have entries of their own.
+typedef std::unordered_multimap<uintptr_t, STInfo> STInfoSet;
+
+// Entry of STIS collecting the matches of the compressed stack trace (Hash,
+// Depth), or nullptr.
+static STInfo *FindCompressed(STInfoSet &STIS, uintptr_t Hash, size_t Depth) {
+  auto Range = STIS.equal_range(Hash);
+  for (auto It = Range.first; It != Range.second; ++It)
+    if (It->second.Compressed && It->second.Depth == Depth)
+      return &It->second;
+  return nullptr;
+}
+
+// Search for the compressed stack trace (Hash, Depth) too, collecting its
+// matches in the entry of a stack trace with this hash and depth, or in a
+// new one.
+static void AddCompressed(STInfoSet &STIS, uintptr_t Hash, size_t Depth) {
+  auto Range = STIS.equal_range(Hash);
+  for (auto It = Range.first; It != Range.second; ++It)
+    if (It->second.Depth == Depth) {
+      It->second.Compressed = true;
+      return;
+    }
+  STInfo STI;
+  STI.Hash = Hash;
+  STI.Depth = Depth;
+  STI.Compressed = true;
+  STIS.emplace(Hash, std::move(STI));
+}
 
 struct DFSRes {
   uintptr_t PruningCount = 0;
+  // Pruning done at each checkpoint depth of the hash.
+  uintptr_t CheckpointPruningCount[ST_HASH_MAX_CHECKPOINTS] = {};
+  uintptr_t ReachPruningCount = 0;
   uintptr_t VisitedNodeCount = 0;
+  // Nodes of the upper halves of the meet-in-the-middle search, included in
+  // VisitedNodeCount.
+  uintptr_t MeetNodeCount = 0;
+  // Nodes the search may visit, set before it (see --budget). Past them, it
+  // gives up, and sets OverBudget: some stack traces may not be found.
+  uintptr_t NodeBudget = UINTPTR_MAX;
+  bool OverBudget = false;
+
+  DFSRes &operator+=(const DFSRes &O) {
+    PruningCount += O.PruningCount;
+    for (unsigned I = 0; I < ST_HASH_MAX_CHECKPOINTS; I++)
+      CheckpointPruningCount[I] += O.CheckpointPruningCount[I];
+    ReachPruningCount += O.ReachPruningCount;
+    VisitedNodeCount += O.VisitedNodeCount;
+    MeetNodeCount += O.MeetNodeCount;
+    OverBudget |= O.OverBudget;
+    return *this;
+  }
 };
 
-uintptr_t 
-HashStep(uintptr_t Hash, uintptr_t PC, size_t Idx, size_t kMedHashIdx) {
-  uintptr_t CRC32 = __builtin_ia32_crc32di(Hash, PC);
-  // TODO: is that the right approach to OR hashes? XOR instead?
-  if (Idx == kMedHashIdx)
-    return CRC32 | (Hash << 32);
-  else
-    return CRC32 | ((Hash >> 32) << 32);
-}
+// Lengths of the stack traces searched for, to cut the branches of the
+// search that can't end at any of them (see FuncReach).
+struct ReachFilter {
+  size_t MaxDepth = 0;
+  // Whether some stack traces were clipped to MaxDepth. These can end
+  // anywhere.
+  bool Clipped = false;
+  // Whether the stack traces shorter than MaxDepth end at a root function.
+  // Otherwise, they can end anywhere as well.
+  bool EndAtRoots = false;
+  // NextLength[D]: shortest length of the stack traces not clipped that is
+  // at least D, or SIZE_MAX. Up to MaxDepth + 1.
+  std::vector<size_t> NextLength;
 
-uintptr_t Hash(const StackTrace &ST, size_t kMedHashIdx) {
-  uintptr_t Res = 0;
-  for (size_t I = 0; I < ST.size(); I++) 
-    Res = HashStep(Res, ST[I], I, kMedHashIdx);
-  return Res;
+  ReachFilter(const STInfoSet &STIS, size_t MaxDepth, bool EndAtRoots)
+    : MaxDepth(MaxDepth), EndAtRoots(EndAtRoots),
+      NextLength(MaxDepth + 2, SIZE_MAX) {
+    for (const auto &El : STIS) {
+      size_t Len = El.second.Depth;
+      if (Len >= MaxDepth)
+        Clipped = true;
+      else
+        NextLength[Len] = Len;
+    }
+    for (size_t D = MaxDepth; D-- > 0;)
+      NextLength[D] = std::min(NextLength[D], NextLength[D + 1]);
+  }
+
+  // Whether a stack trace can be found past function Func at depth Depth.
+  bool CanExtend(const FuncReach &R, size_t Depth) const {
+    auto Bound = [](uint16_t Len) {
+      return Len == FuncReach::kUnbounded ? SIZE_MAX / 2 : (size_t)Len;
+    };
+    if (Clipped && Depth + Bound(R.MaxWalk) >= MaxDepth)
+      return true;
+    if (!EndAtRoots)
+      return NextLength[Depth + 1] <= Depth + Bound(R.MaxWalk);
+    if (R.MinRootDist > R.MaxRootDist)
+      return false;
+    size_t First = std::max(Depth + R.MinRootDist, Depth + 1);
+    return First <= MaxDepth &&
+           NextLength[First] <= Depth + Bound(R.MaxRootDist);
+  }
+};
+
+// Checkpoint hashes of the stack traces, used for pruning: a branch of the
+// search reaching a checkpoint depth is cut if no stack trace longer than
+// that has its checkpoint hash. The shorter ones are matched before. Short
+// checkpoint hashes are kept in a bitmap, the others in a set, behind a
+// filter (see hash_filter.hpp). The hashes of the stack traces themselves
+// are also kept in a filter, checked before the STInfoSet at every node.
+struct CheckpointSets {
+  enum : unsigned { kMaxBitmapBits = 16 };
+  const STHashLayout &Layout;
+  HashFilter Hashes;
+  std::vector<std::vector<uint64_t>> Bitmaps;
+  std::vector<std::unordered_set<uint32_t>> Sets;
+  std::vector<HashFilter> SetFilters;
+
+  CheckpointSets(const STInfoSet &STIS, const STHashLayout &Layout)
+    : Layout(Layout), Hashes(STIS.size()) {
+    bool Bitmap = Layout.Bits <= kMaxBitmapBits;
+    if (Bitmap)
+      Bitmaps.assign(Layout.NumCheckpoints,
+                     std::vector<uint64_t>(((1 << Layout.Bits) + 63) / 64));
+    else {
+      Sets.resize(Layout.NumCheckpoints);
+      SetFilters.assign(Layout.NumCheckpoints, HashFilter(STIS.size()));
+    }
+    for (const auto &El : STIS) {
+      Hashes.Add(El.first);
+      for (unsigned I = 0; I < Layout.NumCheckpoints; I++) {
+        if (El.second.Depth <= Layout.Depths[I])
+          continue;
+        uint32_t H = HashCheckpoint(El.first, Layout, I);
+        if (Bitmap)
+          Bitmaps[I][H / 64] |= 1ULL << (H % 64);
+        else {
+          Sets[I].insert(H);
+          SetFilters[I].Add(H);
+        }
+      }
+    }
+  }
+
+  // Whether some stack trace may have hash Hash: false for most of those
+  // that don't, without touching the STInfoSet.
+  bool MayMatch(uintptr_t Hash) const { return Hashes.MayContain(Hash); }
+
+  // Whether Hash, the hash of a stack trace as deep as checkpoint I, has
+  // the checkpoint hash of some stack trace.
+  bool Contains(unsigned I, uintptr_t Hash) const {
+    uint32_t H = Hash & HashCheckpointMask(Layout);
+    if (!Bitmaps.empty())
+      return (Bitmaps[I][H / 64] >> (H % 64)) & 1;
+    return SetFilters[I].MayContain(H) && Sets[I].count(H);
+  }
+};
+
+uintptr_t Hash(const StackTrace &ST, const STHashLayout &Layout) {
+  return Hash(ST.data(), ST.size(), Layout);
 }
 
+// Read the stack traces at Path on Jobs threads (see st_reader.hpp), and
+// the compressed ones into Compressed, and report the throughput.
 std::unordered_map<std::string /* FuncName */, STSet>
-ReadStackTraces(std::istream &In, size_t DepthLimit, size_t kMedHashIdx) {
+ReadStackTraces(const char *Path, size_t DepthLimit, const STHashLayout &Layout,
+                size_t Jobs, ModuleIndex &Modules,
+                std::unordered_map<std::string, std::vector<CompressedST>>
+                    &Compressed) {
   std::unordered_map<std::string, STSet> Res;
-  std::string X;
-  int CountStackTracesClipped = 0;
+  TraceLog Log;
+  if (!ReadTraceLog(Path, DepthLimit, Jobs, Log)) {
+    fprintf(stderr, "WARNING: can't read the stack traces from \"%s\".\n",
+            Path);
+    return Res;
+  }
+  // Read the module table ("# module ..."), check the checkpoint depths of
+  // the compressed stack traces.
+  for (const auto &X : Log.Comments) {
+    STHashLayout TraceLayout;
+    if (!X.compare(0, 19, "# hash-checkpoints ") &&
+        (!ParseHashLayout(X.c_str() + 19, TraceLayout) ||
+         TraceLayout.NumCheckpoints != Layout.NumCheckpoints ||
+         !std::equal(Layout.Depths, Layout.Depths + Layout.NumCheckpoints,
+                     TraceLayout.Depths)))
+      fprintf(stderr, "WARNING: the stack traces were compressed with other "
+                      "hash checkpoints (\"%s\").\n", X.c_str() + 19);
+    Modules.AddLine(X);
+  }
+  // Compressed stack traces ("FUNCNAME !HASH DEPTH") carry no frames to
+  // evaluate the decompression against; they are decompressed.
+  for (const auto &C : Log.Compressed)
+    Compressed[Log.FuncNames[C.Func]].push_back({C.Hash, C.Depth, false, {}});
+
+  // Frames printed as runtime addresses are mapped to their module with the
+  // whole module table. The same stack trace might be printed either way.
   int CountHashCollisions = 0;
-  while (std::getline(In, X)) {
-    std::stringstream Line(X);
-    std::string FuncName;
-    Line >> FuncName;
-    StackTrace ST;
-    int CurrentDepth = 0;
-    while (true) {
-      uintptr_t PC;
-      Line >> std::hex >> PC;
-      if (!Line) break;
-      ST.push_back(PC);
-      if (++CurrentDepth == DepthLimit) {
-        CountStackTracesClipped++;
-        break;
-      }
+  for (const auto &T : Log.Traces) {
+    StackTrace ST(Log.Frames.begin() + T.First,
+                  Log.Frames.begin() + T.First + T.Len);
+    for (auto &PC : ST)
+      PC = Modules.Translate(PC);
+    uintptr_t STHash = Hash(ST, Layout);
+    STSet &FSTS = Res[Log.FuncNames[T.Func]];
+    auto Range = FSTS.equal_range(STHash);
+    if (std::any_of(Range.first, Range.second,
+                    [&ST](const STSet::value_type &El) {
+                      return El.second == ST;
+                    }))
+      continue;
+    CountHashCollisions += Range.first != Range.second;
+    FSTS.emplace(STHash, std::move(ST));
+  }
 
-    }
-    uintptr_t STHash = Hash(ST, kMedHashIdx);
-    // TODO: stack traces with hash collisions might or might not be same
-    // as we don't compare the full stack traces here. Also keep track of
-    // collisions for different stack traces, which is important to design
-    // the compression method.
-    if (Res[FuncName].count(STHash)) CountHashCollisions++;
-    Res[FuncName][STHash] = ST;
-  }
-  if (CountStackTracesClipped)
-    fprintf(stderr, "WARNING: %d stack traces were clipped as they exceeded "
-                    "the depth limit.\n", CountStackTracesClipped);
+  std::cout << "Stack traces read time          : " << std::fixed
+            << std::setprecision(3) << Log.Seconds << " s ("
+            << std::setprecision(1) << Log.NumBytes / 1e6 << " MB, "
+            << Log.NumBytes / 1e6 / std::max(Log.Seconds, 1e-9) << " MB/s, "
+            << Log.NumLines << " stack traces, " << Log.Traces.size()
+            << " unique)" << std::endl;
+  std::cout.unsetf(std::ios::floatfield);
+  if (Log.NumClipped)
+    fprintf(stderr, "WARNING: %llu stack traces were clipped as they "
+                    "exceeded the depth limit.\n",
+            (unsigned long long)Log.NumClipped);
+  if (Log.NumMalformed)
+    fprintf(stderr, "WARNING: %llu malformed compressed stack traces were "
+                    "skipped.\n", (unsigned long long)Log.NumMalformed);
   if (CountHashCollisions)
-    fprintf(stderr, "WARNING: %d stack traces had hash collisions.\n", 
-                                                      CountHashCollisions);
+    fprintf(stderr, "WARNING: %d stack traces had hash collisions with other "
+                    "stack traces.\n", CountHashCollisions);
   return Res;
 }
 
 void
-ProcessMatch(STInfoSet &STIS, uintptr_t *ST, size_t Depth, size_t kMedHashIdx)
+ProcessMatch(STInfoSet &STIS, uintptr_t *ST, size_t Depth,
+             const STHashLayout &Layout)
 {
   // Create the stack trace with depth (slice from ST).
   StackTrace ST1(ST, ST + Depth);
 
   // Re-compute the hash and verify
-  uintptr_t H = Hash(ST1, kMedHashIdx);
-  assert(STIS.count(H) 
+  uintptr_t H = Hash(ST1, Layout);
+  auto Range = STIS.equal_range(H);
+  assert(Range.first != Range.second
         && "Can't verify the match: no stack trace with such hash.");
+  for (auto It = Range.first; It != Range.second; ++It) {
+    STInfo &STI = It->second;
 
-  // Check if the stack traces match
-  bool STMatches = ST1 == STIS[H].ST;
+    // Check if the stack traces match
+    bool STMatches = ST1 == STI.ST;
 
-  STIS[H].FoundCorrectMatch |= STMatches;
-  STIS[H].NumHashMatches += STMatches;
+    if (STI.Compressed && Depth == STI.Depth) {
+      std::lock_guard<std::mutex> Guard(MatchesLock);
+      STI.Matches.push_back(ST1);
+    }
+
+    if (STMatches)
+      __atomic_store_n(&STI.FoundCorrectMatch, true, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&STI.NumHashMatches, STMatches, __ATOMIC_RELAXED);
+  }
 }
 
+// Branches of the parallel search that run as separate tasks: the callers
+// of the functions at depths below Depth are passed to Spawn, with the
+// stack trace and hash up to them, instead of being searched, as long as
+// Hungry() holds.
+struct DFSSplit {
+  size_t Depth;
+  std::function<bool()> Hungry;
+  std::function<void(const uintptr_t *ST, uint32_t EntryId, uintptr_t Hash,
+                     size_t Depth)> Spawn;
+};
+
+// Meet-in-the-middle search (see --meet): the search from the function
+// stops at depth MeetDepth, and each of its paths (lower halves) is joined
+// with the paths up from the function it reaches (upper halves), of each
+// remaining stack trace length. As the CRC32 of the stack traces is linear
+// (see CRCShift), the upper halves from each function are hashed once, from
+// 0, and kept sorted by hash: the stack traces whose lower 32 bits of the
+// hash match are found by a lookup per stack trace (or per upper half, if
+// fewer) rather than by searching further. The whole hash of a match is
+// then verified. Both halves take about fanout^(depth / 2) nodes rather
+// than fanout^depth, for the memory of the upper halves. These are not
+// pruned by the checkpoint hashes, which depend on the lower half; the
+// lower halves reaching a function with too many upper halves go on a level
+// deeper, and are joined there instead.
+class MeetInMiddle {
+  // Nodes of the upper halves of a function, and of all of them.
+  enum : size_t { kMaxUpNodes = 1 << 16, kMaxTotalUpNodes = 1 << 23 };
+  // Lower halves reaching a function before its upper halves are built.
+  enum : unsigned { kMinHits = 4 };
+
+  // Call site of a path up from a function, and the previous one.
+  struct UpNode {
+    uintptr_t Pc;
+    uint32_t Parent;
+  };
+  // Path up from a function, ending at Node, and its CRC32 from 0.
+  struct UpPath {
+    uint32_t CRC;
+    uint32_t Node;
+    bool operator<(const UpPath &O) const { return CRC < O.CRC; }
+  };
+  // Paths up from a function at some depth: a tree of call sites, rooted at
+  // kNoNode, and the paths of each length J, sorted by CRC.
+  struct UpPaths {
+    enum : uint32_t { kNoNode = UINT32_MAX };
+    std::vector<UpNode> Nodes;
+    std::vector<std::vector<UpPath>> ByLen;
+    // Whether there were too many nodes to keep.
+    bool Overflow = false;
+    bool Built = false;
+    unsigned Hits = 0;
+  };
+
+  const FlatCallGraph &CG;
+  STInfoSet &STIS;
+  const STHashLayout &Layout;
+  const ReachFilter &Reach;
+  size_t MaxDepth;
+  // TargetCRCs[Len]: lower 32 bits of the hashes of the stack traces of
+  // length Len, sorted and unique.
+  std::vector<std::vector<uint32_t>> TargetCRCs;
+  size_t Longest = 0;
+  // Upper halves, by depth and function.
+  std::unordered_map<uint64_t, UpPaths> Ups;
+  size_t TotalUpNodes = 0;
+  // Upper halves kept and overflowing, by depth.
+  std::vector<size_t> NumBuilt, NumOverflows;
+
+  void AddUpPaths(UpPaths &U, uint32_t Func, uint32_t Parent, size_t Depth,
+                  size_t J, uint32_t CRC, DFSRes &DFSResult) {
+    if (Depth + J == MaxDepth || Func == FlatCallGraph::kNoFunc)
+      return;
+    if (!Reach.CanExtend(CG.Reach[Func], Depth + J)) {
+      ++DFSResult.ReachPruningCount;
+      return;
+    }
+    for (const CallerEdge &FuncCall : CG.GetCallers(Func)) {
+      if (U.Overflow ||
+          U.Nodes.size() >= kMaxUpNodes ||
+          TotalUpNodes + U.Nodes.size() >= kMaxTotalUpNodes) {
+        U.Overflow = true;
+        return;
+      }
+      ++DFSResult.VisitedNodeCount;
+      ++DFSResult.MeetNodeCount;
+      uint32_t Node = U.Nodes.size();
+      U.Nodes.push_back({FuncCall.CallSitePc, Parent});
+      uint32_t NextCRC = CRCStep(CRC, FuncCall.CallSitePc);
+      if (!TargetCRCs[Depth + J + 1].empty())
+        U.ByLen[J + 1].push_back({NextCRC, Node});
+      AddUpPaths(U, FuncCall.CallerId, Node, Depth, J + 1, NextCRC,
+                 DFSResult);
+    }
+  }
+
+  // Upper halves from Func at Depth, built on the kMinHits-th use; null if
+  // not built.
+  const UpPaths *GetUpPaths(uint32_t Func, size_t Depth, DFSRes &DFSResult) {
+    UpPaths &U = Ups[(uint64_t)Depth << 32 | Func];
+    if (U.Built)
+      return &U;
+    if (U.Overflow || ++U.Hits < kMinHits)
+      return nullptr;
+    // Most overflow in wide graphs: don't spend the budget on each.
+    if (NumOverflows[Depth] > 8 && NumOverflows[Depth] > NumBuilt[Depth]) {
+      U.Overflow = true;
+      return nullptr;
+    }
+    U.ByLen.resize(MaxDepth - Depth + 1);
+    AddUpPaths(U, Func, UpPaths::kNoNode, Depth, 0, 0, DFSResult);
+    if (U.Overflow) {
+      ++NumOverflows[Depth];
+      U.Nodes = std::vector<UpNode>();
+      U.ByLen = std::vector<std::vector<UpPath>>();
+      return nullptr;
+    }
+    ++NumBuilt[Depth];
+    TotalUpNodes += U.Nodes.size();
+    for (auto &Paths : U.ByLen)
+      std::sort(Paths.begin(), Paths.end());
+    U.Built = true;
+    return &U;
+  }
+
+  // Verify the stack trace ST[0, Depth) followed by Path, of length J.
+  void Match(uintptr_t *ST, size_t Depth, const UpPaths &U,
+             const UpPath &Path, size_t J) {
+    uint32_t Node = Path.Node;
+    for (size_t I = Depth + J; I-- > Depth; Node = U.Nodes[Node].Parent)
+      ST[I] = U.Nodes[Node].Pc;
+    if (STIS.count(Hash(ST, Depth + J, Layout)))
+      ProcessMatch(STIS, ST, Depth + J, Layout);
+  }
+
+public:
+  MeetInMiddle(const FlatCallGraph &CG, STInfoSet &STIS,
+               const STHashLayout &Layout, const ReachFilter &Reach,
+               size_t MaxDepth)
+    : CG(CG), STIS(STIS), Layout(Layout), Reach(Reach), MaxDepth(MaxDepth),
+      TargetCRCs(MaxDepth + 1), NumBuilt(MaxDepth + 1),
+      NumOverflows(MaxDepth + 1) {
+    for (const auto &El : STIS) {
+      size_t Len = El.second.Depth;
+      TargetCRCs[Len].push_back((uint32_t)El.first);
+      Longest = std::max(Longest, Len);
+    }
+    for (auto &CRCs : TargetCRCs) {
+      std::sort(CRCs.begin(), CRCs.end());
+      CRCs.erase(std::unique(CRCs.begin(), CRCs.end()), CRCs.end());
+    }
+  }
+
+  // Join the lower half ST[0, Depth), with hash Hash and ending at function
+  // Func, with the upper halves from Func. Returns false if there are too
+  // many of these, or if they were not worth building yet, to go on a level
+  // deeper instead.
+  bool Join(uintptr_t *ST, uint32_t Func, uintptr_t Hash, size_t Depth,
+            DFSRes &DFSResult) {
+    if (Depth >= Longest || Func == FlatCallGraph::kNoFunc)
+      return true;
+    if (!Reach.CanExtend(CG.Reach[Func], Depth)) {
+      ++DFSResult.ReachPruningCount;
+      return true;
+    }
+    const UpPaths *U = GetUpPaths(Func, Depth, DFSResult);
+    if (!U)
+      return false;
+    uint32_t Shift = Hash;
+    for (size_t J = 1; Depth + J <= Longest; J++) {
+      // CRC of the lower half, shifted past J more frames.
+      Shift = CRCStep(Shift, 0);
+      const auto &Targets = TargetCRCs[Depth + J];
+      const auto &Paths = U->ByLen[J];
+      if (Targets.empty() || Paths.empty())
+        continue;
+      if (Targets.size() <= Paths.size()) {
+        for (uint32_t Target : Targets) {
+          auto Range = std::equal_range(Paths.begin(), Paths.end(),
+                                        UpPath{Target ^ Shift, 0});
+          for (auto It = Range.first; It != Range.second; ++It)
+            Match(ST, Depth, *U, *It, J);
+        }
+      } else {
+        for (const UpPath &Path : Paths)
+          if (std::binary_search(Targets.begin(), Targets.end(),
+                                 Path.CRC ^ Shift))
+            Match(ST, Depth, *U, Path, J);
+      }
+    }
+    return true;
+  }
+};
+
 
 uintptr_t /* Number of nodes visited */
 DFS(
-  CallGraph &CG,     /* Call graph */
+  const FlatCallGraph &CG, /* Call graph */
   uintptr_t *ST,     /* Constructed stack trace */
-  uintptr_t STSize,  /* Max size for the stack trace being constructed */
-  uintptr_t EntryPC, /* Entry to the reverse call graph. Updated with each step. */
+  uintptr_t STSize,  /* Max size for the stack trace being constructed, or
+                        depth to join at if meeting in the middle */
+  uint32_t EntryId,  /* Entry to the reverse call graph. Updated with each step. */
   uintptr_t Hash,    /* Current hash for the stack trace being constructed. */
   size_t Depth,      /* Depth taken so far in the DFS. Will be capped by STSize. */
-  size_t kMedHashIdx, /* Medium hash index used for pruning. */
+  const STHashLayout &Layout, /* Checkpoint depths of the hash, for pruning. */
   STInfoSet &STIS,   /* Stack trace set to search matches for. Also update with results. */
-  MedSTSet &MSTS,    /* Set of pruning hashes, one per each ST in STSet. */
+  const CheckpointSets &CPS, /* Checkpoint hashes of the STs in STSet. */
+  const ReachFilter &Reach, /* Lengths of the stack traces in STSet. */
+  const DFSSplit *Split, /* Branches to run as tasks, if searching in parallel. */
+  MeetInMiddle *Meet, /* Upper halves joined at STSize, if meeting in the middle. */
   DFSRes &DFSResult) /* DFS Results. Out. */
 {
   uintptr_t Count = 1; // Number of nodes in the DFS visited. Current node is +1.
   ++DFSResult.VisitedNodeCount;
+  if (DFSResult.VisitedNodeCount > DFSResult.NodeBudget) {
+    DFSResult.OverBudget = true;
+    return Count;
+  }
 
   // Depth is at most STSize, i.e., max depth.
   assert(Depth <= STSize);
 
   // Check for hash matches (or collisions). Record/log any info.
-  if (STIS.count(Hash)) ProcessMatch(STIS, ST, Depth, kMedHashIdx);
+  if (CPS.MayMatch(Hash) && STIS.count(Hash))
+    ProcessMatch(STIS, ST, Depth, Layout);
 
   // Pruning
-  if (Depth == kMedHashIdx && !MSTS.count(Hash)) {
+  int Checkpoint = Depth <= ST_HASH_MAX_CHECKPOINT_DEPTH
+                       ? Layout.CheckpointAt[Depth] : -1;
+  if (Checkpoint >= 0 && !CPS.Contains(Checkpoint, Hash)) {
       ++DFSResult.PruningCount;
+      ++DFSResult.CheckpointPruningCount[Checkpoint];
+      return 1;
+  }
+  if (Depth == STSize && Meet) {
+    if (Meet->Join(ST, EntryId, Hash, Depth, DFSResult))
+      return Count;
+    // Too many upper halves from EntryId: join a level deeper.
+    ++STSize;
+  }
+  if (Depth < STSize && EntryId != FlatCallGraph::kNoFunc &&
+      !Reach.CanExtend(CG.Reach[EntryId], Depth)) {
+      ++DFSResult.ReachPruningCount;
       return 1;
   }
   if (Depth < STSize) {
     // Pull all possible callers for the function
-    const auto &CallerVec = CG.TargetsToCallers[EntryPC];
+    FlatCallGraph::CallerRange CallerVec = CG.GetCallers(EntryId);
 
-    for (auto FuncCall : CallerVec) {
+    for (const CallerEdge &FuncCall : CallerVec) {
       // Take edge
       ST[Depth] = FuncCall.CallSitePc;
+      if (Split && Depth < Split->Depth && Split->Hungry()) {
+        Split->Spawn(ST, FuncCall.CallerId,
+                     HashStep(Hash, FuncCall.CallSitePc, Depth, Layout),
+                     Depth + 1);
+        continue;
+      }
       Count += DFS(
         CG,
         ST,
         STSize,
-        FuncCall.CallerPc, // Updated function entry with edge taken
-        HashStep(Hash, FuncCall.CallSitePc, Depth, kMedHashIdx), // Updated hash
+        FuncCall.CallerId, // Updated function entry with edge taken
+        HashStep(Hash, FuncCall.CallSitePc, Depth, Layout), // Updated hash
         Depth + 1, // Updated depth
-        kMedHashIdx,
+        Layout,
         STIS,
-        MSTS,
+        CPS,
+        Reach,
+        Split,
+        Meet,
         DFSResult);
     }
   } // else (i.e., if max depth is reached), don't visit further nodes.
@@ -167,43 +610,150 @@ DFS(
 
 }
 
+// Depth to meet in the middle at for the stack traces STIS, given the
+// --meet option (SIZE_MAX: default), or 0 not to. The default is the middle
+// of the part of the search the checkpoint hashes don't prune: from the
+// last checkpoint to the longest stack trace.
+size_t MeetDepthFor(const STInfoSet &STIS, const STHashLayout &Layout,
+                    size_t MeetDepth, size_t MaxDepth) {
+  size_t Longest = 0;
+  for (const auto &El : STIS)
+    Longest = std::max(Longest, El.second.Depth);
+  if (MeetDepth == SIZE_MAX) {
+    size_t Last = 0;
+    for (unsigned I = 0; I < Layout.NumCheckpoints; I++)
+      if (Layout.Depths[I] < Longest)
+        Last = Layout.Depths[I];
+    MeetDepth = (Last + Longest + 1) / 2;
+  }
+  // Nothing to join past the longest stack trace.
+  return MeetDepth < std::min(Longest, MaxDepth) ? MeetDepth : 0;
+}
+
 uintptr_t /* Number of nodes visited */
 DFS(
-  CallGraph &CG,      /* Call graph */
-  uintptr_t Func0,    /* Entry point to reverse CG: last function called */
+  const FlatCallGraph &CG, /* Call graph */
+  uint32_t Func0,     /* Entry point to reverse CG: last function called */
   size_t MaxDepth,    /* Maximum depth during DFS */
-  size_t kMedHashIdx, /* Medium hash index used for pruning */
+  const STHashLayout &Layout, /* Checkpoint depths of the hash, for pruning */
   STInfoSet &STIS,    /* Stack trace set. Looks for all traces simultaneously */
-  DFSRes &DFSResult)  /* DFS Results. Out. */
+  bool EndAtRoots,    /* Whether unclipped stack traces end at root functions */
+  size_t MeetDepth,   /* --meet option, see MeetDepthFor() */
+  DFSRes &DFSResult)  /* DFS Results. Out, but for NodeBudget. */
 {
-  // Compute the right shifted hashes used for pruning
-  MedSTSet MSTS;
-  for (auto ST : STIS) MSTS.insert(ST.first >> 32);
+  // Collect the checkpoint hashes used for pruning
+  CheckpointSets CPS(STIS, Layout);
+  ReachFilter Reach(STIS, MaxDepth, EndAtRoots);
+  MeetDepth = MeetDepthFor(STIS, Layout, MeetDepth, MaxDepth);
+  std::unique_ptr<MeetInMiddle> Meet;
+  if (MeetDepth)
+    Meet.reset(new MeetInMiddle(CG, STIS, Layout, Reach, MaxDepth));
   // Create space for stack trace to be used reconstruction
   StackTrace ST(MaxDepth);
 
   return DFS(
     CG,         // reverse call graph
     ST.data(),  // an empty stack trace vector
-    ST.size(),  // size of the empty stack trace vector
-    Func0,      // entry PC
+    MeetDepth ? MeetDepth : ST.size(), // depth of the search
+    Func0,      // entry function id
     0,          // Hash
     0,          // Depth
-    kMedHashIdx, // Medium hash index used for pruning
+    Layout,     // checkpoint depths used for pruning
     STIS,       // hash: stacktrace mappings
-    MSTS,       // hash portions used for pruning
+    CPS,        // hash portions used for pruning
+    Reach,      // stack trace lengths
+    nullptr,    // not split
+    Meet.get(), // upper halves, if meeting in the middle
     DFSResult);
 
 }
 
+// Search of the stack traces of a function, in ParallelDFS.
+struct DFSFunc {
+  uint32_t Func;
+  STInfoSet *STIS;
+  CheckpointSets CPS;
+  ReachFilter Reach;
+  size_t MeetDepth; // See MeetDepthFor().
+};
+
+// Branch of the search, from function EntryId with stack trace ST[0, Depth).
+struct DFSTask {
+  enum : size_t { kSplitDepth = 3 };
+  size_t FuncIdx; // Function searched, in ParallelDFS's Funcs.
+  uint32_t EntryId;
+  uintptr_t Hash;
+  size_t Depth;
+  uintptr_t ST[kSplitDepth];
+};
+
+// Search for the stack traces of several functions, (function, stack trace
+// set) pairs, on Jobs threads. The first levels of the search of each
+// function are split into tasks while the other threads run out of work,
+// and balanced across the threads by work stealing. Each thread counts its
+// results per function, summed into Results[I] for Funcs[I] at the end.
+// Searches meeting in the middle (see MeetDepthFor()) are not split, as
+// their upper halves are shared.
+void
+ParallelDFS(const FlatCallGraph &CG,
+            const std::vector<std::pair<uint32_t, STInfoSet *>> &Funcs,
+            size_t MaxDepth, const STHashLayout &Layout, bool EndAtRoots,
+            size_t MeetDepth, size_t Jobs, std::vector<DFSRes> &Results)
+{
+  std::vector<DFSFunc> Searches;
+  Searches.reserve(Funcs.size());
+  for (const auto &F : Funcs)
+    Searches.push_back({F.first, F.second, CheckpointSets(*F.second, Layout),
+                        ReachFilter(*F.second, MaxDepth, EndAtRoots),
+                        MeetDepthFor(*F.second, Layout, MeetDepth, MaxDepth)});
+
+  TaskPool<DFSTask> Pool(Jobs);
+  // Per thread: space for the stack traces, and the results per function.
+  std::vector<StackTrace> STs(Pool.NumWorkers(), StackTrace(MaxDepth));
+  std::vector<std::vector<DFSRes>> ThreadResults(
+      Pool.NumWorkers(), std::vector<DFSRes>(Funcs.size()));
+  for (size_t I = 0; I < Funcs.size(); I++)
+    Pool.Push(I % Pool.NumWorkers(), DFSTask{I, Funcs[I].first, 0, 0, {}});
+
+  Pool.Run([&](size_t W, const DFSTask &Task) {
+    const DFSFunc &S = Searches[Task.FuncIdx];
+    std::copy(Task.ST, Task.ST + Task.Depth, STs[W].data());
+    // The last level is never split: its tasks would be single nodes.
+    DFSSplit Split = {
+        std::min<size_t>(DFSTask::kSplitDepth, MaxDepth ? MaxDepth - 1 : 0),
+        [&Pool, W]() { return Pool.Hungry(W); },
+        [&](const uintptr_t *ST, uint32_t EntryId, uintptr_t Hash,
+            size_t Depth) {
+          DFSTask Child = {Task.FuncIdx, EntryId, Hash, Depth, {}};
+          std::copy(ST, ST + Depth, Child.ST);
+          Pool.Push(W, Child);
+        }};
+    if (S.MeetDepth) {
+      MeetInMiddle Meet(CG, *S.STIS, Layout, S.Reach, MaxDepth);
+      DFS(CG, STs[W].data(), S.MeetDepth, Task.EntryId, Task.Hash, Task.Depth,
+          Layout, *S.STIS, S.CPS, S.Reach, nullptr, &Meet,
+          ThreadResults[W][Task.FuncIdx]);
+      return;
+    }
+    DFS(CG, STs[W].data(), MaxDepth, Task.EntryId, Task.Hash, Task.Depth,
+        Layout, *S.STIS, S.CPS, S.Reach, &Split, nullptr,
+        ThreadResults[W][Task.FuncIdx]);
+  });
+
+  Results.assign(Funcs.size(), DFSRes());
+  for (const auto &TR : ThreadResults)
+    for (size_t I = 0; I < Funcs.size(); I++)
+      Results[I] += TR[I];
+}
+
 void
 PrintDFSResults(std::ostream &Out, std::ostream &Err,
                 const std::string& FuncName,
-                const CallGraph &CG,
+                const FlatCallGraph &CG,
                 const DFSRes &DFSResults, const STInfoSet &STIS,
-                bool PrintNonDecompST)
+                const STHashLayout &Layout, bool PrintNonDecompST)
 {
-  uintptr_t TotalST = STIS.size();
+  uintptr_t TotalST = 0;
   uintptr_t TotalFoundCorrectly = 0;
   uintptr_t TotalCouldNotFind = 0;
   float PercFoundCorrectly = 0;
@@ -211,28 +761,35 @@ PrintDFSResults(std::ostream &Out, std::ostream &Err,
   uintptr_t TotalIncorrectCollisions = 0;
   uintptr_t TotalDirCallsCorrectlyFound = 0;
   uintptr_t TotalIndirCallsCorrectFound = 0;
+  uintptr_t TotalNotInCG = 0;
 
   if (PrintNonDecompST)
     Err << "== STACK TRACES CAN'T DECOMP FOR \"" << FuncName << "\" ==\n";
   for (const auto &El : STIS) {
-    auto Hash = El.first;
     const auto &STI = El.second;
+    if (!STI.HasFrames())
+      continue;
     
     // TODO: Record these into DFSResults instead of computing here.
+    TotalST++;
     TotalFoundCorrectly += STI.FoundCorrectMatch;
     TotalCouldNotFind += !STI.FoundCorrectMatch;
     TotalHadIncorrectCollisions += (STI.NumHashMatches - STI.FoundCorrectMatch) > 0;
     TotalIncorrectCollisions += STI.NumHashMatches - STI.FoundCorrectMatch;
+    TotalNotInCG += STI.NumValidFrames < STI.ST.size();
 
     if (STI.FoundCorrectMatch) {
       for (const auto& Addr : STI.ST) {
-        TotalDirCallsCorrectlyFound += CG.DirCallSiteAddrs.count(Addr); 
-        TotalIndirCallsCorrectFound += CG.IndirCallSiteAddrs.count(Addr);
+        TotalDirCallsCorrectlyFound += CG.IsDirCallSite(Addr);
+        TotalIndirCallsCorrectFound += CG.IsIndirCallSite(Addr);
       }
     } else if(!STI.FoundCorrectMatch && PrintNonDecompST) {
+      // Frames from the first one not matching the call graph are marked
+      // with '?'.
       Err << FuncName;
-      // TODO: symbolize the addresses as func+offset
-      for (const auto& Addr : STI.ST) Err << " " << std::hex << Addr;
+      for (size_t I = 0; I < STI.ST.size(); I++)
+        Err << (I < STI.NumValidFrames ? " " : " ?")
+            << CG.Symbolize(STI.ST[I]);
       Err << "\n";
     }
   }
@@ -248,6 +805,9 @@ PrintDFSResults(std::ostream &Out, std::ostream &Err,
       << "\nNum decompressed correctly      : " << TotalFoundCorrectly
       // Number of stack traces that could not be decompressed.
       << "\nNum could not be decompressed   : " << TotalCouldNotFind
+      // Number of stack traces with calls that are not in the call graph,
+      // which can't be decompressed.
+      << "\nNum not in the call graph       : " << TotalNotInCG
       // Percentage of correctly decompressed stack trace
       << "\nSuccess rate                    : " << std::fixed << std::setprecision(2)
                                                 << PercFoundCorrectly << "%"
@@ -264,47 +824,610 @@ PrintDFSResults(std::ostream &Out, std::ostream &Err,
       // TODO: document that more pruning does not necessarily mean better
       // performance. Pruning less but at less deeper nodes can be better.
       << "\nNum pruning done                : " << DFSResults.PruningCount
-      << "\n";
+      // Branches cut as they can't end at any of the stack trace lengths.
+      << "\nNum pruned by reachability      : " << DFSResults.ReachPruningCount
+      // Nodes visited up from the middle depth, with --meet.
+      << "\nNum nodes in upper halves       : " << DFSResults.MeetNodeCount;
+  // Pruning at each checkpoint depth, and the share of the branches
+  // expected to pass it: distinct checkpoint hashes of the stack traces over
+  // the number of checkpoint hashes. Fewer bits per checkpoint let more
+  // branches through; more checkpoints cut them sooner.
+  Out << "\nNum pruned per checkpoint       :";
+  for (unsigned I = 0; I < Layout.NumCheckpoints; I++)
+    Out << " " << Layout.Depths[I] << ":"
+        << DFSResults.CheckpointPruningCount[I];
+  Out << "\nCheckpoint pass rate            :";
+  for (unsigned I = 0; I < Layout.NumCheckpoints; I++) {
+    std::unordered_set<uint32_t> Hashes;
+    for (const auto &El : STIS)
+      if (El.second.Depth > Layout.Depths[I])
+        Hashes.insert(HashCheckpoint(El.first, Layout, I));
+    Out << " " << Layout.Depths[I] << ":" << std::defaultfloat
+        << std::setprecision(3)
+        << 100.0 * Hashes.size() / (1ULL << Layout.Bits) << "%";
+  }
+  Out << "\n";
+}
+
+// Print frame PC as in the stack traces, "MODULE_ID:0xOFFSET" in DSOs.
+static void PrintFrame(std::ostream &Out, uintptr_t PC) {
+  if (PC >> CG_MODULE_SHIFT)
+    Out << (PC >> CG_MODULE_SHIFT) << ":";
+  Out << "0x" << std::hex << (PC & ((1ULL << CG_MODULE_SHIFT) - 1))
+      << std::dec;
+}
+
+// Print the stack traces the compressed ones of FuncName were decompressed
+// to, as "FUNCNAME FRAME..." lines of the stack trace format. A "#" line
+// notes the compressed stack traces with no or several matches first.
+void
+PrintDecompressed(std::ostream &Out, const std::string &FuncName,
+                  const std::vector<CompressedST> &CSTs)
+{
+  uintptr_t TotalFromDict = 0, TotalDecompressed = 0, TotalAmbiguous = 0;
+  for (const auto &C : CSTs) {
+    TotalFromDict += C.FromDict;
+    TotalDecompressed += !C.Matches.empty();
+    TotalAmbiguous += C.Matches.size() > 1;
+  }
+  Out << "Num compressed stack traces     : " << CSTs.size()
+      // Found with a lookup rather than a search (see --dict).
+      << "\nNum found in the dictionary     : " << TotalFromDict
+      << "\nNum decompressed                : " << TotalDecompressed
+      // Decompressed to several stack traces, as their hash collides.
+      << "\nNum decompressed ambiguously    : " << TotalAmbiguous << "\n";
+  for (const auto &C : CSTs) {
+    if (C.Matches.size() != 1)
+      Out << "# " << C.Matches.size() << " stack traces for " << FuncName
+          << " !0x" << std::hex << C.Hash << std::dec << " " << C.Depth
+          << "\n";
+    for (const auto &ST : C.Matches) {
+      Out << FuncName;
+      for (uintptr_t PC : ST) {
+        Out << " ";
+        PrintFrame(Out, PC);
+      }
+      Out << "\n";
+    }
+  }
+}
+
+// Id of the function whose stack traces are collected as FuncName, or
+// FlatCallGraph::kNoFunc if not in the call graph.
+static uint32_t FindTracedFunc(const FlatCallGraph &CG,
+                               const std::string &FuncName) {
+  uint32_t Func = CG.FindFuncByName(FuncName);
+  // With the preloaded wrap2trace, calls go to the function itself, e.g.,
+  // to malloc in libwrap2trace.so, rather than to __wrap_malloc.
+  if (Func == FlatCallGraph::kNoFunc && !FuncName.compare(0, 7, "__wrap_"))
+    Func = CG.FindFuncByName(FuncName.substr(7));
+  return Func;
+}
+
+// Compressed stack trace of a call graph, key of the results of the
+// decompression server.
+struct STKey {
+  uint64_t Hash;
+  uint32_t Func;
+  uint32_t Depth;
+  uint32_t Graph;
+
+  bool operator==(const STKey &O) const {
+    return Hash == O.Hash && Func == O.Func && Depth == O.Depth &&
+           Graph == O.Graph;
+  }
+};
+
+struct STKeyHash {
+  size_t operator()(const STKey &K) const {
+    return K.Hash ^ (((uint64_t)K.Graph << 48 | (uint64_t)K.Func << 16 |
+                      K.Depth) * 0x9e3779b97f4a7c15ULL);
+  }
+};
+
+// State of the decompression server, shared by its workers.
+struct ServerContext {
+  std::vector<std::unique_ptr<FlatCallGraph>> CGs;
+  size_t MaxDepth;
+  STHashLayout Layout;
+  bool EndAtRoots;
+  size_t MeetDepth; // --meet option, see MeetDepthFor().
+  uintptr_t NodeBudget; // Of each request, see --budget.
+  // Stack traces found for recent compressed stack traces, none included.
+  LRUCache<STKey, std::vector<StackTrace>, STKeyHash> Cache;
+
+  ServerContext(size_t CacheSize) : Cache(CacheSize) {}
+};
+
+// Read a request (see st_server.hpp) from Fd, and write the response.
+// Returns false if the connection is to be closed.
+static bool ServeRequest(ServerContext &Ctx, int Fd) {
+  STRequestHeader H;
+  if (!ReadFull(Fd, &H, sizeof(H)))
+    return false;
+  STResponseHeader R = {};
+  R.Magic = ST_RESPONSE_MAGIC;
+  R.Version = ST_SERVER_VERSION;
+  if (H.Magic != ST_REQUEST_MAGIC || H.Version != ST_SERVER_VERSION ||
+      H.NumTraces > ST_SERVER_MAX_TRACES ||
+      H.NamesSize > ST_SERVER_MAX_NAMES_SIZE || H.NamesSize % 8) {
+    R.Status = kSTBadRequest;
+    WriteFull(Fd, &R, sizeof(R));
+    return false;
+  }
+  std::vector<STRequestTrace> Traces(H.NumTraces);
+  // With a NUL past the end, so that any offset is a terminated name.
+  std::vector<char> Names(H.NamesSize + 1);
+  if (!ReadFull(Fd, Traces.data(), Traces.size() * sizeof(STRequestTrace)) ||
+      !ReadFull(Fd, Names.data(), H.NamesSize))
+    return false;
+  if (H.Graph >= Ctx.CGs.size()) {
+    R.Status = kSTBadGraph;
+    WriteFull(Fd, &R, sizeof(R));
+    return false;
+  }
+  const FlatCallGraph &CG = *Ctx.CGs[H.Graph];
+
+  // Look the stack traces up in the cache, and collect the others per
+  // function.
+  std::vector<STResponseTrace> RTraces(Traces.size());
+  std::vector<std::vector<StackTrace>> Matches(Traces.size());
+  std::vector<uint32_t> Funcs(Traces.size());
+  std::unordered_map<std::string, uint32_t> FuncIds;
+  std::map<uint32_t, std::vector<size_t>> Misses;
+  for (size_t I = 0; I < Traces.size(); I++) {
+    const STRequestTrace &T = Traces[I];
+    RTraces[I].Depth = T.Depth;
+    if (T.Name >= H.NamesSize) {
+      R.Status = kSTBadRequest;
+      WriteFull(Fd, &R, sizeof(R));
+      return false;
+    }
+    std::string FuncName = &Names[T.Name];
+    auto It = FuncIds.find(FuncName);
+    if (It == FuncIds.end())
+      It = FuncIds.emplace(FuncName, FindTracedFunc(CG, FuncName)).first;
+    Funcs[I] = It->second;
+    if (Funcs[I] == FlatCallGraph::kNoFunc)
+      RTraces[I].Status = kSTUnknownFunc;
+    else if (T.Depth > Ctx.MaxDepth)
+      RTraces[I].Status = kSTTooDeep;
+    else if (!Ctx.Cache.Get({T.Hash, Funcs[I], T.Depth, H.Graph}, Matches[I]))
+      Misses[Funcs[I]].push_back(I);
+  }
+
+  // Search for the misses of each function at once, within the node
+  // budget of the request. Once it is spent, the searches give up: the
+  // stack traces they didn't find are kSTOverBudget, and their results are
+  // not cached, as they may be missing some.
+  uintptr_t Budget = Ctx.NodeBudget;
+  for (const auto &El : Misses) {
+    STInfoSet STIS;
+    for (size_t I : El.second)
+      AddCompressed(STIS, Traces[I].Hash, Traces[I].Depth);
+    DFSRes DFSResult;
+    DFSResult.NodeBudget = Budget;
+    DFS(CG, El.first, Ctx.MaxDepth, Ctx.Layout, STIS, Ctx.EndAtRoots,
+        Ctx.MeetDepth, DFSResult);
+    Budget -= std::min(Budget, DFSResult.VisitedNodeCount);
+    for (size_t I : El.second) {
+      const STRequestTrace &T = Traces[I];
+      Matches[I] = FindCompressed(STIS, T.Hash, T.Depth)->Matches;
+      std::sort(Matches[I].begin(), Matches[I].end());
+      if (!DFSResult.OverBudget)
+        Ctx.Cache.Put({T.Hash, El.first, T.Depth, H.Graph}, Matches[I]);
+      else if (Matches[I].empty())
+        RTraces[I].Status = kSTOverBudget;
+    }
+  }
+
+  std::vector<uint64_t> Frames;
+  std::string Symbols;
+  for (size_t I = 0; I < Traces.size(); I++) {
+    if (RTraces[I].Status == kSTOk && Matches[I].empty())
+      RTraces[I].Status = kSTNotFound;
+    RTraces[I].NumMatches = Matches[I].size();
+    for (const auto &ST : Matches[I])
+      for (uintptr_t PC : ST) {
+        Frames.push_back(PC);
+        Symbols += CG.Symbolize(PC);
+        Symbols += '\0';
+      }
+  }
+  Symbols.resize(AlignTo8(Symbols.size()));
+  R.NumTraces = RTraces.size();
+  R.NumFrames = Frames.size();
+  R.SymbolsSize = Symbols.size();
+  return WriteFull(Fd, &R, sizeof(R)) &&
+         WriteFull(Fd, RTraces.data(),
+                   RTraces.size() * sizeof(STResponseTrace)) &&
+         WriteFull(Fd, Frames.data(), Frames.size() * sizeof(uint64_t)) &&
+         WriteFull(Fd, Symbols.data(), Symbols.size());
+}
+
+// Serve decompression requests on the Unix domain socket at Path, with
+// Jobs workers. The main thread polls the listening socket and the idle
+// connections, and queues the connections with a request for the workers,
+// which serve that one request and hand the connection back: idle clients
+// hold no worker. Clients stalling in the middle of a request or response
+// are cut off after kTimeout, and connections past kMaxConns are closed
+// once accepted, which also bounds the queue. Only returns if the socket
+// can't be set up, or poll() or accept() fails, once the workers are done.
+static int Serve(ServerContext &Ctx, const char *Path, size_t Jobs) {
+  enum : int { kMaxConns = 256, kTimeout = 5 /* seconds */ };
+  // Clients going away are noticed as write errors.
+  signal(SIGPIPE, SIG_IGN);
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  if (strlen(Path) >= sizeof(Addr.sun_path)) {
+    fprintf(stderr, "Error: socket path \"%s\" too long.\n", Path);
+    return 1;
+  }
+  strcpy(Addr.sun_path, Path);
+  // Remove the socket of a previous server, but nothing else.
+  struct stat St;
+  if (!lstat(Path, &St) && S_ISSOCK(St.st_mode))
+    unlink(Path);
+  int Sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Sock < 0 || bind(Sock, (sockaddr *)&Addr, sizeof(Addr)) ||
+      listen(Sock, SOMAXCONN)) {
+    perror("Error: can't listen on the socket");
+    return 1;
+  }
+  // The workers write to Wake when handing a connection back, to wake up
+  // poll(). Neither end blocks: a full pipe already wakes it up.
+  int Wake[2];
+  if (pipe(Wake) || fcntl(Sock, F_SETFL, O_NONBLOCK) ||
+      fcntl(Wake[0], F_SETFL, O_NONBLOCK) ||
+      fcntl(Wake[1], F_SETFL, O_NONBLOCK)) {
+    perror("Error: can't set up the socket");
+    return 1;
+  }
+  std::cout << "Serving on " << Path << " with " << Jobs << " workers"
+            << std::endl;
+
+  std::mutex Lock;
+  std::condition_variable Ready;
+  std::deque<int> Queue;   // Connections with a request.
+  std::vector<int> Served; // Connections handed back, -1 if closed.
+  bool Stop = false;
+  auto Work = [&]() {
+    for (;;) {
+      int Fd;
+      {
+        std::unique_lock<std::mutex> Guard(Lock);
+        Ready.wait(Guard, [&]() { return Stop || !Queue.empty(); });
+        if (Stop)
+          return;
+        Fd = Queue.front();
+        Queue.pop_front();
+      }
+      if (!ServeRequest(Ctx, Fd)) {
+        close(Fd);
+        Fd = -1;
+      }
+      {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Served.push_back(Fd);
+      }
+      char C = 0;
+      while (write(Wake[1], &C, 1) < 0 && errno == EINTR)
+        ;
+    }
+  };
+  std::vector<std::thread> Workers;
+  for (size_t W = 0; W < Jobs; W++)
+    Workers.emplace_back(Work);
+
+  std::vector<int> Idle; // Connections waiting for a request.
+  size_t NumConns = 0;
+  std::vector<pollfd> Fds;
+  for (;;) {
+    Fds.clear();
+    Fds.push_back({Sock, POLLIN, 0});
+    Fds.push_back({Wake[0], POLLIN, 0});
+    for (int Fd : Idle)
+      Fds.push_back({Fd, POLLIN, 0});
+    if (poll(Fds.data(), Fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Error: can't poll the connections");
+      break;
+    }
+
+    // Queue the connections with a request, or closed by the client, which
+    // the worker notices.
+    Idle.clear();
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      for (size_t I = 2; I < Fds.size(); I++) {
+        if (Fds[I].revents)
+          Queue.push_back(Fds[I].fd);
+        else
+          Idle.push_back(Fds[I].fd);
+      }
+    }
+    Ready.notify_all();
+
+    if (Fds[1].revents) {
+      char Buf[64];
+      while (read(Wake[0], Buf, sizeof(Buf)) > 0)
+        ;
+      std::lock_guard<std::mutex> Guard(Lock);
+      for (int Fd : Served) {
+        if (Fd < 0)
+          --NumConns;
+        else
+          Idle.push_back(Fd);
+      }
+      Served.clear();
+    }
+
+    if (Fds[0].revents) {
+      int Fd = accept(Sock, nullptr, nullptr);
+      if (Fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN ||
+            errno == EWOULDBLOCK)
+          continue;
+        perror("Error: can't accept connections");
+        break;
+      }
+      if (NumConns >= kMaxConns) {
+        close(Fd);
+        continue;
+      }
+      timeval Timeout = {kTimeout, 0};
+      setsockopt(Fd, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+      setsockopt(Fd, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+      ++NumConns;
+      Idle.push_back(Fd);
+    }
+  }
+
+  // Let the workers finish the requests they are serving, and close
+  // everything.
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Stop = true;
+  }
+  Ready.notify_all();
+  for (std::thread &W : Workers)
+    W.join();
+  for (int Fd : Queue)
+    close(Fd);
+  for (int Fd : Served)
+    if (Fd >= 0)
+      close(Fd);
+  for (int Fd : Idle)
+    close(Fd);
+  close(Wake[0]);
+  close(Wake[1]);
+  close(Sock);
+  return 1;
 }
 
 int main(int argc, char **argv) {
-  if (argc != 5 && argc != 6) {
+  // Options, then positional arguments.
+  const char *CachePath = nullptr;
+  const char *DictPath = nullptr;
+  const char *ServePath = nullptr;
+  std::vector<const char *> GraphPaths; // Call graphs served after (1).
+  size_t CacheSize = 1 << 16;
+  uintptr_t NodeBudget = 100000000;
+  std::vector<ModuleSource> ModuleCGs;
+  bool TraceModules = false;
+  bool EndAtRoots = false;
+  int Jobs = 1;
+  // Depth to meet in the middle at; SIZE_MAX for the default, 0 not to.
+  size_t MeetDepth = 0;
+  int NumOpts = 0;
+  for (; 1 + NumOpts < argc && argv[1 + NumOpts][0] == '-'; NumOpts++) {
+    const char *Opt = argv[1 + NumOpts];
+    unsigned Id;
+    int PathPos = 0;
+    if (!strncmp(Opt, "--cg-cache=", 11))
+      CachePath = Opt + 11;
+    else if (!strncmp(Opt, "--dict=", 7))
+      DictPath = Opt + 7;
+    else if (!strncmp(Opt, "--serve=", 8) && Opt[8])
+      ServePath = Opt + 8;
+    else if (!strncmp(Opt, "--graph=", 8) && Opt[8])
+      GraphPaths.push_back(Opt + 8);
+    else if (!strncmp(Opt, "--cache-size=", 13))
+      CacheSize = strtoull(Opt + 13, nullptr, 10);
+    else if (!strncmp(Opt, "--budget=", 9))
+      NodeBudget = strtoull(Opt + 9, nullptr, 10);
+    else if (sscanf(Opt, "--module=%u:%n", &Id, &PathPos) == 1 && PathPos &&
+             Id && Opt[PathPos])
+      ModuleCGs.push_back({Id, Opt + PathPos});
+    else if (!strcmp(Opt, "--trace-modules"))
+      TraceModules = true;
+    else if (!strcmp(Opt, "--prune-roots"))
+      EndAtRoots = true;
+    else if (!strcmp(Opt, "--meet"))
+      MeetDepth = SIZE_MAX;
+    else if (!strncmp(Opt, "--meet=", 7) && atoi(Opt + 7) > 0)
+      MeetDepth = atoi(Opt + 7);
+    else if (!strcmp(Opt, "-j") && 2 + NumOpts < argc)
+      Jobs = atoi(argv[1 + ++NumOpts]);
+    else if (!strncmp(Opt, "-j", 2) && Opt[2])
+      Jobs = atoi(Opt + 2);
+    else
+      argc = 0; // Unknown option.
+  }
+  if (Jobs == 0)
+    Jobs = std::max(1u, std::thread::hardware_concurrency());
+  if (Jobs < 0)
+    argc = 0;
+  argv += NumOpts;
+  argc -= NumOpts;
+
+  if (ServePath ? argc != 4 : argc != 5 && argc != 6) {
     // TODO: print info on CLI.
     std::cerr << "Error: CLI" << std::endl;
-    // 1: call graph disassembly output
+    // 1: call graph disassembly output, or the binary itself
     // 2: stack trace set
     // 3: funcname
     // 4: depth
-    // 5: medium hash index used for pruning
+    // 5: checkpoint depths of the hash used for pruning, "D" or
+    //    "D1,D2,..." (see common/st_hash.hpp), as given to wrap2trace
     // 6: (optional) set to non-zero to print stack traces that could not 
     //    be decompressed.
+    // Options, before the arguments:
+    //   --cg-cache=PATH: binary cache of the call graph (see cg_cache.hpp),
+    //    used if built from the same call graph disassembly output, and
+    //    (re)written otherwise.
+    //   --module=ID:PATH: call graph (disassembly output or binary) of the
+    //    DSO with module id ID in the stack traces, merged with the call
+    //    graph of the executable (1). Can be repeated.
+    //   --trace-modules: merge the call graphs of all the DSOs listed in the
+    //    module table of the stack traces, read from the binaries.
+    //   --prune-roots: assume that stack traces shorter than the max depth
+    //    end at a root function (see FuncReach), and cut the branches of
+    //    the search that can't reach one at the right depth.
+    //   -j N: search on N threads (0: one per core), across the functions
+    //    and the branches of the search of each (see ParallelDFS).
+    //   --meet[=M]: search up to depth M and join with the paths up from
+    //    there, hashed once per function (see MeetInMiddle). The default is
+    //    halfway from the last hash checkpoint to the longest stack trace.
+    //   --dict=PATH: dictionary of decompressed stack traces (see
+    //    st_dict.hpp): the compressed stack traces ("FUNCNAME !HASH DEPTH")
+    //    found there are not searched for, and those searched for are added.
+    //   --serve=SOCKET: serve decompression requests (see st_server.hpp) on
+    //    the Unix domain socket SOCKET, with the -j N workers, instead of
+    //    reading stack traces. The arguments are then (1), (4) and (5).
+    //   --graph=PATH: (--serve) another call graph to serve, as (1). Can be
+    //    repeated; requests name call graphs by their order, (1) first.
+    //   --cache-size=N: (--serve) number of recent results kept.
+    //   --budget=N: (--serve) number of nodes the searches of a request may
+    //    visit, 100 million by default, 0 for no limit. The stack traces
+    //    not found within it are answered as over budget.
+    return 1;
+  }
+
+  if (ServePath) {
+    ServerContext Ctx(CacheSize);
+    Ctx.MaxDepth = atoi(argv[2]);
+    Ctx.EndAtRoots = EndAtRoots;
+    Ctx.MeetDepth = MeetDepth;
+    Ctx.NodeBudget = NodeBudget ? NodeBudget : UINTPTR_MAX;
+    if (!ParseHashLayout(argv[3], Ctx.Layout)) {
+      std::cerr << "Error: invalid hash checkpoints \"" << argv[3] << "\""
+                << std::endl;
+      return 1;
+    }
+    // The DSOs merged with (1), and the cache of each call graph, numbered
+    // after the first.
+    GraphPaths.insert(GraphPaths.begin(), argv[1]);
+    for (size_t I = 0; I < GraphPaths.size(); I++) {
+      std::vector<ModuleSource> Sources = {{0, GraphPaths[I]}};
+      if (!I)
+        Sources.insert(Sources.end(), ModuleCGs.begin(), ModuleCGs.end());
+      std::sort(Sources.begin(), Sources.end(),
+                [](const ModuleSource &A, const ModuleSource &B) {
+                  return A.Id < B.Id;
+                });
+      std::string GraphCachePath =
+          CachePath ? CachePath + (I ? "." + std::to_string(I) : "") : "";
+      Ctx.CGs.emplace_back(new FlatCallGraph);
+      if (!LoadCallGraph(Sources,
+                         CachePath ? GraphCachePath.c_str() : nullptr,
+                         *Ctx.CGs.back())) {
+        std::cerr << "Error: can't read the call graph from \""
+                  << GraphPaths[I] << "\"" << std::endl;
+        return 1;
+      }
+    }
+    return Serve(Ctx, ServePath, Jobs);
+  }
+
+  // Read depth
+  size_t Depth = atoi(argv[3]);
+
+  // Read the checkpoint depths of the hash used for pruning
+  STHashLayout Layout;
+  if (!ParseHashLayout(argv[4], Layout)) {
+    std::cerr << "Error: invalid hash checkpoints \"" << argv[4] << "\""
+              << std::endl;
     return 1;
   }
+  std::cout << "Hash checkpoints                : " << argv[4] << " ("
+            << Layout.Bits << " bits each)" << std::endl;
 
-  // TODO: support multiple hashes. Currently, whole stack trace is
-  // compressed into a single hash value with a single kMedHashIdx. Instead,
-  // support multiple hash values computed at some frequency (e.g., per 8
-  // frames).
+  // Read stack traces, and the modules they refer to
+  ModuleIndex Modules;
+  std::unordered_map<std::string /*FuncName*/, std::vector<CompressedST>>
+      CSTS;
+  auto STS = ReadStackTraces(argv[2], Depth, Layout, Jobs, Modules, CSTS);
+  // Decompress each compressed stack trace once.
+  for (auto &El : CSTS) {
+    auto &CSTs = El.second;
+    auto Less = [](const CompressedST &A, const CompressedST &B) {
+      return std::make_pair(A.Hash, A.Depth) < std::make_pair(B.Hash, B.Depth);
+    };
+    std::sort(CSTs.begin(), CSTs.end(), Less);
+    CSTs.erase(std::unique(CSTs.begin(), CSTs.end(),
+                           [](const CompressedST &A, const CompressedST &B) {
+                             return A.Hash == B.Hash && A.Depth == B.Depth;
+                           }),
+               CSTs.end());
+  }
 
-  // Read the call graph (disassembly output).
-  std::ifstream CGIn(argv[1]);
-  CallGraph CG(CGIn);
+  // Call graphs of the executable (module 0) and of the DSOs, in load order.
+  ModuleCGs.insert(ModuleCGs.begin(), {0, argv[1]});
+  if (TraceModules) {
+    for (const auto &M : Modules.GetModules()) {
+      if (std::any_of(ModuleCGs.begin(), ModuleCGs.end(),
+                      [&M](const ModuleSource &S) { return S.Id == M.Id; }))
+        continue;
+      // E.g., the vDSO has no file.
+      if (access(M.Path.c_str(), R_OK)) {
+        fprintf(stderr, "WARNING: no call graph for module %u (\"%s\").\n",
+                M.Id, M.Path.c_str());
+        continue;
+      }
+      ModuleCGs.push_back({M.Id, M.Path});
+    }
+  }
+  std::sort(ModuleCGs.begin(), ModuleCGs.end(),
+            [](const ModuleSource &A, const ModuleSource &B) {
+              return A.Id < B.Id;
+            });
+
+  // Read the call graph (disassembly output), or its cache.
+  auto LoadStart = std::chrono::steady_clock::now();
+  FlatCallGraph CG;
+  if (!LoadCallGraph(ModuleCGs, CachePath, CG)) {
+    std::cerr << "Error: can't read the call graph from \"" << argv[1]
+              << "\"" << std::endl;
+    return 1;
+  }
+  double LoadSeconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - LoadStart).count();
+  std::cout << "Call graph load time            : " << std::fixed
+            << std::setprecision(3) << LoadSeconds << " s"
+            << (CG.FromCache ? " (cached)" : "") << std::endl;
   //CG.Print(std::cerr);
 
+  // The dictionary holds the results of searches in this call graph, with
+  // this hash and these options.
+  std::unique_ptr<STDict> Dict;
+  if (DictPath) {
+    std::vector<uint64_t> Keys = {CG.Fingerprint(), EndAtRoots, Depth,
+                                  Layout.NumCheckpoints};
+    Keys.insert(Keys.end(), Layout.Depths,
+                Layout.Depths + Layout.NumCheckpoints);
+    Dict.reset(new STDict(HashDump((const char *)Keys.data(),
+                                   Keys.size() * sizeof(uint64_t))));
+    Dict->Open(DictPath);
+    std::cout << "Decompression dictionary        : " << Dict->size()
+              << " entries" << std::endl;
+  }
+
   //std::cout << "\n== Reverse call graph ==" << std::endl;
   //CG.PrintReverseCG(std::cout, false);
   //std::cout << "\n==\n" << std::endl;
 
-  // Read depth
-  size_t Depth = atoi(argv[3]);
-
-  // Read medium hash index used for pruning
-  size_t kMedHashIdx = atoi(argv[4]);
-
-  // Read stack traces
-  std::ifstream TargetStacksIn(argv[2]);
-  auto STS = ReadStackTraces(TargetStacksIn, Depth, kMedHashIdx);
-
   // Whether to print stack traces that could not be recovered
   bool PrintNonDecompST = argc == 6 && atoi(argv[5]);
 
@@ -318,23 +1441,86 @@ int main(int argc, char **argv) {
       .ST = ST.second,
       .Hash = ST.first,
       .NumHashMatches = 0,
-      .FoundCorrectMatch = false };
-      STIS[FuncName][ST.first] = STI;
+      .FoundCorrectMatch = false,
+      .NumValidFrames = 0,
+      .Depth = ST.second.size(),
+      .Compressed = false,
+      .Matches = {} };
+      STIS[FuncName].emplace(ST.first, std::move(STI));
     }
   }
+  for (auto &El : CSTS)
+    STIS[El.first];
 
-  DFSRes DFSResult;
+  // Functions to search from, in the order of the results.
+  std::vector<std::pair<uint32_t, STInfoSet *>> Funcs;
+  for (auto &El : STIS) {
+    const std::string &FuncName = El.first;
+    uint32_t Func = FindTracedFunc(CG, FuncName);
+    STInfoSet &FSTIS = El.second;
+    for (auto &STI : FSTIS)
+      STI.second.NumValidFrames = CG.ValidateStackTrace(
+          Func, STI.second.ST.data(), STI.second.ST.size());
+    // Look the compressed stack traces up, and search for the others. Those
+    // deeper than the search can't be found.
+    for (auto &C : CSTS[FuncName]) {
+      STDict::Traces Found;
+      if (Dict && Func != FlatCallGraph::kNoFunc &&
+          Dict->Lookup(Func, C.Hash, C.Depth, Found)) {
+        C.FromDict = true;
+        for (size_t I = 0; I < Found.Num; I++)
+          C.Matches.emplace_back(Found.Frames + I * Found.Depth,
+                                 Found.Frames + (I + 1) * Found.Depth);
+        continue;
+      }
+      if (C.Depth <= Depth)
+        AddCompressed(FSTIS, C.Hash, C.Depth);
+    }
+    Funcs.push_back({Func, &FSTIS});
+  }
 
+  // With several threads, search for all the functions at once first.
+  std::vector<DFSRes> FuncResults;
+  if (Jobs > 1)
+    ParallelDFS(CG, Funcs, Depth, Layout, EndAtRoots, MeetDepth, Jobs,
+                FuncResults);
+
+  DFSRes DFSResult;
+  size_t I = 0;
   for (auto &El : STIS) {
     std::string FuncName = El.first;
     std::cout << "=== FUNC: \"" << FuncName << "\" ===" << std::endl;
-    auto PC = CG.FuncNameToAddr[FuncName];
     STInfoSet &FSTIS = El.second;
+    uint32_t Func = Funcs[I].first;
     std::cout << "Starting DFS.. " << std::endl;
-    uintptr_t Count = DFS(CG, PC, Depth, kMedHashIdx, FSTIS, DFSResult);
+    if (Jobs > 1)
+      DFSResult += FuncResults[I];
+    else
+      DFS(CG, Func, Depth, Layout, FSTIS, EndAtRoots, MeetDepth, DFSResult);
+    I++;
     std::cout << "Finished DFS. Printing the results.." << std::endl;
-    PrintDFSResults(std::cout, std::cerr, FuncName, CG, DFSResult, FSTIS, PrintNonDecompST);
+    PrintDFSResults(std::cout, std::cerr, FuncName, CG, DFSResult, FSTIS, Layout,
+                    PrintNonDecompST);
+
+    // Collect the matches of the compressed stack traces searched for, in a
+    // stable order, and add them to the dictionary.
+    auto &CSTs = CSTS[FuncName];
+    for (auto &C : CSTs) {
+      const STInfo *STI = FindCompressed(FSTIS, C.Hash, C.Depth);
+      if (C.FromDict || !STI)
+        continue;
+      C.Matches = STI->Matches;
+      std::sort(C.Matches.begin(), C.Matches.end());
+      if (Dict && Func != FlatCallGraph::kNoFunc)
+        Dict->Add(Func, C.Hash, C.Depth, C.Matches);
+    }
+    if (!CSTs.empty())
+      PrintDecompressed(std::cout, FuncName, CSTs);
     std::cout << std::endl;
   }
+
+  if (Dict && Dict->NumAdded() && !Dict->Write(DictPath))
+    fprintf(stderr, "WARNING: can't write the decompression dictionary "
+                    "\"%s\".\n", DictPath);
   return 0;
 }
\ No newline at end of file
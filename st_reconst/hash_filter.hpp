@@ -0,0 +1,56 @@
+// Bloom filter of 64-bit hashes, in front of the hash table lookups of the
+// search (see CheckpointSets in cg_reconst.cpp).
+//
+// The search checks the hash of every node it visits against the stack
+// traces, and nearly all of these checks fail. The filter answers them with
+// a single load: each hash selects a 64-bit word, and sets kBitsSet bits of
+// it (a register-blocked Bloom filter). With kBitsPerKey bits per hash, the
+// filter of tens of thousands of stack traces fits in L2, and lets about 1
+// in 100 misses through to the hash table.
+
+#ifndef __HASH_FILTER_H__
+#define __HASH_FILTER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class HashFilter {
+  enum : unsigned { kBitsSet = 4, kBitsPerKey = 16 };
+  std::vector<uint64_t> Words;
+
+  // The hashes of stack traces are not mixed: their upper bits are 0 for
+  // short stack traces. The word is picked by the upper half of the
+  // product, the bits by the lower half, which depends on the CRC32.
+  static uint64_t Mix(uint64_t H) {
+    return (H ^ H >> 32) * 0x9e3779b97f4a7c15ULL;
+  }
+
+  size_t WordOf(uint64_t H) const { return (H >> 32) * Words.size() >> 32; }
+
+  static uint64_t Mask(uint64_t H) {
+    uint64_t M = 0;
+    for (unsigned I = 0; I < kBitsSet; I++)
+      M |= 1ULL << (H >> (8 + 6 * I) & 63);
+    return M;
+  }
+
+public:
+  // For NumKeys hashes.
+  explicit HashFilter(size_t NumKeys = 0)
+      : Words(NumKeys * kBitsPerKey / 64 + 1) {}
+
+  void Add(uint64_t H) {
+    H = Mix(H);
+    Words[WordOf(H)] |= Mask(H);
+  }
+
+  // False if H was not added; true if it was, and for a few others.
+  bool MayContain(uint64_t H) const {
+    H = Mix(H);
+    uint64_t M = Mask(H);
+    return (Words[WordOf(H)] & M) == M;
+  }
+};
+
+#endif
@@ -0,0 +1,64 @@
+// Bounded cache of recent results, evicting the least recently used, for
+// the decompression server (see Serve in cg_reconst.cpp).
+//
+// Workers look up and insert concurrently; a single mutex guards the list
+// and the index, as lookups are short next to the searches they save.
+
+#ifndef __LRU_CACHE_H__
+#define __LRU_CACHE_H__
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+template <typename K, typename V, typename KeyHash = std::hash<K>>
+class LRUCache {
+  typedef std::list<std::pair<K, V>> List;
+  List Entries; // Most recently used first.
+  std::unordered_map<K, typename List::iterator, KeyHash> Index;
+  size_t Capacity;
+  mutable std::mutex Lock;
+
+public:
+  LRUCache(size_t Capacity) : Capacity(Capacity) {}
+
+  // Copy the value of Key to Res, and make it the most recently used.
+  // Returns false if Key is not cached.
+  bool Get(const K &Key, V &Res) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Index.find(Key);
+    if (It == Index.end())
+      return false;
+    Entries.splice(Entries.begin(), Entries, It->second);
+    Res = It->second->second;
+    return true;
+  }
+
+  // Cache Value for Key, evicting the least recently used entry if full.
+  void Put(const K &Key, V Value) {
+    if (!Capacity)
+      return;
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Index.find(Key);
+    if (It != Index.end()) {
+      It->second->second = std::move(Value);
+      Entries.splice(Entries.begin(), Entries, It->second);
+      return;
+    }
+    if (Index.size() == Capacity) {
+      Index.erase(Entries.back().first);
+      Entries.pop_back();
+    }
+    Entries.emplace_front(Key, std::move(Value));
+    Index[Key] = Entries.begin();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> Guard(Lock);
+    return Index.size();
+  }
+};
+
+#endif
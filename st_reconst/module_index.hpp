@@ -0,0 +1,79 @@
+// Modules (executable and DSOs) of the traced process, read from the module
+// table of the stack traces ("# module ID BIAS START END PATH" lines, see
+// wrap2trace/module_map.hpp).
+//
+// Frames in DSOs are printed as "MODULE_ID:OFFSET" and keyed as (module id,
+// offset) in the merged call graph (see CG_MODULE_SHIFT). Frames printed as
+// plain runtime addresses, e.g., by unwinders that don't translate them, are
+// mapped to their module with a binary search over the sorted address
+// ranges of the modules.
+
+#ifndef __MODULE_INDEX_H__
+#define __MODULE_INDEX_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "cg.hpp"
+
+struct TraceModule {
+  uint32_t Id;
+  uintptr_t Bias;  // Load bias: runtime address - address in the binary.
+  uintptr_t Start; // Runtime address range of the executable segments.
+  uintptr_t End;
+  std::string Path;
+};
+
+class ModuleIndex {
+  // Sorted by start address.
+  std::vector<TraceModule> Modules;
+
+public:
+  // Add the module of a "# module ID BIAS START END PATH" line. Returns
+  // false if Line is not a module line.
+  bool AddLine(const std::string &Line) {
+    unsigned Id;
+    unsigned long Bias, Start, End;
+    int PathPos = 0;
+    if (sscanf(Line.c_str(), "# module %u %lx %lx %lx %n", &Id, &Bias, &Start,
+               &End, &PathPos) != 4 || !PathPos)
+      return false;
+    TraceModule M = {Id, Bias, Start, End, Line.substr(PathPos)};
+    auto It = std::upper_bound(Modules.begin(), Modules.end(), M.Start,
+                               [](uintptr_t Addr, const TraceModule &M) {
+                                 return Addr < M.Start;
+                               });
+    Modules.insert(It, std::move(M));
+    return true;
+  }
+
+  // Module whose address range contains Addr, or nullptr. A return address
+  // might point right past the last instruction.
+  const TraceModule *Find(uintptr_t Addr) const {
+    auto It = std::upper_bound(Modules.begin(), Modules.end(), Addr,
+                               [](uintptr_t Addr, const TraceModule &M) {
+                                 return Addr < M.Start;
+                               });
+    if (It == Modules.begin() || Addr > (It - 1)->End)
+      return nullptr;
+    return &*(It - 1);
+  }
+
+  // Key of a frame in the merged call graph: frames with no module id that
+  // are runtime addresses in a known module become (module id, offset).
+  uintptr_t Translate(uintptr_t Frame) const {
+    if (Frame >> CG_MODULE_SHIFT)
+      return Frame;
+    const TraceModule *M = Find(Frame);
+    if (!M)
+      return Frame;
+    return ((uintptr_t)M->Id << CG_MODULE_SHIFT) | (Frame - M->Bias);
+  }
+
+  const std::vector<TraceModule> &GetModules() const { return Modules; }
+};
+
+#endif
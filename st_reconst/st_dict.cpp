@@ -0,0 +1,147 @@
+#include "st_dict.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(STDictEntry) == 24, "STDictEntry is stored as is");
+static_assert(sizeof(STDictHeader) % 8 == 0, "Arrays are 8-byte aligned");
+
+// First slot to probe for a key, in a table of Mask + 1 slots.
+static size_t SlotOf(uint32_t Func, uint64_t Hash, size_t Depth,
+                     size_t Mask) {
+  uint64_t Key = Hash ^ (((uint64_t)Func << 16 | Depth) *
+                         0x9e3779b97f4a7c15ULL);
+  Key ^= Key >> 32;
+  return (Key * 0x9e3779b97f4a7c15ULL >> 32) & Mask;
+}
+
+// Slot of the key in Slots, or of the empty slot it would go to; NumSlots
+// if neither, i.e., if the table is full.
+static size_t FindSlot(const STDictEntry *Slots, size_t NumSlots,
+                       uint32_t Func, uint64_t Hash, size_t Depth) {
+  size_t Mask = NumSlots - 1;
+  size_t I = SlotOf(Func, Hash, Depth, Mask);
+  for (size_t N = 0; N < NumSlots; N++, I = (I + 1) & Mask)
+    if (Slots[I].Func == STDict::kEmpty ||
+        (Slots[I].Func == Func && Slots[I].Hash == Hash &&
+         Slots[I].Depth == Depth))
+      return I;
+  return NumSlots;
+}
+
+STDict::~STDict() {
+  if (Mapping)
+    munmap((void *)Mapping, MappingSize);
+}
+
+bool STDict::Open(const char *Path) {
+  int Fd = open(Path, O_RDONLY);
+  struct stat St;
+  if (Fd < 0 || fstat(Fd, &St) ||
+      (size_t)St.st_size < sizeof(STDictHeader)) {
+    if (Fd >= 0) close(Fd);
+    return false;
+  }
+  size_t Size = St.st_size;
+  void *Data = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+  close(Fd);
+  if (Data == MAP_FAILED)
+    return false;
+  const STDictHeader &H = *(const STDictHeader *)Data;
+  size_t SlotsSize = H.NumSlots * sizeof(STDictEntry);
+  if (memcmp(H.Magic, ST_DICT_MAGIC, sizeof(H.Magic)) ||
+      H.Version != ST_DICT_VERSION || H.Fingerprint != Fingerprint ||
+      !H.NumSlots || (H.NumSlots & (H.NumSlots - 1)) ||
+      H.NumSlots > Size / sizeof(STDictEntry) ||
+      H.NumFrames > Size / sizeof(uint64_t) ||
+      sizeof(H) + SlotsSize + H.NumFrames * sizeof(uint64_t) != Size) {
+    munmap(Data, Size);
+    return false;
+  }
+  Mapping = Data;
+  MappingSize = Size;
+  Slots.Data = (const STDictEntry *)((const char *)Data + sizeof(H));
+  Slots.Size = H.NumSlots;
+  Frames.Data = (const uint64_t *)((const char *)Slots.Data + SlotsSize);
+  Frames.Size = H.NumFrames;
+  NumMapped = H.NumEntries;
+  return true;
+}
+
+bool STDict::Lookup(uint32_t Func, uint64_t Hash, size_t Depth,
+                    Traces &Res) const {
+  size_t I = FindSlot(Slots.Data, Slots.Size, Func, Hash, Depth);
+  if (I == Slots.Size)
+    return false;
+  const STDictEntry &E = Slots[I];
+  // Entries are checked against the frames on use, not all on Open().
+  if (E.Func == kEmpty ||
+      E.FirstFrame + (uint64_t)E.NumTraces * E.Depth > Frames.Size)
+    return false;
+  Res.Frames = Frames.Data + E.FirstFrame;
+  Res.Depth = E.Depth;
+  Res.Num = E.NumTraces;
+  return true;
+}
+
+void STDict::Add(uint32_t Func, uint64_t Hash, size_t Depth,
+                 const std::vector<std::vector<uintptr_t>> &STs) {
+  if (Depth > kMaxDepth || Func == kEmpty)
+    return;
+  size_t Num = std::min(STs.size(), (size_t)kMaxTraces);
+  Added.push_back({Hash, Func, (uint16_t)Depth, (uint16_t)Num,
+                   AddedFrames.size()});
+  for (size_t I = 0; I < Num; I++)
+    AddedFrames.insert(AddedFrames.end(), STs[I].begin(), STs[I].end());
+}
+
+bool STDict::Write(const char *Path) const {
+  // At most half full.
+  size_t NumSlots = 16;
+  while (NumSlots < 2 * size())
+    NumSlots *= 2;
+  std::vector<STDictEntry> NewSlots(NumSlots);
+  for (auto &E : NewSlots)
+    E.Func = kEmpty;
+  std::vector<uint64_t> NewFrames;
+  size_t NumEntries = 0;
+  auto Insert = [&](const STDictEntry &E, const uint64_t *EFrames) {
+    STDictEntry &Slot =
+        NewSlots[FindSlot(NewSlots.data(), NumSlots, E.Func, E.Hash, E.Depth)];
+    if (Slot.Func != kEmpty)
+      return;
+    Slot = E;
+    Slot.FirstFrame = NewFrames.size();
+    NewFrames.insert(NewFrames.end(), EFrames,
+                     EFrames + (size_t)E.NumTraces * E.Depth);
+    NumEntries++;
+  };
+  for (const auto &E : Added)
+    Insert(E, AddedFrames.data() + E.FirstFrame);
+  for (const auto &E : Slots)
+    if (E.Func != kEmpty &&
+        E.FirstFrame + (uint64_t)E.NumTraces * E.Depth <= Frames.Size)
+      Insert(E, Frames.Data + E.FirstFrame);
+
+  STDictHeader H = {};
+  memcpy(H.Magic, ST_DICT_MAGIC, sizeof(H.Magic));
+  H.Version = ST_DICT_VERSION;
+  H.Fingerprint = Fingerprint;
+  H.NumSlots = NumSlots;
+  H.NumEntries = NumEntries;
+  H.NumFrames = NewFrames.size();
+  std::vector<char> Image(sizeof(H) + NumSlots * sizeof(STDictEntry) +
+                          NewFrames.size() * sizeof(uint64_t));
+  char *Out = Image.data();
+  memcpy(Out, &H, sizeof(H));
+  Out += sizeof(H);
+  memcpy(Out, NewSlots.data(), NumSlots * sizeof(STDictEntry));
+  Out += NumSlots * sizeof(STDictEntry);
+  if (!NewFrames.empty())
+    memcpy(Out, NewFrames.data(), NewFrames.size() * sizeof(uint64_t));
+  return WriteFileAtomically(Path, Image.data(), Image.size());
+}
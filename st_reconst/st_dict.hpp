@@ -0,0 +1,104 @@
+// Persistent dictionary of decompressed stack traces.
+//
+// The same binary produces the same stack traces run after run, so the
+// search for a compressed stack trace is done once: the dictionary maps the
+// (function, hash, depth) of each compressed stack trace searched for to
+// the stack traces found, none, one, or several if the hash collides. It is
+// an open-addressing hash table in a file, mapped and looked up in place:
+//
+//   STDictHeader
+//   Slots[NumSlots]    STDictEntry, NumSlots a power of 2; Func is kEmpty
+//                      in the empty slots
+//   Frames[NumFrames]  u64, the stack traces of each entry, one after the
+//                      other
+//
+// Functions are ids in the call graph, and the search depends on the max
+// depth, the hash layout and options, so a dictionary is only valid for
+// these: its header records their fingerprint, and it is started over when
+// they change.
+// Dictionaries are written whole, as the call graph cache (see
+// WriteFileAtomically); of concurrent runs, the last one to write wins.
+
+#ifndef __ST_DICT_H__
+#define __ST_DICT_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cg_cache.hpp"
+
+#define ST_DICT_MAGIC "STDICT\0\0"
+#define ST_DICT_VERSION 1
+
+struct STDictHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t Reserved;
+  uint64_t Fingerprint;
+  uint64_t NumSlots;
+  uint64_t NumEntries;
+  uint64_t NumFrames;
+};
+
+// Stack traces found for a compressed stack trace: NumTraces of Depth
+// frames each, at Frames[FirstFrame].
+struct STDictEntry {
+  uint64_t Hash;
+  uint32_t Func;
+  uint16_t Depth;
+  uint16_t NumTraces;
+  uint64_t FirstFrame;
+};
+
+class STDict {
+public:
+  enum : uint32_t { kEmpty = UINT32_MAX };
+  // Longest stack traces, and most stack traces per entry, kept.
+  enum : size_t { kMaxDepth = UINT16_MAX, kMaxTraces = UINT16_MAX };
+
+  // Stack traces of an entry, Num of Depth frames each, one after the
+  // other.
+  struct Traces {
+    const uint64_t *Frames = nullptr;
+    size_t Depth = 0;
+    size_t Num = 0;
+  };
+
+  STDict(uint64_t Fingerprint) : Fingerprint(Fingerprint) {}
+  STDict(const STDict &) = delete;
+  STDict &operator=(const STDict &) = delete;
+  ~STDict();
+
+  // Map the dictionary at Path. Returns false if there is none, or if it
+  // has another fingerprint; the dictionary is empty then.
+  bool Open(const char *Path);
+
+  // Stack traces found for (Func, Hash, Depth). Returns false if it was
+  // not searched for.
+  bool Lookup(uint32_t Func, uint64_t Hash, size_t Depth, Traces &Res) const;
+
+  // Record the stack traces STs found for (Func, Hash, Depth), not in the
+  // dictionary. Ignored if too deep; only the first kMaxTraces are kept.
+  void Add(uint32_t Func, uint64_t Hash, size_t Depth,
+           const std::vector<std::vector<uintptr_t>> &STs);
+
+  size_t size() const { return NumMapped + Added.size(); }
+  size_t NumAdded() const { return Added.size(); }
+
+  // Write the mapped entries and the added ones to Path. Returns false on
+  // error.
+  bool Write(const char *Path) const;
+
+private:
+  uint64_t Fingerprint;
+  const void *Mapping = nullptr;
+  size_t MappingSize = 0;
+  FlatArray<STDictEntry> Slots;
+  FlatArray<uint64_t> Frames;
+  size_t NumMapped = 0;
+  std::vector<STDictEntry> Added;
+  std::vector<uint64_t> AddedFrames;
+};
+
+#endif
@@ -0,0 +1,161 @@
+// Client of the decompression server (st_reconst --serve, see
+// st_server.hpp). Reads compressed stack traces, "FUNCNAME !HASH DEPTH"
+// lines as printed by wrap2trace and w2t_dump, from the standard input,
+// sends them in batches of up to BATCH, and prints the stack traces they
+// decompress to as "FUNCNAME FRAME..." lines, with frames symbolized as
+// "NAME+0xOFFSET". A "#" line notes the compressed stack traces with no or
+// several matches first. Other lines are skipped. The time each batch took
+// is printed to the standard error.
+//
+// Usage: st_query SOCKET [GRAPH [BATCH]] < compressed.txt
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "st_server.hpp"
+
+static const char *StatusName(uint16_t Status) {
+  switch (Status) {
+  case kSTNotFound:
+    return "not found";
+  case kSTUnknownFunc:
+    return "function not in the call graph";
+  case kSTTooDeep:
+    return "deeper than the max depth";
+  case kSTOverBudget:
+    return "over the search budget";
+  }
+  return "error";
+}
+
+// Compressed stack traces of a batch, and their function names.
+struct Batch {
+  std::vector<STRequestTrace> Traces;
+  std::vector<std::string> FuncNames; // Of each trace.
+  std::string Names; // As sent, each once.
+  std::unordered_map<std::string, uint32_t> NameOffsets; // In Names.
+};
+
+// Send Req for call graph Graph, and print the response. Returns false on
+// error.
+static bool Query(int Fd, uint16_t Graph, Batch &Req) {
+  Req.Names.resize(AlignTo8(Req.Names.size()));
+  STRequestHeader H = {ST_REQUEST_MAGIC, ST_SERVER_VERSION, Graph,
+                       (uint32_t)Req.Traces.size(),
+                       (uint32_t)Req.Names.size()};
+  auto Start = std::chrono::steady_clock::now();
+  STResponseHeader R;
+  if (!WriteFull(Fd, &H, sizeof(H)) ||
+      !WriteFull(Fd, Req.Traces.data(),
+                 Req.Traces.size() * sizeof(STRequestTrace)) ||
+      !WriteFull(Fd, Req.Names.data(), Req.Names.size()) ||
+      !ReadFull(Fd, &R, sizeof(R)))
+    return false;
+  if (R.Magic != ST_RESPONSE_MAGIC || R.Status != kSTOk ||
+      R.NumTraces != Req.Traces.size()) {
+    fprintf(stderr, "Error: the server rejected the request (%u).\n",
+            R.Status);
+    return false;
+  }
+  std::vector<STResponseTrace> RTraces(R.NumTraces);
+  std::vector<uint64_t> Frames(R.NumFrames);
+  std::vector<char> Symbols(R.SymbolsSize);
+  if (!ReadFull(Fd, RTraces.data(), RTraces.size() * sizeof(STResponseTrace)) ||
+      !ReadFull(Fd, Frames.data(), Frames.size() * sizeof(uint64_t)) ||
+      !ReadFull(Fd, Symbols.data(), Symbols.size()))
+    return false;
+  double Ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - Start).count();
+
+  const char *Symbol = Symbols.data();
+  for (size_t I = 0; I < RTraces.size(); I++) {
+    const STResponseTrace &T = RTraces[I];
+    const std::string &FuncName = Req.FuncNames[I];
+    if (T.Status != kSTOk && T.Status != kSTNotFound)
+      printf("# not decompressed (%s): ", StatusName(T.Status));
+    else if (T.NumMatches != 1)
+      printf("# %llu stack traces for ", (unsigned long long)T.NumMatches);
+    if (T.Status != kSTOk || T.NumMatches != 1)
+      printf("%s !0x%llx %u\n", FuncName.c_str(),
+             (unsigned long long)Req.Traces[I].Hash, T.Depth);
+    for (uint64_t M = 0; M < T.NumMatches; M++) {
+      fputs(FuncName.c_str(), stdout);
+      for (uint32_t D = 0; D < T.Depth; D++) {
+        printf(" %s", Symbol);
+        Symbol += strlen(Symbol) + 1;
+      }
+      putchar('\n');
+    }
+  }
+  fflush(stdout);
+  fprintf(stderr, "# %zu stack traces decompressed in %.3f ms\n",
+          RTraces.size(), Ms);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 4) {
+    fprintf(stderr, "Usage: %s SOCKET [GRAPH [BATCH]]\n", argv[0]);
+    return 1;
+  }
+  uint16_t Graph = argc > 2 ? atoi(argv[2]) : 0;
+  size_t BatchSize = argc > 3 ? atoi(argv[3]) : 1024;
+  if (!BatchSize || BatchSize > ST_SERVER_MAX_TRACES)
+    BatchSize = ST_SERVER_MAX_TRACES;
+
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  strncpy(Addr.sun_path, argv[1], sizeof(Addr.sun_path) - 1);
+  int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Fd < 0 || connect(Fd, (sockaddr *)&Addr, sizeof(Addr))) {
+    fprintf(stderr, "Error: can't connect to \"%s\"\n", argv[1]);
+    return 1;
+  }
+
+  Batch Req;
+  std::string Line;
+  for (;;) {
+    bool More = (bool)std::getline(std::cin, Line);
+    if (More) {
+      std::istringstream In(Line);
+      std::string FuncName, HashStr;
+      uint32_t Depth;
+      if (!(In >> FuncName >> HashStr >> Depth) || FuncName[0] == '#' ||
+          HashStr.size() < 2 || HashStr[0] != '!')
+        continue;
+      auto It = Req.NameOffsets.find(FuncName);
+      if (It == Req.NameOffsets.end()) {
+        It = Req.NameOffsets.emplace(FuncName, Req.Names.size()).first;
+        Req.Names += FuncName;
+        Req.Names += '\0';
+      }
+      Req.Traces.push_back(
+          {strtoull(HashStr.c_str() + 1, nullptr, 16), It->second, Depth});
+      Req.FuncNames.push_back(FuncName);
+    }
+    if (Req.Traces.size() == BatchSize ||
+        Req.Names.size() + 8 > ST_SERVER_MAX_NAMES_SIZE ||
+        (!More && !Req.Traces.empty())) {
+      if (!Query(Fd, Graph, Req)) {
+        fprintf(stderr, "Error: the connection to the server failed.\n");
+        return 1;
+      }
+      Req = Batch();
+    }
+    if (!More)
+      break;
+  }
+  close(Fd);
+  return 0;
+}
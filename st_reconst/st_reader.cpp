@@ -0,0 +1,404 @@
+#include "st_reader.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "cg.hpp"
+#include "task_pool.hpp"
+
+namespace {
+
+enum : size_t { kChunkSize = 8 << 20 };
+
+// Value of each hex digit, -1 for other characters.
+struct HexTable {
+  int8_t Value[256];
+
+  HexTable() {
+    memset(Value, -1, sizeof(Value));
+    for (int I = 0; I < 10; I++)
+      Value['0' + I] = I;
+    for (int I = 0; I < 6; I++)
+      Value['a' + I] = Value['A' + I] = 10 + I;
+  }
+};
+
+const HexTable Hex;
+
+bool IsSpace(char C) { return C == ' ' || C == '\t' || C == '\r'; }
+
+bool StartsWith(const char *P, const char *End, const char *Prefix) {
+  size_t Len = strlen(Prefix);
+  return (size_t)(End - P) >= Len && !memcmp(P, Prefix, Len);
+}
+
+const char *SkipSpaces(const char *P, const char *End) {
+  while (P < End && IsSpace(*P))
+    P++;
+  return P;
+}
+
+// Scan the hex number at P, with an optional "0x" prefix, and set P past
+// it. Dec is its value read as a decimal number, or UINT64_MAX if it isn't
+// one. Returns false if there are no digits.
+bool ScanHex(const char *&P, const char *End, uint64_t &Val, uint64_t &Dec) {
+  bool Prefixed = End - P > 2 && P[0] == '0' && (P[1] == 'x' || P[1] == 'X') &&
+                  Hex.Value[(uint8_t)P[2]] >= 0;
+  if (Prefixed)
+    P += 2;
+  const char *Start = P;
+  Val = 0;
+  Dec = Prefixed ? UINT64_MAX : 0;
+  for (; P < End; P++) {
+    int D = Hex.Value[(uint8_t)*P];
+    if (D < 0)
+      break;
+    Val = Val << 4 | D;
+    if (Dec != UINT64_MAX)
+      Dec = D < 10 ? Dec * 10 + D : UINT64_MAX;
+  }
+  return P != Start;
+}
+
+// Scan the frame at P, "0xOFFSET", "OFFSET" or "ID:0xOFFSET", and set P
+// past it. Returns false if it is malformed.
+bool ScanFrame(const char *&P, const char *End, uintptr_t &Frame) {
+  uint64_t Val, Dec;
+  if (!ScanHex(P, End, Val, Dec))
+    return false;
+  // Frames in DSOs are printed as "MODULE_ID:OFFSET". Keep the module id in
+  // the upper bits, as wrap2trace does in its binary output.
+  if (P < End && *P == ':') {
+    uint64_t Id = Dec;
+    ++P;
+    if (Id == UINT64_MAX || !ScanHex(P, End, Val, Dec))
+      return false;
+    Val |= Id << CG_MODULE_SHIFT;
+  }
+  Frame = Val;
+  return P == End || IsSpace(*P);
+}
+
+// Function name in the log, not copied.
+struct NameRef {
+  const char *Data;
+  size_t Size;
+
+  bool operator==(const NameRef &O) const {
+    return Size == O.Size && !memcmp(Data, O.Data, Size);
+  }
+};
+
+struct NameRefHash {
+  size_t operator()(const NameRef &N) const {
+    uint64_t H = 0xcbf29ce484222325ULL; // FNV-1a
+    for (size_t I = 0; I < N.Size; I++)
+      H = (H ^ (uint8_t)N.Data[I]) * 0x100000001b3ULL;
+    return H;
+  }
+};
+
+// Unique stack traces, with the position in the log of the first
+// occurrence of each, to keep them in the order of the log.
+class TraceSet {
+  struct Hasher {
+    const TraceSet *S;
+    size_t operator()(uint32_t I) const {
+      const LogTrace &T = S->Traces[I];
+      uint64_t H = T.Func * 0x9e3779b97f4a7c15ULL;
+      for (size_t J = 0; J < T.Len; J++)
+        H = (H ^ S->Frames[T.First + J]) * 0xff51afd7ed558ccdULL;
+      return H ^ H >> 32;
+    }
+  };
+  struct Equal {
+    const TraceSet *S;
+    bool operator()(uint32_t A, uint32_t B) const {
+      const LogTrace &TA = S->Traces[A], &TB = S->Traces[B];
+      return TA.Func == TB.Func && TA.Len == TB.Len &&
+             std::equal(S->Frames.begin() + TA.First,
+                        S->Frames.begin() + TA.First + TA.Len,
+                        S->Frames.begin() + TB.First);
+    }
+  };
+
+public:
+  std::vector<LogTrace> Traces;
+  std::vector<uintptr_t> Frames;
+  std::vector<uint64_t> Pos;
+  std::unordered_set<uint32_t, Hasher, Equal> Index;
+
+  TraceSet() : Index(16, Hasher{this}, Equal{this}) {}
+  TraceSet(const TraceSet &) = delete;
+  TraceSet &operator=(const TraceSet &) = delete;
+
+  // Add the stack trace of Func at Frames[First, end), at position P of the
+  // log, unless it is already in the set.
+  void Add(uint32_t Func, size_t First, uint64_t P) {
+    Traces.push_back({Func, (uint32_t)(Frames.size() - First), First});
+    Pos.push_back(P);
+    auto Ins = Index.insert(Traces.size() - 1);
+    if (Ins.second)
+      return;
+    Traces.pop_back();
+    Pos.pop_back();
+    Frames.resize(First);
+    Pos[*Ins.first] = std::min(Pos[*Ins.first], P);
+  }
+};
+
+struct CompressedKey {
+  bool operator()(const LogCompressed &A, const LogCompressed &B) const {
+    return A.Func == B.Func && A.Depth == B.Depth && A.Hash == B.Hash;
+  }
+  size_t operator()(const LogCompressed &C) const {
+    return C.Hash ^ ((uint64_t)C.Func << 32 | C.Depth) * 0x9e3779b97f4a7c15ULL;
+  }
+};
+
+// Unique compressed stack traces, with the position of the first
+// occurrence of each.
+typedef std::unordered_map<LogCompressed, uint64_t, CompressedKey,
+                           CompressedKey> CompressedSet;
+
+// Stack traces of a chunk of the log, with function ids of the chunk.
+struct ChunkLog {
+  std::vector<NameRef> Names;
+  std::vector<uint64_t> NamePos; // First occurrence of each name.
+  std::unordered_map<NameRef, uint32_t, NameRefHash> NameIds;
+  TraceSet Traces;
+  CompressedSet Compressed;
+  std::vector<std::string> Comments;
+  uint64_t NumLines = 0, NumClipped = 0, NumMalformed = 0;
+};
+
+// Parse the line [P, End), at position Pos of the log.
+void ParseLine(const char *P, const char *End, uint64_t Pos,
+               size_t DepthLimit, ChunkLog &C) {
+  if (P == End)
+    return;
+  if (*P == '#') {
+    if (StartsWith(P, End, "# module ") ||
+        StartsWith(P, End, "# hash-checkpoints "))
+      C.Comments.emplace_back(P, End - (End[-1] == '\r') - P);
+    return;
+  }
+  P = SkipSpaces(P, End);
+  NameRef Name = {P, 0};
+  while (P < End && !IsSpace(*P))
+    P++;
+  Name.Size = P - Name.Data;
+  if (!Name.Size)
+    return;
+  auto It = C.NameIds.find(Name);
+  if (It == C.NameIds.end()) {
+    It = C.NameIds.emplace(Name, C.Names.size()).first;
+    C.Names.push_back(Name);
+    C.NamePos.push_back(Pos);
+  }
+  uint32_t Func = It->second;
+  C.NumLines++;
+  P = SkipSpaces(P, End);
+
+  // Compressed stack traces: "FUNCNAME !HASH DEPTH".
+  if (P < End && *P == '!') {
+    uint64_t Hash, Dec, Depth = 0;
+    ++P;
+    if (!ScanHex(P, End, Hash, Dec) || P == End || !IsSpace(*P)) {
+      C.NumMalformed++;
+      return;
+    }
+    P = SkipSpaces(P, End);
+    if (P == End || *P < '0' || *P > '9') {
+      C.NumMalformed++;
+      return;
+    }
+    for (; P < End && *P >= '0' && *P <= '9'; P++)
+      Depth = Depth * 10 + (*P - '0');
+    C.Compressed.emplace(LogCompressed{Func, (uint32_t)Depth, Hash}, Pos);
+    return;
+  }
+
+  size_t First = C.Traces.Frames.size();
+  size_t Depth = 0;
+  uintptr_t Frame;
+  // Up to the first malformed frame.
+  while (P < End && ScanFrame(P, End, Frame)) {
+    C.Traces.Frames.push_back(Frame);
+    P = SkipSpaces(P, End);
+    if (++Depth == DepthLimit) {
+      C.NumClipped++;
+      break;
+    }
+  }
+  C.Traces.Add(Func, First, Pos);
+}
+
+// Start of the first line starting at or after Pos.
+size_t LineStart(const char *Data, size_t Size, size_t Pos) {
+  if (!Pos || Pos >= Size)
+    return std::min(Pos, Size);
+  const char *NL = (const char *)memchr(Data + Pos - 1, '\n', Size - Pos + 1);
+  return NL ? NL + 1 - Data : Size;
+}
+
+} // namespace
+
+bool ReadTraceLog(const char *Path, size_t DepthLimit, size_t Jobs,
+                  TraceLog &Res) {
+  auto Start = std::chrono::steady_clock::now();
+  int Fd = open(Path, O_RDONLY);
+  struct stat St;
+  if (Fd < 0 || fstat(Fd, &St)) {
+    if (Fd >= 0)
+      close(Fd);
+    return false;
+  }
+  // Map regular files; read others, e.g., pipes, whole.
+  const char *Data = nullptr;
+  size_t Size = 0;
+  std::string Buf;
+  bool Mapped = false;
+  if (S_ISREG(St.st_mode) && St.st_size > 0) {
+    void *Map = mmap(nullptr, St.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    if (Map != MAP_FAILED) {
+      Data = (const char *)Map;
+      Size = St.st_size;
+      Mapped = true;
+    }
+  }
+  if (!Mapped) {
+    char Block[1 << 16];
+    ssize_t N;
+    while ((N = read(Fd, Block, sizeof(Block))) > 0)
+      Buf.append(Block, N);
+    Data = Buf.data();
+    Size = Buf.size();
+  }
+  close(Fd);
+
+  // The unique stack traces merged so far, with global function ids.
+  std::mutex Lock;
+  std::unordered_map<std::string, uint32_t> FuncIds;
+  std::vector<uint64_t> NamePos;
+  TraceSet Traces;
+  CompressedSet Compressed;
+  size_t NumChunks = (Size + kChunkSize - 1) / kChunkSize;
+  std::vector<std::vector<std::string>> Comments(NumChunks);
+
+  TaskPool<size_t> Pool(Jobs);
+  for (size_t I = 0; I < NumChunks; I++)
+    Pool.Push(I % Pool.NumWorkers(), I);
+  Pool.Run([&](size_t, size_t I) {
+    size_t Begin = LineStart(Data, Size, I * kChunkSize);
+    size_t End = LineStart(Data, Size, (I + 1) * kChunkSize);
+    ChunkLog C;
+    for (size_t P = Begin; P < End;) {
+      const char *NL = (const char *)memchr(Data + P, '\n', End - P);
+      size_t EOL = NL ? NL - Data : End;
+      ParseLine(Data + P, Data + EOL, P, DepthLimit, C);
+      P = EOL + 1;
+    }
+
+    std::lock_guard<std::mutex> Guard(Lock);
+    std::vector<uint32_t> Ids(C.Names.size());
+    for (size_t J = 0; J < C.Names.size(); J++) {
+      std::string Name(C.Names[J].Data, C.Names[J].Size);
+      auto It = FuncIds.find(Name);
+      if (It == FuncIds.end()) {
+        It = FuncIds.emplace(Name, Res.FuncNames.size()).first;
+        Res.FuncNames.push_back(Name);
+        NamePos.push_back(C.NamePos[J]);
+      }
+      NamePos[It->second] = std::min(NamePos[It->second], C.NamePos[J]);
+      Ids[J] = It->second;
+    }
+    for (size_t J = 0; J < C.Traces.Traces.size(); J++) {
+      const LogTrace &T = C.Traces.Traces[J];
+      size_t First = Traces.Frames.size();
+      Traces.Frames.insert(Traces.Frames.end(),
+                           C.Traces.Frames.begin() + T.First,
+                           C.Traces.Frames.begin() + T.First + T.Len);
+      Traces.Add(Ids[T.Func], First, C.Traces.Pos[J]);
+    }
+    for (const auto &El : C.Compressed) {
+      LogCompressed LC = El.first;
+      LC.Func = Ids[LC.Func];
+      auto Ins = Compressed.emplace(LC, El.second);
+      Ins.first->second = std::min(Ins.first->second, El.second);
+    }
+    Comments[I] = std::move(C.Comments);
+    Res.NumLines += C.NumLines;
+    Res.NumClipped += C.NumClipped;
+    Res.NumMalformed += C.NumMalformed;
+  });
+
+  // In the order of the log, whatever the order the chunks were merged in:
+  // functions, stack traces and compressed stack traces by first
+  // occurrence.
+  std::vector<uint32_t> Order(Res.FuncNames.size());
+  for (uint32_t I = 0; I < Order.size(); I++)
+    Order[I] = I;
+  std::sort(Order.begin(), Order.end(), [&NamePos](uint32_t A, uint32_t B) {
+    return NamePos[A] < NamePos[B];
+  });
+  std::vector<uint32_t> NewIds(Order.size());
+  std::vector<std::string> FuncNames(Order.size());
+  for (uint32_t I = 0; I < Order.size(); I++) {
+    NewIds[Order[I]] = I;
+    FuncNames[I] = std::move(Res.FuncNames[Order[I]]);
+  }
+  Res.FuncNames = std::move(FuncNames);
+
+  Order.resize(Traces.Traces.size());
+  for (uint32_t I = 0; I < Order.size(); I++)
+    Order[I] = I;
+  std::sort(Order.begin(), Order.end(), [&Traces](uint32_t A, uint32_t B) {
+    return Traces.Pos[A] < Traces.Pos[B];
+  });
+  Res.Traces.clear();
+  Res.Frames.clear();
+  Res.Traces.reserve(Order.size());
+  Res.Frames.reserve(Traces.Frames.size());
+  for (uint32_t I : Order) {
+    const LogTrace &T = Traces.Traces[I];
+    Res.Traces.push_back({NewIds[T.Func], T.Len, Res.Frames.size()});
+    Res.Frames.insert(Res.Frames.end(), Traces.Frames.begin() + T.First,
+                      Traces.Frames.begin() + T.First + T.Len);
+  }
+
+  std::vector<std::pair<uint64_t, LogCompressed>> ByPos;
+  ByPos.reserve(Compressed.size());
+  for (const auto &El : Compressed)
+    ByPos.push_back({El.second, El.first});
+  std::sort(ByPos.begin(), ByPos.end(),
+            [](const std::pair<uint64_t, LogCompressed> &A,
+               const std::pair<uint64_t, LogCompressed> &B) {
+              return A.first < B.first;
+            });
+  Res.Compressed.clear();
+  for (auto &El : ByPos) {
+    El.second.Func = NewIds[El.second.Func];
+    Res.Compressed.push_back(El.second);
+  }
+
+  Res.Comments.clear();
+  for (auto &CC : Comments)
+    for (auto &Line : CC)
+      Res.Comments.push_back(std::move(Line));
+
+  if (Mapped)
+    munmap((void *)Data, Size);
+  Res.NumBytes = Size;
+  Res.Seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - Start).count();
+  return true;
+}
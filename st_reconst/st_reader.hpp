@@ -0,0 +1,58 @@
+// Reader of the stack trace logs of wrap2trace (text format, see
+// wrap2trace/trace_format.hpp), for logs of many gigabytes.
+//
+// The log is mapped in memory and split into chunks at line boundaries,
+// parsed in parallel on a TaskPool. Function names are interned, and stack
+// traces deduplicated in each chunk, then merged into the unique stack
+// traces of the log as each chunk is done: memory grows with the number of
+// unique stack traces, not with the size of the log.
+//
+// Frames are read as printed, "0xOFFSET", "OFFSET" or "ID:0xOFFSET" (see
+// CG_MODULE_SHIFT), and not translated with the module table: the
+// "# module" lines might come after the stack traces that refer to them,
+// so they are returned, in order, to translate the unique stack traces
+// with once all are read.
+
+#ifndef __ST_READER_H__
+#define __ST_READER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Unique stack trace: Len frames at TraceLog::Frames[First].
+struct LogTrace {
+  uint32_t Func;
+  uint32_t Len;
+  size_t First;
+};
+
+// Unique compressed stack trace ("FUNCNAME !HASH DEPTH").
+struct LogCompressed {
+  uint32_t Func;
+  uint32_t Depth;
+  uint64_t Hash;
+};
+
+struct TraceLog {
+  std::vector<std::string> FuncNames; // By function id.
+  std::vector<LogTrace> Traces;
+  std::vector<uintptr_t> Frames;
+  std::vector<LogCompressed> Compressed;
+  // "# module" and "# hash-checkpoints" lines, in the order of the log.
+  std::vector<std::string> Comments;
+
+  uint64_t NumBytes = 0;
+  uint64_t NumLines = 0; // Stack traces, full or compressed.
+  uint64_t NumClipped = 0; // Stack traces cut at the depth limit.
+  uint64_t NumMalformed = 0; // Malformed compressed stack traces.
+  double Seconds = 0; // Time taken to read.
+};
+
+// Read the stack traces of the log at Path, keeping the first DepthLimit
+// frames of each, on Jobs threads. Returns false if the log can't be read.
+bool ReadTraceLog(const char *Path, size_t DepthLimit, size_t Jobs,
+                  TraceLog &Res);
+
+#endif
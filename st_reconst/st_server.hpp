@@ -0,0 +1,128 @@
+// Protocol of the decompression server (st_reconst --serve, see Serve in
+// cg_reconst.cpp), and of its client st_query.
+//
+// The server keeps its call graphs loaded, and answers batches of
+// compressed stack traces over a Unix domain socket, so that they are
+// decompressed as they are collected, without reloading the call graph.
+// A client sends requests and reads the response to each, in order, on the
+// same connection; all fields are little endian, and all parts 8-byte
+// aligned:
+//
+//   Request:
+//     STRequestHeader
+//     Traces[NumTraces]   STRequestTrace
+//     Names[NamesSize]    NUL-terminated function names, zero padded to 8
+//                         bytes; STRequestTrace::Name is an offset into
+//                         Names
+//
+//   Response:
+//     STResponseHeader
+//     Traces[NumTraces]   STResponseTrace, in the order of the request
+//     Frames[NumFrames]   u64, the NumMatches * Depth frames of each trace,
+//                         one match after the other
+//     Symbols[SymbolsSize]  NUL-terminated "NAME+0xOFFSET" of each frame
+//                         (see FlatCallGraph::Symbolize), zero padded to 8
+//                         bytes
+//
+// A response with a Status other than kSTOk has no traces, and the server
+// closes the connection after it. The server also closes connections
+// stalling in the middle of a request, or not reading the response, for a
+// few seconds.
+
+#ifndef __ST_SERVER_H__
+#define __ST_SERVER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+
+// "STRQ" and "STRS" in little endian.
+#define ST_REQUEST_MAGIC 0x51525453U
+#define ST_RESPONSE_MAGIC 0x53525453U
+#define ST_SERVER_VERSION 1
+
+// Limits of a request, to bound the memory a client can make the server
+// allocate.
+#define ST_SERVER_MAX_TRACES (1U << 20)
+#define ST_SERVER_MAX_NAMES_SIZE (16U << 20)
+
+enum STStatus : uint16_t {
+  kSTOk = 0,
+  kSTBadRequest = 1, // Of the response: malformed request.
+  kSTBadGraph = 2,   // Of the response: no such call graph.
+  kSTNotFound = 3,   // Of a trace: no stack trace has this hash.
+  kSTUnknownFunc = 4, // Of a trace: the function is not in the call graph.
+  kSTTooDeep = 5,    // Of a trace: deeper than the server's max depth.
+  kSTOverBudget = 6, // Of a trace: not found within the request's budget.
+};
+
+struct STRequestHeader {
+  uint32_t Magic;
+  uint16_t Version;
+  uint16_t Graph; // Call graph, in the order given to the server.
+  uint32_t NumTraces;
+  uint32_t NamesSize;
+};
+
+// Compressed stack trace, as in "FUNCNAME !HASH DEPTH".
+struct STRequestTrace {
+  uint64_t Hash;
+  uint32_t Name;
+  uint32_t Depth;
+};
+
+struct STResponseHeader {
+  uint32_t Magic;
+  uint16_t Version;
+  uint16_t Status;
+  uint32_t NumTraces;
+  uint32_t Reserved;
+  uint64_t NumFrames;
+  uint64_t SymbolsSize;
+};
+
+struct STResponseTrace {
+  uint16_t Status;
+  uint16_t Reserved;
+  uint32_t Depth;
+  uint64_t NumMatches; // Several if the hash collides.
+};
+
+static_assert(sizeof(STRequestHeader) % 8 == 0 &&
+              sizeof(STRequestTrace) % 8 == 0 &&
+              sizeof(STResponseHeader) % 8 == 0 &&
+              sizeof(STResponseTrace) % 8 == 0, "Parts are 8-byte aligned");
+
+static inline size_t AlignTo8(size_t Size) { return (Size + 7) & ~(size_t)7; }
+
+// Read or write exactly Size bytes. Return false on error or end of file.
+static inline bool ReadFull(int Fd, void *Buf, size_t Size) {
+  char *P = (char *)Buf;
+  while (Size) {
+    ssize_t N = read(Fd, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+static inline bool WriteFull(int Fd, const void *Buf, size_t Size) {
+  const char *P = (const char *)Buf;
+  while (Size) {
+    ssize_t N = write(Fd, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+#endif
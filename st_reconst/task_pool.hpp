@@ -0,0 +1,103 @@
+// Work-stealing pool of tasks, for the parallel search (see ParallelDFS in
+// cg_reconst.cpp).
+//
+// Each worker has its own deque of tasks. A worker takes the task it pushed
+// last, i.e., the deepest branch of the search, which shares its cache
+// lines; an idle worker steals from the other end of another worker's
+// deque, i.e., the shallowest and largest branch. Tasks are whole subtrees
+// of the search, so a mutex per deque costs nothing next to running them.
+
+#ifndef __TASK_POOL_H__
+#define __TASK_POOL_H__
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+template <typename T> class TaskPool {
+  struct Queue {
+    std::mutex Lock;
+    std::deque<T> Tasks;
+    std::atomic<size_t> Size{0}; // Tasks.size(), read without the lock.
+  };
+  std::vector<Queue> Queues;
+  // Tasks pushed and not completed yet, so that idle workers don't stop
+  // while running tasks can still push more.
+  std::atomic<size_t> Pending{0};
+
+  bool Pop(size_t W, T &Task) {
+    Queue &Q = Queues[W];
+    std::lock_guard<std::mutex> Guard(Q.Lock);
+    if (Q.Tasks.empty())
+      return false;
+    Task = std::move(Q.Tasks.back());
+    Q.Tasks.pop_back();
+    Q.Size.store(Q.Tasks.size(), std::memory_order_relaxed);
+    return true;
+  }
+
+  bool Steal(size_t W, T &Task) {
+    for (size_t I = 1; I < Queues.size(); I++) {
+      Queue &Q = Queues[(W + I) % Queues.size()];
+      std::lock_guard<std::mutex> Guard(Q.Lock);
+      if (Q.Tasks.empty())
+        continue;
+      Task = std::move(Q.Tasks.front());
+      Q.Tasks.pop_front();
+      Q.Size.store(Q.Tasks.size(), std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+public:
+  TaskPool(size_t NumWorkers) : Queues(NumWorkers ? NumWorkers : 1) {}
+
+  size_t NumWorkers() const { return Queues.size(); }
+
+  // Add a task to the deque of worker W: from a task running on W, or
+  // before Run().
+  void Push(size_t W, T Task) {
+    Pending.fetch_add(1, std::memory_order_relaxed);
+    Queue &Q = Queues[W];
+    std::lock_guard<std::mutex> Guard(Q.Lock);
+    Q.Tasks.push_back(std::move(Task));
+    Q.Size.store(Q.Tasks.size(), std::memory_order_relaxed);
+  }
+
+  // Whether the deque of worker W is short, i.e., pushing a task there
+  // rather than running it right away gives the other workers something to
+  // steal. Tasks are only split as long as they are stolen.
+  bool Hungry(size_t W) const {
+    return Queues[W].Size.load(std::memory_order_relaxed) < Queues.size();
+  }
+
+  // Run F(W, Task) for all the tasks, including those pushed while running,
+  // on NumWorkers() threads, W being the worker. Returns when all are done.
+  template <typename Fn> void Run(Fn F) {
+    auto Work = [this, &F](size_t W) {
+      T Task;
+      for (;;) {
+        if (Pop(W, Task) || Steal(W, Task)) {
+          F(W, Task);
+          Pending.fetch_sub(1, std::memory_order_acq_rel);
+        } else if (!Pending.load(std::memory_order_acquire)) {
+          return;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    };
+    std::vector<std::thread> Threads;
+    for (size_t W = 1; W < Queues.size(); W++)
+      Threads.emplace_back(Work, W);
+    Work(0);
+    for (auto &Thread : Threads)
+      Thread.join();
+  }
+};
+
+#endif
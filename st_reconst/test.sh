@@ -0,0 +1,194 @@
+#!/bin/sh
+# Behavior tests of st_reconst, run by "make test".
+#
+# The stack traces of testdata/ (full ones, and compressed ones with hash
+# checkpoint 4) are decompressed with the plain search, which must find
+# every one of them, and with each option, which must give the same
+# results. Then a program and its library, built from
+# testdata/elf_*.c, are traced with wrap2trace, linked in or preloaded, and
+# their stack traces must decompress against the binaries themselves.
+
+cd "$(dirname "$0")" || exit 1
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' EXIT
+Failed=0
+
+# The results of a run, without timings and the statistics of the search
+# itself (nodes visited, pruning), which depend on the options.
+Results() {
+  ./st_reconst "$@" 2>&1 |
+    grep -v -e ' time ' -e '^Num nodes' -e '^Num prun' -e 'pass rate' \
+            -e 'upper halves' -e 'dictionary' -e '^Hash checkpoints'
+}
+
+# Check NAME EXPECTED ACTUAL
+Check() {
+  if cmp -s "$2" "$3"; then
+    echo "PASS: $1"
+  else
+    echo "FAIL: $1"
+    diff "$2" "$3" | head -20
+    Failed=1
+  fi
+}
+
+# Plain search, the reference. Every stack trace must be found.
+Results testdata/cg.txt testdata/st.txt 6 4 > "$T/plain"
+grep 'could not be decompressed' "$T/plain" | grep -v ': 0$' > "$T/missed"
+Check "plain search finds every stack trace" /dev/null "$T/missed"
+
+# Options of the search, the call graph cache and the dictionary (each
+# twice: written, then read).
+while read -r Opts; do
+  # shellcheck disable=SC2086
+  Results $Opts testdata/cg.txt testdata/st.txt 6 4 > "$T/out"
+  Check "$Opts" "$T/plain" "$T/out"
+done <<EOF
+-j 3
+--meet
+--meet=3
+--prune-roots
+-j 2 --prune-roots
+-j 2 --meet --prune-roots
+--cg-cache=$T/cg.cache
+--cg-cache=$T/cg.cache
+--dict=$T/st.dict
+--dict=$T/st.dict
+-j 2 --cg-cache=$T/cg.cache --dict=$T/st.dict
+EOF
+
+# The reader: repeated stack traces are counted once, and a pipe is read
+# rather than mapped.
+cat testdata/st.txt testdata/st.txt > "$T/st2.txt"
+Results testdata/cg.txt "$T/st2.txt" 6 4 > "$T/out"
+Check "repeated stack traces" "$T/plain" "$T/out"
+cat testdata/st.txt | Results -j 2 testdata/cg.txt /dev/stdin 6 4 > "$T/out"
+Check "stack traces from a pipe" "$T/plain" "$T/out"
+
+# Full stack traces with other hash checkpoints.
+grep -v '!' testdata/st.txt > "$T/full.txt"
+Results testdata/cg.txt "$T/full.txt" 6 4 > "$T/full"
+for Layout in 2,4 1,2,3,4 6; do
+  Results testdata/cg.txt "$T/full.txt" 6 $Layout > "$T/out"
+  Check "hash checkpoints $Layout" "$T/full" "$T/out"
+done
+
+# The decompression server, with a single worker, queried by st_query: the
+# stack traces must be those of the plain search, even with another client
+# connected and idle. Frames are printed as "NAME+0xOFFSET", and turned back
+# into addresses with the function addresses of the call graph.
+Addresses() {
+  awk 'function Hex(S,  I, N) {
+         N = 0
+         S = tolower(S)
+         sub(/^0x/, "", S)
+         for (I = 1; I <= length(S); I++)
+           N = N * 16 + index("0123456789abcdef", substr(S, I, 1)) - 1
+         return N
+       }
+       FNR == NR {
+         if (NF == 2 && $2 ~ /^func_/)
+           Start[$2] = Hex($1)
+         next
+       }
+       !/^#/ {
+         Line = $1
+         for (I = 2; I <= NF; I++) {
+           split($I, Sym, "+")
+           Line = Line sprintf(" 0x%x", Start[Sym[1]] + Hex(Sym[2]))
+         }
+         print Line
+       }' testdata/cg.txt -
+}
+
+StartServer() {
+  rm -f "$T/st.sock"
+  ./st_reconst -j 1 "$@" --serve="$T/st.sock" testdata/cg.txt 6 4 \
+    > "$T/server.log" 2>&1 &
+  Server=$!
+  I=0
+  while [ ! -S "$T/st.sock" ] && [ $I -lt 50 ]; do
+    sleep 0.1
+    I=$((I + 1))
+  done
+}
+
+StopServer() {
+  kill $Server
+  wait $Server 2> /dev/null
+}
+
+grep '!' testdata/st.txt > "$T/compressed.txt"
+grep '^func_[0-9]* 0x' "$T/plain" | sort > "$T/decompressed"
+StartServer
+# The idle client waits for its standard input, until fd 3 is closed.
+mkfifo "$T/idle"
+./st_query "$T/st.sock" < "$T/idle" > /dev/null 2>&1 &
+exec 3> "$T/idle"
+sleep 0.5
+timeout 10 ./st_query "$T/st.sock" < "$T/compressed.txt" 2> /dev/null |
+  Addresses | sort > "$T/out"
+Check "server, beside an idle connection" "$T/decompressed" "$T/out"
+exec 3>&-
+StopServer
+
+# Past the search budget of a request, the stack traces are not found.
+StartServer --budget=1
+./st_query "$T/st.sock" < "$T/compressed.txt" 2> /dev/null |
+  grep -c 'over the search budget' > "$T/count"
+grep -c . "$T/compressed.txt" > "$T/expected"
+Check "server, over the search budget" "$T/expected" "$T/count"
+StopServer
+
+# ELF binaries: direct calls found by a sweep of the code, calls through
+# the PLT, and the module table of the stack traces (--trace-modules).
+# Frames below main() are in the C library, which has no symbols, and are
+# cut off, as are the stack traces of allocations made by other modules.
+CC=${CC:-cc}
+if $CC -O1 -fno-omit-frame-pointer -fno-inline -fPIC -shared \
+       testdata/elf_lib.c -o "$T/libelf_lib.so" &&
+   $CC -O1 -fno-omit-frame-pointer -fno-inline -c testdata/elf_main.c \
+       -o "$T/elf_main.o" &&
+   $CC "$T/elf_main.o" -L"$T" -lelf_lib -Wl,-rpath,"$T" -o "$T/elf_main" &&
+   clang++ -fno-omit-frame-pointer "$T/elf_main.o" \
+       ../wrap2trace/wrap2trace.o -L"$T" -lelf_lib -Wl,-rpath,"$T" \
+       -Wl,--wrap=malloc,--wrap=free -ldl -lpthread -o "$T/elf_main_wrapped" &&
+   "$T/elf_main_wrapped" 2> "$T/wrapped.txt" &&
+   LD_PRELOAD=../wrap2trace/libwrap2trace.so "$T/elf_main" 2> "$T/trace.txt"
+then
+  echo 2 > "$T/expected"
+  # Linked in, wrap2trace only wraps the calls of the executable.
+  awk '!/^#/ { NF--; print }' "$T/wrapped.txt" > "$T/elf.txt"
+  Results "$T/elf_main_wrapped" "$T/elf.txt" 8 4 > "$T/elf"
+  grep -c 'Success rate *: 100.00%' "$T/elf" > "$T/count"
+  Check "ELF binary, wrap2trace linked in" "$T/expected" "$T/count"
+
+  awk '/^# module / {
+         if ($7 ~ /(elf_main|libelf_lib\.so|libwrap2trace\.so)$/) {
+           Keep[$3] = 1
+           print
+         }
+         next
+       }
+       {
+         OK = 1
+         for (I = 2; I < NF; I++)
+           if ($I ~ /:/ && !(substr($I, 1, index($I, ":") - 1) in Keep))
+             OK = 0
+         if (OK && NF > 2) {
+           NF--
+           print
+         }
+       }' "$T/trace.txt" > "$T/elf.txt"
+  Results --trace-modules "$T/elf_main" "$T/elf.txt" 8 4 > "$T/elf"
+  grep -c 'Success rate *: 100.00%' "$T/elf" > "$T/count"
+  Check "ELF binaries, wrap2trace preloaded" "$T/expected" "$T/count"
+  Results -j 2 --cg-cache="$T/elf.cache" --trace-modules "$T/elf_main" \
+          "$T/elf.txt" 8 4 > "$T/out"
+  Check "ELF binaries, -j 2 --cg-cache" "$T/elf" "$T/out"
+else
+  echo "FAIL: can't build or trace testdata/elf_*.c"
+  Failed=1
+fi
+
+exit $Failed
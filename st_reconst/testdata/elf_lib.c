@@ -0,0 +1,12 @@
+// Shared library of elf_main.c: calls malloc through its own PLT.
+
+#include <stdlib.h>
+
+void *volatile LibBlock; // Not optimized away.
+
+__attribute__((noinline)) void *lib_alloc(size_t Size) { return malloc(Size); }
+
+__attribute__((noinline)) void lib_work(void) {
+  LibBlock = lib_alloc(16);
+  free(LibBlock);
+}
@@ -0,0 +1,26 @@
+// Test program of st_reconst's ELF reader (see test.sh): allocates from two
+// call paths in the executable, and one through elf_lib.c. It is traced
+// with wrap2trace linked in, and with the allocation functions preloaded
+// from libwrap2trace.so, i.e., called through the PLT of each module.
+
+#include <stdlib.h>
+
+void lib_work(void);
+
+void *volatile Block; // Not optimized away.
+
+__attribute__((noinline)) static void work(size_t Size) {
+  Block = malloc(Size);
+  free(Block);
+  lib_work();
+}
+
+__attribute__((noinline)) void path_a(void) { work(8); }
+
+__attribute__((noinline)) void path_b(void) { work(24); }
+
+int main(void) {
+  path_a();
+  path_b();
+  return 0;
+}
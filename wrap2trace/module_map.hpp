@@ -0,0 +1,217 @@
+// Map of the modules (executable and DSOs) loaded in the process, used to
+// translate return addresses to (module id, offset) pairs.
+//
+// The loaded modules are snapshotted with dl_iterate_phdr() at startup and
+// again only when the set of loaded modules changes, i.e., after
+// dlopen()/dlclose(), or when an address is not found in the snapshot and
+// the loader reports that modules were added or removed (checked at most
+// once a millisecond). A snapshot is an array of executable address ranges
+// sorted by start address, so an address is translated with a binary
+// search over a few ranges.
+//
+// Module ids are assigned in the order modules are first seen, and the
+// executable is always module 0. A module keeps its id for the lifetime of
+// the process, even after it is unloaded.
+
+#ifndef __MODULE_MAP_H__
+#define __MODULE_MAP_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <link.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace_format.hpp"
+
+#define MAX_MODULES 1024
+#define MODULE_NAME_SIZE 512
+
+struct ModuleInfo {
+  uintptr_t Bias;  // Load bias: runtime address - address in the object file.
+  uintptr_t Start; // Lowest address of the executable segments.
+  uintptr_t End;   // End of the executable segments.
+  char Name[MODULE_NAME_SIZE];
+};
+
+struct ModuleRange {
+  uintptr_t Start;
+  uintptr_t End;
+  uintptr_t Bias;
+  uint32_t Id;
+};
+
+struct ModuleSnapshot {
+  // Values of dlpi_adds and dlpi_subs when the snapshot was taken.
+  unsigned long long Adds, Subs;
+  size_t NumRanges;
+  ModuleRange Ranges[MAX_MODULES]; // One per loaded module.
+};
+
+// Called for each module seen for the first time, with the refresh lock held.
+typedef void (*NewModuleCallback)(uint32_t Id, const ModuleInfo &M);
+
+static ModuleInfo Modules[MAX_MODULES];
+static uint32_t NumModules;
+static std::atomic<ModuleSnapshot *> CurrentModules;
+static pthread_mutex_t ModulesLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct ModuleScan {
+  ModuleSnapshot *Snapshot;
+  NewModuleCallback OnNewModule;
+  size_t Index; // Index of the module being visited.
+};
+
+static int AddModuleRanges(struct dl_phdr_info *Info, size_t, void *Data) {
+  ModuleScan &Scan = *(ModuleScan *)Data;
+  ModuleSnapshot &S = *Scan.Snapshot;
+  S.Adds = Info->dlpi_adds;
+  S.Subs = Info->dlpi_subs;
+
+  const char *Name = Info->dlpi_name;
+  char ExePath[MODULE_NAME_SIZE] = {};
+  if (Scan.Index++ == 0 && (!Name || !*Name)) {
+    // The executable comes first and has no name.
+    if (NumModules)
+      Name = Modules[0].Name;
+    else if (readlink("/proc/self/exe", ExePath, sizeof(ExePath) - 1) > 0)
+      Name = ExePath;
+    else
+      Name = "<main>";
+  }
+
+  uintptr_t Start = UINTPTR_MAX, End = 0;
+  for (int I = 0; I < Info->dlpi_phnum; I++) {
+    const ElfW(Phdr) &P = Info->dlpi_phdr[I];
+    if (P.p_type != PT_LOAD || !(P.p_flags & PF_X))
+      continue;
+    uintptr_t SegStart = Info->dlpi_addr + P.p_vaddr;
+    if (SegStart < Start) Start = SegStart;
+    if (SegStart + P.p_memsz > End) End = SegStart + P.p_memsz;
+  }
+  if (Start >= End)
+    return 0;
+
+  // Find the id of the module, or register it.
+  uint32_t Id = 0;
+  while (Id < NumModules && !(Modules[Id].Bias == Info->dlpi_addr &&
+                              Modules[Id].Start == Start &&
+                              !strncmp(Modules[Id].Name, Name,
+                                       MODULE_NAME_SIZE - 1)))
+    Id++;
+  if (Id == NumModules) {
+    if (NumModules == MAX_MODULES)
+      return 0;
+    ModuleInfo &M = Modules[NumModules++];
+    M.Bias = Info->dlpi_addr;
+    M.Start = Start;
+    M.End = End;
+    size_t Len = strnlen(Name, MODULE_NAME_SIZE - 1);
+    memcpy(M.Name, Name, Len);
+    M.Name[Len] = '\0';
+    if (Scan.OnNewModule)
+      Scan.OnNewModule(Id, M);
+  }
+
+  if (S.NumRanges < MAX_MODULES)
+    S.Ranges[S.NumRanges++] = {Start, End, Info->dlpi_addr, Id};
+  return 0;
+}
+
+// Take a new snapshot of the loaded modules and publish it. Old snapshots
+// are not unmapped as other threads might still be reading them; there is
+// one snapshot per dlopen()/dlclose().
+static void RefreshModules(NewModuleCallback OnNewModule) {
+  pthread_mutex_lock(&ModulesLock);
+  void *Mem = mmap(nullptr, sizeof(ModuleSnapshot), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (Mem != MAP_FAILED) {
+    ModuleSnapshot *S = (ModuleSnapshot *)Mem;
+    ModuleScan Scan = {S, OnNewModule, 0};
+    dl_iterate_phdr(AddModuleRanges, &Scan);
+
+    // Insertion sort: there are a few ranges and they mostly come sorted.
+    for (size_t I = 1; I < S->NumRanges; I++) {
+      ModuleRange R = S->Ranges[I];
+      size_t J = I;
+      for (; J > 0 && S->Ranges[J - 1].Start > R.Start; J--)
+        S->Ranges[J] = S->Ranges[J - 1];
+      S->Ranges[J] = R;
+    }
+    CurrentModules.store(S, std::memory_order_release);
+  }
+  pthread_mutex_unlock(&ModulesLock);
+}
+
+static int ReadLoaderCounters(struct dl_phdr_info *Info, size_t, void *Data) {
+  unsigned long long *Counters = (unsigned long long *)Data;
+  Counters[0] = Info->dlpi_adds;
+  Counters[1] = Info->dlpi_subs;
+  return 1; // Stop after the first module.
+}
+
+// Refresh the snapshot if modules were loaded or unloaded since it was
+// taken. Used when an address is not found in the current snapshot. Reading
+// the loader counters takes the loader lock, and frames of unknown modules
+// (e.g., JIT code) might come on every call, so they are read at most once
+// per kModuleCheckIntervalNs; dlopen()/dlclose() refresh right away.
+static bool RefreshModulesIfChanged(NewModuleCallback OnNewModule) {
+  enum : uint64_t { kModuleCheckIntervalNs = 1000000 };
+  static std::atomic<uint64_t> LastCheck;
+  timespec Now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &Now);
+  uint64_t NowNs = Now.tv_sec * 1000000000ULL + Now.tv_nsec;
+  uint64_t Last = LastCheck.load(std::memory_order_relaxed);
+  if (NowNs - Last < kModuleCheckIntervalNs ||
+      !LastCheck.compare_exchange_strong(Last, NowNs,
+                                         std::memory_order_relaxed))
+    return false;
+
+  unsigned long long Counters[2];
+  dl_iterate_phdr(ReadLoaderCounters, Counters);
+  ModuleSnapshot *S = CurrentModules.load(std::memory_order_acquire);
+  if (S && S->Adds == Counters[0] && S->Subs == Counters[1])
+    return false;
+  RefreshModules(OnNewModule);
+  return true;
+}
+
+// Find the range containing Addr in snapshot S. Returns nullptr if Addr is
+// not in a known module.
+__attribute__((always_inline))
+static const ModuleRange *FindModuleRange(const ModuleSnapshot *S,
+                                          uintptr_t Addr) {
+  // Find the last range starting at or below Addr.
+  size_t Lo = 0, Hi = S->NumRanges;
+  while (Lo < Hi) {
+    size_t Mid = (Lo + Hi) / 2;
+    if (S->Ranges[Mid].Start <= Addr)
+      Lo = Mid + 1;
+    else
+      Hi = Mid;
+  }
+  // A return address might point right past the last instruction.
+  if (!Lo || Addr > S->Ranges[Lo - 1].End)
+    return nullptr;
+  return &S->Ranges[Lo - 1];
+}
+
+// Translate a runtime address to an encoded (module id, offset) frame. See
+// EncodeFrame().
+__attribute__((always_inline))
+static uint64_t TranslateAddress(uintptr_t Addr, NewModuleCallback OnNewModule) {
+  const ModuleSnapshot *S = CurrentModules.load(std::memory_order_acquire);
+  const ModuleRange *R = S ? FindModuleRange(S, Addr) : nullptr;
+  if (__builtin_expect(!R, 0) && RefreshModulesIfChanged(OnNewModule)) {
+    S = CurrentModules.load(std::memory_order_acquire);
+    R = S ? FindModuleRange(S, Addr) : nullptr;
+  }
+  if (!R)
+    return EncodeFrame(W2T_UNKNOWN_MODULE, Addr);
+  return EncodeFrame(R->Id, Addr - R->Bias);
+}
+
+#endif
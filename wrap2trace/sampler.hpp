@@ -0,0 +1,134 @@
+// Sampling policies deciding which calls of the wrapped functions get their
+// stack trace recorded.
+//
+//  - 1-in-N: every N-th call of a function is sampled. N is per function.
+//  - Byte interval: for functions with a size argument (malloc), a call is
+//    sampled each time the allocated bytes cross a sampling point. The
+//    distance between two sampling points is drawn from an exponential
+//    distribution with the given mean, as in tcmalloc's heap profiler, so
+//    that large allocations are more likely to be sampled, and the samples
+//    are not correlated with the allocation pattern of the program.
+//  - Token bucket: at most Rate samples per second per thread, with bursts
+//    of up to Burst samples. Bounds the overhead whatever the call rate.
+//
+// A call is sampled if all of the enabled policies accept it. The state of
+// the policies is per thread, so sampling decisions take no locks and touch
+// no shared cache lines.
+
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <cstdint>
+#include <cstring>
+#include <time.h>
+
+// Sampling settings for NumFuncs functions. The byte interval and the token
+// bucket are shared by all functions.
+template <unsigned NumFuncs> struct SamplingPolicy {
+  uint64_t Every[NumFuncs]; // Sample 1 in Every calls; 0 or 1 for all calls.
+  uint64_t MeanBytes;       // Mean byte interval; 0 disables.
+  uint64_t Rate;            // Token bucket refill, samples/second; 0 disables.
+  uint64_t Burst;           // Token bucket capacity, in samples.
+
+  bool Enabled() const {
+    for (unsigned F = 0; F < NumFuncs; F++)
+      if (Every[F] > 1)
+        return true;
+    return MeanBytes || Rate;
+  }
+};
+
+// Approximation of log2(D) for D > 0, with an absolute error below 0.01,
+// that does not need libm.
+static inline double FastLog2(double D) {
+  uint64_t Bits;
+  memcpy(&Bits, &D, sizeof(Bits));
+  int Exp = (int)((Bits >> 52) & 0x7ff) - 1023;
+  Bits = (Bits & ((1ULL << 52) - 1)) | (1023ULL << 52);
+  double M; // Mantissa, in [1, 2).
+  memcpy(&M, &Bits, sizeof(M));
+  return Exp + (-0.34484843 * M + 2.02466578) * M - 1.67487759;
+}
+
+#define NS_PER_SEC 1000000000ULL
+
+// Per-thread state of the sampling policies for NumFuncs functions. Must be
+// zero-initialized, e.g., a thread-local variable.
+template <unsigned NumFuncs> struct Sampler {
+  bool Initialized;
+  uint64_t Countdown[NumFuncs]; // Calls until the next 1-in-N sample.
+  int64_t BytesUntilSample;
+  uint64_t Rng;
+  uint64_t Tokens; // In 1/NS_PER_SEC samples.
+  uint64_t LastRefillNs;
+
+  void Init(const SamplingPolicy<NumFuncs> &P, uint64_t Seed) {
+    Rng = Seed | 1;
+    for (unsigned F = 0; F < NumFuncs; F++)
+      Countdown[F] = P.Every[F];
+    BytesUntilSample = NextByteInterval(P.MeanBytes);
+    Tokens = P.Burst * NS_PER_SEC;
+    LastRefillNs = NowNs();
+    Initialized = true;
+  }
+
+  // Whether the call of function Func allocating Size bytes (0 if Func has
+  // no size argument) is sampled.
+  __attribute__((always_inline))
+  bool ShouldSample(const SamplingPolicy<NumFuncs> &P, unsigned Func,
+                    size_t Size) {
+    if (P.Every[Func] > 1) {
+      if (--Countdown[Func])
+        return false;
+      Countdown[Func] = P.Every[Func];
+    }
+    if (P.MeanBytes && Size) {
+      BytesUntilSample -= Size;
+      if (BytesUntilSample > 0)
+        return false;
+      BytesUntilSample = NextByteInterval(P.MeanBytes);
+    }
+    if (P.Rate) {
+      uint64_t Now = NowNs();
+      uint64_t Cap = P.Burst * NS_PER_SEC;
+      uint64_t Elapsed = Now - LastRefillNs;
+      LastRefillNs = Now;
+      // Refill without overflowing after long idle periods.
+      Tokens = Elapsed >= (Cap - Tokens) / P.Rate ? Cap
+                                                  : Tokens + Elapsed * P.Rate;
+      if (Tokens < NS_PER_SEC)
+        return false;
+      Tokens -= NS_PER_SEC;
+    }
+    return true;
+  }
+
+private:
+  uint64_t NextRandom() {
+    // xorshift64*
+    Rng ^= Rng >> 12;
+    Rng ^= Rng << 25;
+    Rng ^= Rng >> 27;
+    return Rng * 0x2545f4914f6cdd1dULL;
+  }
+
+  // Exponentially distributed with the given mean.
+  int64_t NextByteInterval(uint64_t Mean) {
+    if (!Mean)
+      return 0;
+    // Uniform in (0, 1].
+    double U = ((NextRandom() >> 11) + 1) * (1.0 / (1ULL << 53));
+    // -ln(U) * Mean
+    double Interval = -FastLog2(U) * 0.6931471805599453 * Mean;
+    return Interval < 1 ? 1 : (int64_t)Interval;
+  }
+
+  static uint64_t NowNs() {
+    struct timespec Ts;
+    // Served from the vDSO; a few ns.
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &Ts);
+    return Ts.tv_sec * NS_PER_SEC + Ts.tv_nsec;
+  }
+};
+
+#endif
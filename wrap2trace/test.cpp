@@ -32,6 +32,9 @@ void r1(int k) {
 int main() {
   int k = 5;
   //printf("debug: main (k=%d)\n", k);
-  r1(k);
+  // Twice, so that each stack trace is seen twice: 20 calls, 10 unique
+  // stack traces.
+  for (int i = 0; i < 2; i++)
+    r1(k);
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,17 @@
+// Regression test of the unwind cache (see UnwindCache in wrap2trace.cpp):
+// two calls from the same frames of X and C, but from different callers of
+// C, must give different stack traces. Run with and without
+// WRAP2TRACE_UNWIND=nocache; both must print the same stack traces.
+
+#include <stdlib.h>
+
+__attribute__((noinline)) void X() { free(malloc(16)); }
+__attribute__((noinline)) void C() { X(); }
+__attribute__((noinline)) void D1() { C(); }
+__attribute__((noinline)) void D2() { C(); }
+
+int main() {
+  D1();
+  D2();
+  return 0;
+}
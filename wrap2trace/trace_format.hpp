@@ -0,0 +1,141 @@
+// Binary trace file format written by wrap2trace when WRAP2TRACE_OUTPUT is
+// set, and read back by w2t_dump.
+//
+// The file is a plain sequence of records.  Every record starts with a
+// RecordHeader and is a multiple of 8 bytes long, so a reader can walk the
+// file without knowing every record kind.  Records coming from different
+// threads are interleaved at record granularity.  Several processes (e.g.,
+// after fork/exec) may append to the same file; each of them starts with
+// its own kRecHeader record.
+
+#ifndef __TRACE_FORMAT_H__
+#define __TRACE_FORMAT_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+// "W2TRACE1" in little endian.
+#define W2T_MAGIC 0x3145434152543257ULL
+#define W2T_VERSION 6
+
+enum RecordKind : uint8_t {
+  // Payload: u64 magic, u32 version, u32 pid.
+  kRecHeader = 1,
+  // Arg: function id.  Payload: NUL terminated name, zero padded.
+  kRecFuncName = 2,
+  // Arg: function id.  Payload: u64 frames, top of the stack first.
+  kRecTrace = 3,
+  // Arg: ring id.  Payload: u64 number of records dropped since the last
+  // kRecOverflow record for the same ring.
+  kRecOverflow = 4,
+  // Arg: module id.  Payload: u64 load bias, u64 start and u64 end of the
+  // executable segments (runtime addresses), NUL terminated path, zero
+  // padded.
+  kRecModule = 5,
+  // Compressed stack trace. Aux: depth, i.e., number of frames hashed.
+  // Arg: function id.  Payload: u64 hash (see common/st_hash.hpp).
+  kRecCompressed = 6,
+  // Unique stack trace, written once per process. Trace ids are per
+  // process, and the records of processes sharing the file interleave, so
+  // these records carry the pid. Arg: trace id.  Payload: u32 pid,
+  // u32 function id, u64 frames, top of the stack first.
+  kRecUniqueTrace = 7,
+  // Arg: trace id.  Payload: u64 pid, u64 number of occurrences since the
+  // last kRecTraceCount record for the same trace. May come before the
+  // kRecUniqueTrace record of the trace.
+  kRecTraceCount = 8,
+  // Sampling policy. Arg: function id.  Payload: u64 1-in-N rate, u64 mean
+  // byte interval, u64 token bucket rate (per second) and u64 token bucket
+  // capacity; 0 for policies not in use.
+  kRecSampling = 9,
+  // Arg: function id.  Payload: u64 number of calls, u64 number of calls
+  // sampled. Written at exit.
+  kRecCallCounts = 10,
+  // Checkpoint depths of the hashes of the compressed stack traces (see
+  // common/st_hash.hpp). Arg: number of checkpoints.  Payload: u64 depths.
+  kRecHashLayout = 11,
+};
+
+struct RecordHeader {
+  uint8_t Kind;   // RecordKind
+  uint8_t Aux;    // Kind specific.
+  uint16_t Words; // Record size in 8-byte words, including the header.
+  uint32_t Arg;   // Kind specific.
+};
+
+static_assert(sizeof(RecordHeader) == 8, "RecordHeader must be one word");
+
+// Frames are encoded as (module id << 48 | offset in the module), where
+// module ids refer to kRecModule records. Module 0 is the executable, so
+// its frames are plain offsets. Addresses that are not in any known module
+// are kept as is, with W2T_UNKNOWN_MODULE as module id.
+#define W2T_MODULE_SHIFT 48
+#define W2T_UNKNOWN_MODULE 0xffffU
+
+static inline uint64_t EncodeFrame(uint32_t ModuleId, uint64_t Offset) {
+  return ((uint64_t)ModuleId << W2T_MODULE_SHIFT) | Offset;
+}
+
+static inline uint32_t FrameModule(uint64_t Frame) {
+  return Frame >> W2T_MODULE_SHIFT;
+}
+
+static inline uint64_t FrameOffset(uint64_t Frame) {
+  return Frame & ((1ULL << W2T_MODULE_SHIFT) - 1);
+}
+
+// Print a frame in the text format: "0xOFFSET" for frames in the
+// executable and unknown addresses, "ID:0xOFFSET" for frames in other
+// modules.
+static inline int PrintFrame(FILE *Out, uint64_t Frame) {
+  uint32_t Module = FrameModule(Frame);
+  if (!Module || Module == W2T_UNKNOWN_MODULE)
+    return fprintf(Out, "0x%llx", (unsigned long long)FrameOffset(Frame));
+  return fprintf(Out, "%u:0x%llx", Module,
+                 (unsigned long long)FrameOffset(Frame));
+}
+
+// Print a compressed stack trace in the text format:
+// "FUNCNAME !0xHASH DEPTH".
+static inline int PrintCompressedStackTrace(FILE *Out, const char *FuncName,
+                                            uint64_t Hash, unsigned Depth) {
+  return fprintf(Out, "%s !0x%llx %u\n", FuncName, (unsigned long long)Hash,
+                 Depth);
+}
+
+// Print the checkpoint depths of the hashes in the text format:
+// "# hash-checkpoints D1,D2,...".
+static inline void PrintHashLayout(FILE *Out, const uint64_t *Depths,
+                                   unsigned Num) {
+  fprintf(Out, "# hash-checkpoints");
+  for (unsigned I = 0; I < Num; I++)
+    fprintf(Out, "%c%llu", I ? ',' : ' ', (unsigned long long)Depths[I]);
+  fprintf(Out, "\n");
+}
+
+// Print a sampling policy in the text format:
+// "# sampling FUNCNAME every=N bytes=B rate=R burst=S".
+static inline int PrintSamplingPolicy(FILE *Out, const char *FuncName,
+                                      uint64_t Every, uint64_t MeanBytes,
+                                      uint64_t Rate, uint64_t Burst) {
+  return fprintf(Out, "# sampling %s every=%llu bytes=%llu rate=%llu "
+                      "burst=%llu\n", FuncName, (unsigned long long)Every,
+                 (unsigned long long)MeanBytes, (unsigned long long)Rate,
+                 (unsigned long long)Burst);
+}
+
+// Print the call counts of a function in the text format:
+// "# calls FUNCNAME SEEN SAMPLED".
+static inline int PrintCallCounts(FILE *Out, const char *FuncName,
+                                  uint64_t Seen, uint64_t Sampled) {
+  return fprintf(Out, "# calls %s %llu %llu\n", FuncName,
+                 (unsigned long long)Seen, (unsigned long long)Sampled);
+}
+
+// Size of the payload of a record in bytes.
+static inline size_t RecordPayloadSize(const RecordHeader &H) {
+  return ((size_t)H.Words - 1) * 8;
+}
+
+#endif
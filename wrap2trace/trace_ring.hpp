@@ -0,0 +1,93 @@
+// Single-producer/single-consumer byte ring used to hand trace records from
+// an instrumented thread to the drain thread.
+//
+// The producer (the thread owning the ring) only appends whole records and
+// publishes them by advancing Head.  The consumer (the drain thread) reads
+// [Tail, Head) and advances Tail once the bytes are written out.  Head and
+// Tail are monotonic byte counters; the position in Data is the counter
+// modulo Size.  Since only whole records are published, [Tail, Head) always
+// starts and ends at a record boundary.
+
+#ifndef __TRACE_RING_H__
+#define __TRACE_RING_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+#include "trace_format.hpp"
+
+enum RingState : int {
+  kRingFree = 0,     // Not owned by any thread. Empty.
+  kRingOwned = 1,    // Owned by a live thread.
+  kRingOrphaned = 2, // Owner exited. Freed by the drain thread once empty.
+};
+
+struct TraceRing {
+  // Written by the producer only.
+  alignas(64) std::atomic<uint64_t> Head;
+  uint64_t CachedTail;
+  // Number of records that did not fit. Written by the producer only.
+  std::atomic<uint64_t> Dropped;
+
+  // Written by the consumer only.
+  alignas(64) std::atomic<uint64_t> Tail;
+  // Value of Dropped last reported by the consumer.
+  uint64_t DroppedReported;
+
+  // Shared.
+  alignas(64) std::atomic<int> State;
+  uint32_t Id;
+  uint64_t Size; // Power of two.
+  char *Data;
+  TraceRing *Next; // Immutable once the ring is published.
+
+  // Map a new ring of Size bytes. Returns nullptr on failure.
+  static TraceRing *Create(uint32_t Id, uint64_t Size) {
+    void *Mem = mmap(nullptr, sizeof(TraceRing) + Size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Mem == MAP_FAILED)
+      return nullptr;
+    // Anonymous mappings are zeroed, i.e., all counters start at 0.
+    TraceRing *R = new (Mem) TraceRing();
+    R->Id = Id;
+    R->Size = Size;
+    R->Data = (char *)Mem + sizeof(TraceRing);
+    return R;
+  }
+
+  // Append a record made of a header and a payload. Returns false and counts
+  // the record as dropped if the ring does not have enough free space.
+  __attribute__((always_inline))
+  bool Write(const RecordHeader &H, const void *Payload) {
+    uint64_t Len = (uint64_t)H.Words * 8;
+    uint64_t Pos = Head.load(std::memory_order_relaxed);
+    if (Pos + Len - CachedTail > Size) {
+      CachedTail = Tail.load(std::memory_order_acquire);
+      if (Pos + Len - CachedTail > Size) {
+        Dropped.store(Dropped.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+        return false;
+      }
+    }
+    Pos = Copy(Pos, &H, sizeof(H));
+    Pos = Copy(Pos, Payload, Len - sizeof(H));
+    Head.store(Pos, std::memory_order_release);
+    return true;
+  }
+
+private:
+  __attribute__((always_inline))
+  uint64_t Copy(uint64_t Pos, const void *Src, uint64_t Len) {
+    uint64_t Off = Pos & (Size - 1);
+    uint64_t First = Len < Size - Off ? Len : Size - Off;
+    memcpy(Data + Off, Src, First);
+    if (First < Len)
+      memcpy(Data, (const char *)Src + First, Len - First);
+    return Pos + Len;
+  }
+};
+
+#endif
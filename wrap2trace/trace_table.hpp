@@ -0,0 +1,149 @@
+// Fixed-size, lock-free table of unique stack traces with occurrence counts.
+//
+// Most stack traces repeat: recording each unique stack trace once with a
+// count makes the output grow with the number of unique stack traces rather
+// than with the number of calls. The table uses open addressing with linear
+// probing on a 64-bit hash of the function and the frames. Frames are
+// compared in full on a hash match, so two different stack traces with the
+// same hash are never merged.
+//
+// An entry is claimed by setting its key with a CAS. The claiming thread
+// then copies the frames to the frame arena and publishes the entry by
+// setting its state to kEntryReady. A thread finding the same key before
+// then does not wait for it: it misses, and its caller records the stack
+// trace in full. Entries are never removed. Insertion fails when the probe
+// sequence or the frame arena is exhausted.
+
+#ifndef __TRACE_TABLE_H__
+#define __TRACE_TABLE_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+
+#define TRACE_TABLE_MAX_PROBES 64
+
+enum TraceEntryState : uint32_t {
+  kEntryEmpty = 0,  // Free, or claimed and being written.
+  kEntryReady = 1,
+  kEntryFailed = 2, // Arena exhausted, or unfinished at a fork; no trace.
+};
+
+struct TraceEntry {
+  std::atomic<uint64_t> Key; // 0 if empty.
+  std::atomic<uint32_t> State;
+  uint32_t FuncId;
+  uint32_t NumFrames;
+  // Whether the trace was written to the output.
+  std::atomic<bool> Emitted;
+  const uint64_t *Frames;
+  // Occurrences since the count was last flushed.
+  std::atomic<uint64_t> Count;
+};
+
+struct TraceTable {
+  TraceEntry *Entries = nullptr;
+  uint64_t Mask = 0; // Number of entries - 1.
+  uint64_t *Arena = nullptr;
+  std::atomic<uint64_t> ArenaUsed{0}; // In words.
+  uint64_t ArenaSize = 0;             // In words.
+
+  // Map a table of NumEntries (a power of two) entries, with room for
+  // ArenaWords frames in total.
+  bool Create(uint64_t NumEntries, uint64_t ArenaWords) {
+    void *E = mmap(nullptr, NumEntries * sizeof(TraceEntry),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *A = mmap(nullptr, ArenaWords * sizeof(uint64_t),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (E == MAP_FAILED || A == MAP_FAILED)
+      return false;
+    // Anonymous mappings are zeroed, i.e., all entries are empty.
+    Entries = (TraceEntry *)E;
+    Mask = NumEntries - 1;
+    Arena = (uint64_t *)A;
+    ArenaSize = ArenaWords;
+    return true;
+  }
+
+  uint64_t Size() const { return Entries ? Mask + 1 : 0; }
+
+  __attribute__((always_inline))
+  static uint64_t HashTrace(uint32_t FuncId, const uint64_t *Frames,
+                            size_t NumFrames) {
+    // Two CRC32 lanes, the second one over scrambled frames so that the
+    // lanes do not collide together.
+    uint64_t Lo = FuncId, Hi = ~(uint64_t)FuncId;
+    for (size_t I = 0; I < NumFrames; I++) {
+      Lo = __builtin_ia32_crc32di(Lo, Frames[I]);
+      Hi = __builtin_ia32_crc32di(Hi, Frames[I] * 0x9e3779b97f4a7c15ULL);
+    }
+    uint64_t Key = (Hi << 32) | Lo;
+    return Key ? Key : 1;
+  }
+
+  // Find the entry for the stack trace, or insert it. Counts an occurrence
+  // of the stack trace. Sets IsNew if the entry was inserted by this call.
+  // Returns nullptr if the stack trace could not be inserted.
+  __attribute__((always_inline))
+  TraceEntry *Insert(uint32_t FuncId, const uint64_t *Frames,
+                     size_t NumFrames, bool &IsNew) {
+    uint64_t Key = HashTrace(FuncId, Frames, NumFrames);
+    IsNew = false;
+    for (uint64_t I = 0, Idx = Key & Mask; I < TRACE_TABLE_MAX_PROBES;
+         I++, Idx = (Idx + 1) & Mask) {
+      TraceEntry &E = Entries[Idx];
+      uint64_t K = E.Key.load(std::memory_order_acquire);
+      if (!K) {
+        if (E.Key.compare_exchange_strong(K, Key, std::memory_order_acquire)) {
+          IsNew = Fill(E, FuncId, Frames, NumFrames);
+          return IsNew ? &E : nullptr;
+        }
+        // Lost the race; K is the key set by the other thread.
+      }
+      if (K != Key)
+        continue;
+
+      uint32_t S = E.State.load(std::memory_order_acquire);
+      if (S == kEntryEmpty)
+        return nullptr; // Being written by another thread.
+      if (S == kEntryReady && E.FuncId == FuncId &&
+          E.NumFrames == NumFrames &&
+          !memcmp(E.Frames, Frames, NumFrames * sizeof(uint64_t))) {
+        E.Count.fetch_add(1, std::memory_order_relaxed);
+        return &E;
+      }
+    }
+    return nullptr;
+  }
+
+  // Mark the entries claimed but not yet written as failed. In a forked
+  // child, the threads writing them are gone.
+  void FailUnfinished() {
+    for (uint64_t I = 0; I < Size(); I++) {
+      TraceEntry &E = Entries[I];
+      if (E.Key.load(std::memory_order_relaxed) &&
+          E.State.load(std::memory_order_relaxed) == kEntryEmpty)
+        E.State.store(kEntryFailed, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  bool Fill(TraceEntry &E, uint32_t FuncId, const uint64_t *Frames,
+            size_t NumFrames) {
+    uint64_t Off = ArenaUsed.fetch_add(NumFrames, std::memory_order_relaxed);
+    if (Off + NumFrames > ArenaSize) {
+      E.State.store(kEntryFailed, std::memory_order_release);
+      return false;
+    }
+    memcpy(Arena + Off, Frames, NumFrames * sizeof(uint64_t));
+    E.FuncId = FuncId;
+    E.NumFrames = NumFrames;
+    E.Frames = Arena + Off;
+    E.Count.store(1, std::memory_order_relaxed);
+    E.State.store(kEntryReady, std::memory_order_release);
+    return true;
+  }
+};
+
+#endif
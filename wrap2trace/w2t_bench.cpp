@@ -0,0 +1,394 @@
+// Overhead benchmark of wrap2trace: measures the cost of a wrapped
+// malloc/free call for each capture mode of the runtime, against an
+// uninstrumented baseline, for a range of thread counts and stack depths.
+//
+// The same source is built twice: w2t_bench without instrumentation, and
+// w2t_bench_wrapped linked with wrap2trace_bench.o (wrap2trace.cpp built
+// with -O2) and --wrap=malloc,--wrap=free.
+// As wrap2trace reads its settings once at startup, w2t_bench measures the
+// baseline itself, then runs w2t_bench_wrapped (or itself with LD_PRELOAD
+// set, for the "preload" mode) once per mode with the corresponding
+// WRAP2TRACE_* variables, and reports all results as JSON on stdout:
+//
+//   {"benchmark": "wrap2trace", "iterations": N, "calls_per_iteration": 2,
+//    "results": [{"mode": "baseline", "threads": 1, "depth": 1,
+//                 "ns_per_call": 20.1, "calls_per_sec": 49751243.8,
+//                 "overhead_ns": 0.0}, ...]}
+//
+// ns_per_call is the CPU time of a worker thread per call, averaged over
+// the threads, so it is not inflated when there are more threads than
+// cores; it does not include the drain thread. calls_per_sec is the total
+// number of calls divided by the wall time of the run. overhead_ns is
+// ns_per_call minus the baseline's for the same threads and depth.
+//
+// Each thread recurses Depth frames deep before calling malloc/free in a
+// loop, so the sweep shows how the unwinding cost grows with the depth, up
+// to MAX_STACK_TRACE_SIZE (100) frames.
+//
+// Usage: w2t_bench [-n ITERATIONS] [-t THREADS,..] [-d DEPTHS,..]
+//                  [-m MODES,..] > bench.json
+// Modes: baseline text full hash dedup sampled nocache backtrace preload
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+#define DEFAULT_ITERATIONS 10000
+#define WARMUP_ITERATIONS 100
+#define ALLOC_SIZE 16
+
+struct BenchMode {
+  const char *Name;
+  // Whether the mode runs w2t_bench_wrapped rather than w2t_bench.
+  bool Wrapped;
+  // WRAP2TRACE_* settings, as "NAME=VALUE" strings; nullptr terminated.
+  const char *Env[4];
+};
+
+// Binary output goes to /dev/null, so that the benchmark measures the
+// capture path rather than the disk. Rings are large enough not to drop
+// stack traces between two drains.
+#define BINARY_OUTPUT "WRAP2TRACE_OUTPUT=/dev/null", \
+                      "WRAP2TRACE_RING_SIZE=16777216"
+
+static const BenchMode Modes[] = {
+    {"baseline", false, {nullptr}},
+    // Text output to stderr, which is redirected to /dev/null.
+    {"text", true, {nullptr}},
+    {"full", true, {BINARY_OUTPUT, nullptr}},
+    {"hash", true, {BINARY_OUTPUT, "WRAP2TRACE_MODE=hash", nullptr}},
+    {"dedup", true, {BINARY_OUTPUT, "WRAP2TRACE_MODE=dedup", nullptr}},
+    {"sampled", true, {BINARY_OUTPUT, "WRAP2TRACE_SAMPLE_EVERY=64", nullptr}},
+    {"nocache", true, {BINARY_OUTPUT, "WRAP2TRACE_UNWIND=nocache", nullptr}},
+    {"backtrace", true,
+     {BINARY_OUTPUT, "WRAP2TRACE_UNWIND=backtrace", nullptr}},
+    // LD_PRELOAD=libwrap2trace_bench.so is added when the mode is run.
+    {"preload", false, {BINARY_OUTPUT, nullptr}},
+};
+
+static struct {
+  unsigned Iterations = DEFAULT_ITERATIONS;
+  std::vector<unsigned> Threads = {1, 2, 4, 8, 16, 32, 64};
+  std::vector<unsigned> Depths = {1, 10, 25, 50, 100};
+  std::vector<std::string> Modes;
+} Opts;
+
+// Result of one run, i.e., one thread count and depth.
+struct BenchResult {
+  unsigned Threads;
+  unsigned Depth;
+  double NsPerCall;
+  double CallsPerSec;
+};
+
+static uint64_t NowNs(clockid_t Clock) {
+  struct timespec Ts;
+  clock_gettime(Clock, &Ts);
+  return Ts.tv_sec * 1000000000ULL + Ts.tv_nsec;
+}
+
+///////////////////
+/* Worker threads */
+///////////////////
+
+struct Worker {
+  pthread_t Thread;
+  unsigned Depth;
+  pthread_barrier_t *Start;
+  uint64_t WallStartNs, WallEndNs;
+  uint64_t CpuNs;
+};
+
+__attribute__((noinline))
+static void AllocLoop(unsigned Iterations) {
+  for (unsigned I = 0; I < Iterations; I++) {
+    void *P = malloc(ALLOC_SIZE);
+    // Keep the compiler from removing the malloc/free pair.
+    asm volatile("" : : "r"(P) : "memory");
+    free(P);
+  }
+}
+
+__attribute__((noinline))
+static void RunAtDepth(Worker &W, unsigned Depth) {
+  if (Depth > 1) {
+    RunAtDepth(W, Depth - 1);
+    // Not a tail call, so that each level keeps its frame.
+    asm volatile("" : : : "memory");
+    return;
+  }
+  // Allocate the per-thread state of wrap2trace (ring, sampler) before the
+  // measurement starts.
+  AllocLoop(WARMUP_ITERATIONS);
+  pthread_barrier_wait(W.Start);
+  W.WallStartNs = NowNs(CLOCK_MONOTONIC);
+  uint64_t Cpu = NowNs(CLOCK_THREAD_CPUTIME_ID);
+  AllocLoop(Opts.Iterations);
+  W.CpuNs = NowNs(CLOCK_THREAD_CPUTIME_ID) - Cpu;
+  W.WallEndNs = NowNs(CLOCK_MONOTONIC);
+}
+
+static void *WorkerMain(void *Arg) {
+  Worker *W = (Worker *)Arg;
+  RunAtDepth(*W, W->Depth);
+  return nullptr;
+}
+
+static BenchResult RunOne(unsigned NumThreads, unsigned Depth) {
+  std::vector<Worker> Workers(NumThreads);
+  pthread_barrier_t Start;
+  pthread_barrier_init(&Start, nullptr, NumThreads);
+  for (Worker &W : Workers) {
+    W.Depth = Depth;
+    W.Start = &Start;
+    if (pthread_create(&W.Thread, nullptr, WorkerMain, &W)) {
+      fprintf(stderr, "Error: can't create %u threads\n", NumThreads);
+      exit(1);
+    }
+  }
+  for (Worker &W : Workers)
+    pthread_join(W.Thread, nullptr);
+  pthread_barrier_destroy(&Start);
+
+  uint64_t WallStart = UINT64_MAX, WallEnd = 0;
+  double CpuNs = 0;
+  for (const Worker &W : Workers) {
+    WallStart = W.WallStartNs < WallStart ? W.WallStartNs : WallStart;
+    WallEnd = W.WallEndNs > WallEnd ? W.WallEndNs : WallEnd;
+    CpuNs += W.CpuNs;
+  }
+  double Calls = 2.0 * Opts.Iterations * NumThreads;
+  double WallSec = (WallEnd - WallStart) / 1e9;
+  return {NumThreads, Depth, CpuNs / Calls,
+          WallSec > 0 ? Calls / WallSec : 0};
+}
+
+// Run the whole sweep in this process.
+static std::vector<BenchResult> RunSweep() {
+  std::vector<BenchResult> Results;
+  for (unsigned Depth : Opts.Depths)
+    for (unsigned Threads : Opts.Threads)
+      Results.push_back(RunOne(Threads, Depth));
+  return Results;
+}
+
+//////////////////////////////////////
+/* Driver, running one mode per child */
+//////////////////////////////////////
+
+static std::string JoinList(const std::vector<unsigned> &L) {
+  std::string S;
+  for (unsigned V : L)
+    S += (S.empty() ? "" : ",") + std::to_string(V);
+  return S;
+}
+
+// Path of a file next to this binary.
+static std::string SiblingPath(const char *Argv0, const char *Name) {
+  std::string Path = Argv0;
+  size_t Slash = Path.rfind('/');
+  return (Slash == std::string::npos ? "./" : Path.substr(0, Slash + 1)) +
+         Name;
+}
+
+// Run the sweep in a child process with the settings of mode M. The child
+// prints one "THREADS DEPTH NS_PER_CALL CALLS_PER_SEC" line per run.
+static bool RunMode(const BenchMode &M, const char *Argv0,
+                    std::vector<BenchResult> &Results) {
+  std::string Binary = SiblingPath(Argv0, M.Wrapped ? "w2t_bench_wrapped"
+                                                    : "w2t_bench");
+  bool IsPreload = !strcmp(M.Name, "preload");
+  std::string Library = SiblingPath(Argv0, "libwrap2trace_bench.so");
+  std::string Preload = "LD_PRELOAD=" + Library;
+  if (IsPreload && access(Library.c_str(), R_OK)) {
+    fprintf(stderr, "Error: %s not found\n", Library.c_str());
+    return false;
+  }
+
+  // The environment of this process, without the WRAP2TRACE_* variables,
+  // plus the ones of the mode.
+  std::vector<char *> Env;
+  for (char **E = environ; *E; E++)
+    if (strncmp(*E, "WRAP2TRACE_", 11) && strncmp(*E, "LD_PRELOAD=", 11))
+      Env.push_back(*E);
+  for (const char *const *E = M.Env; *E; E++)
+    Env.push_back((char *)*E);
+  if (IsPreload)
+    Env.push_back((char *)Preload.c_str());
+  Env.push_back(nullptr);
+
+  std::string Iterations = std::to_string(Opts.Iterations);
+  std::string Threads = JoinList(Opts.Threads);
+  std::string Depths = JoinList(Opts.Depths);
+  char *Argv[] = {(char *)Binary.c_str(), (char *)"--child",
+                  (char *)"-n", (char *)Iterations.c_str(),
+                  (char *)"-t", (char *)Threads.c_str(),
+                  (char *)"-d", (char *)Depths.c_str(), nullptr};
+
+  int Pipe[2];
+  if (pipe(Pipe))
+    return false;
+  posix_spawn_file_actions_t Actions;
+  posix_spawn_file_actions_init(&Actions);
+  posix_spawn_file_actions_adddup2(&Actions, Pipe[1], 1);
+  posix_spawn_file_actions_addclose(&Actions, Pipe[0]);
+  posix_spawn_file_actions_addclose(&Actions, Pipe[1]);
+  // Text output of the "text" mode, and warnings.
+  posix_spawn_file_actions_addopen(&Actions, 2, "/dev/null", O_WRONLY, 0);
+  pid_t Pid;
+  int Err = posix_spawn(&Pid, Binary.c_str(), &Actions, nullptr, Argv,
+                        Env.data());
+  posix_spawn_file_actions_destroy(&Actions);
+  close(Pipe[1]);
+  if (Err) {
+    fprintf(stderr, "Error: can't run %s: %s\n", Binary.c_str(),
+            strerror(Err));
+    close(Pipe[0]);
+    return false;
+  }
+
+  FILE *Out = fdopen(Pipe[0], "r");
+  BenchResult R;
+  while (fscanf(Out, "%u %u %lf %lf", &R.Threads, &R.Depth, &R.NsPerCall,
+                &R.CallsPerSec) == 4)
+    Results.push_back(R);
+  fclose(Out);
+  int Status;
+  waitpid(Pid, &Status, 0);
+  if (!WIFEXITED(Status) || WEXITSTATUS(Status)) {
+    fprintf(stderr, "Error: mode \"%s\" failed\n", M.Name);
+    return false;
+  }
+  return true;
+}
+
+static void PrintJson(const std::vector<const BenchMode *> &Ran,
+                      const std::vector<std::vector<BenchResult>> &Results) {
+  // Baseline per (threads, depth), if measured.
+  const std::vector<BenchResult> *Baseline = nullptr;
+  for (size_t I = 0; I < Ran.size(); I++)
+    if (!strcmp(Ran[I]->Name, "baseline"))
+      Baseline = &Results[I];
+
+  printf("{\"benchmark\": \"wrap2trace\", \"iterations\": %u, "
+         "\"calls_per_iteration\": 2,\n \"results\": [",
+         Opts.Iterations);
+  bool First = true;
+  for (size_t I = 0; I < Ran.size(); I++) {
+    for (const BenchResult &R : Results[I]) {
+      printf("%s\n  {\"mode\": \"%s\", \"threads\": %u, \"depth\": %u, "
+             "\"ns_per_call\": %.2f, \"calls_per_sec\": %.1f",
+             First ? "" : ",", Ran[I]->Name, R.Threads, R.Depth, R.NsPerCall,
+             R.CallsPerSec);
+      First = false;
+      if (Baseline)
+        for (const BenchResult &B : *Baseline)
+          if (B.Threads == R.Threads && B.Depth == R.Depth)
+            printf(", \"overhead_ns\": %.2f", R.NsPerCall - B.NsPerCall);
+      printf("}");
+    }
+  }
+  printf("\n]}\n");
+}
+
+static bool ParseList(const char *S, std::vector<unsigned> &L) {
+  L.clear();
+  for (char *End; *S; S = *End ? End + 1 : End) {
+    unsigned long V = strtoul(S, &End, 10);
+    if (End == S || (*End && *End != ',') || !V)
+      return false;
+    L.push_back(V);
+  }
+  return !L.empty();
+}
+
+static void Usage(const char *Argv0) {
+  fprintf(stderr,
+          "Usage: %s [-n ITERATIONS] [-t THREADS,..] [-d DEPTHS,..] "
+          "[-m MODES,..]\nModes:",
+          Argv0);
+  for (const BenchMode &M : Modes)
+    fprintf(stderr, " %s", M.Name);
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+  bool Child = false;
+  for (int I = 1; I < argc; I++) {
+    if (!strcmp(argv[I], "--child")) {
+      Child = true;
+      continue;
+    }
+    if (I + 1 == argc) {
+      Usage(argv[0]);
+      return 1;
+    }
+    const char *Arg = argv[++I];
+    bool Ok = true;
+    if (!strcmp(argv[I - 1], "-n")) {
+      Opts.Iterations = strtoul(Arg, nullptr, 10);
+      Ok = Opts.Iterations > 0;
+    } else if (!strcmp(argv[I - 1], "-t")) {
+      Ok = ParseList(Arg, Opts.Threads);
+    } else if (!strcmp(argv[I - 1], "-d")) {
+      Ok = ParseList(Arg, Opts.Depths);
+    } else if (!strcmp(argv[I - 1], "-m")) {
+      for (const char *S = Arg; *S;) {
+        const char *Comma = strchr(S, ',');
+        size_t Len = Comma ? Comma - S : strlen(S);
+        Opts.Modes.emplace_back(S, Len);
+        S += Len + (Comma != nullptr);
+      }
+    } else {
+      Ok = false;
+    }
+    if (!Ok) {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (Child) {
+    for (const BenchResult &R : RunSweep())
+      printf("%u %u %.3f %.1f\n", R.Threads, R.Depth, R.NsPerCall,
+             R.CallsPerSec);
+    return 0;
+  }
+
+  std::vector<const BenchMode *> Ran;
+  for (const BenchMode &M : Modes) {
+    bool Selected = Opts.Modes.empty();
+    for (const std::string &Name : Opts.Modes)
+      Selected |= Name == M.Name;
+    if (Selected)
+      Ran.push_back(&M);
+  }
+  if (Ran.size() != (Opts.Modes.empty() ? sizeof(Modes) / sizeof(Modes[0])
+                                        : Opts.Modes.size())) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<std::vector<BenchResult>> Results(Ran.size());
+  for (size_t I = 0; I < Ran.size(); I++) {
+    fprintf(stderr, "Running \"%s\"...\n", Ran[I]->Name);
+    bool Ok = !strcmp(Ran[I]->Name, "baseline")
+                  ? (Results[I] = RunSweep(), true)
+                  : RunMode(*Ran[I], argv[0], Results[I]);
+    if (!Ok)
+      return 1;
+  }
+  PrintJson(Ran, Results);
+  return 0;
+}
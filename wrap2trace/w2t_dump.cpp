@@ -0,0 +1,241 @@
+// Convert the binary output of wrap2trace (see trace_format.hpp) to the
+// text format printed by wrap2trace by default, i.e., one
+// "FUNCNAME STADDR_TOP .. STADDR_BOTTOM" line per stack trace and a
+// "# module ID BIAS START END PATH" line per loaded module, which st_reconst
+// takes as input. Compressed stack traces are printed as
+// "FUNCNAME !HASH DEPTH". Unique stack traces written in "dedup" mode are
+// printed once per process, preceded by a "# count N" line giving their
+// number of occurrences. Sampling policies and call counts are printed as
+// "# sampling" and "# calls" lines, and the checkpoint depths of the hashes
+// of compressed stack traces as a "# hash-checkpoints" line.
+//
+// Usage: w2t_dump TRACE_FILE > stack_traces.txt
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "trace_format.hpp"
+
+static void PrintTrace(const char *FuncName, const uint64_t *Frames,
+                       size_t NumFrames) {
+  fputs(FuncName, stdout);
+  for (size_t I = 0; I < NumFrames; I++) {
+    putchar(' ');
+    PrintFrame(stdout, Frames[I]);
+  }
+  putchar('\n');
+}
+
+// Smallest payload of each record kind; shorter records are skipped.
+static size_t MinPayloadSize(uint8_t Kind) {
+  switch (Kind) {
+  case kRecHeader:
+    return 16;
+  case kRecCompressed:
+  case kRecOverflow:
+  case kRecUniqueTrace:
+    return 8;
+  case kRecTraceCount:
+  case kRecCallCounts:
+    return 16;
+  case kRecSampling:
+    return 32;
+  case kRecModule:
+    return 24;
+  }
+  return 0;
+}
+
+struct UniqueTrace {
+  uint32_t FuncId = 0;
+  bool Seen = false; // Whether the kRecUniqueTrace record was read.
+  uint64_t Count = 0;
+  std::vector<uint64_t> Frames;
+};
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s TRACE_FILE\n", argv[0]);
+    return 1;
+  }
+
+  int Fd = open(argv[1], O_RDONLY);
+  struct stat St;
+  if (Fd < 0 || fstat(Fd, &St)) {
+    fprintf(stderr, "Error: can't open \"%s\"\n", argv[1]);
+    return 1;
+  }
+  size_t Size = St.st_size;
+  if (!Size)
+    return 0;
+  const char *Data = (const char *)mmap(nullptr, Size, PROT_READ, MAP_PRIVATE,
+                                        Fd, 0);
+  if (Data == MAP_FAILED) {
+    fprintf(stderr, "Error: can't map \"%s\"\n", argv[1]);
+    return 1;
+  }
+
+  // Function names of the process that wrote the records being read.
+  std::unordered_map<uint32_t, std::string> FuncNames;
+  // Unique stack traces by (pid << 32 | trace id). Printed at the end, once
+  // all of their counts are read.
+  std::unordered_map<uint64_t, UniqueTrace> UniqueTraces;
+  uint64_t NumTraces = 0, NumUnique = 0, NumDropped = 0, NumShort = 0;
+
+  auto GetFuncName = [&](uint32_t Id) {
+    auto It = FuncNames.find(Id);
+    return It != FuncNames.end() ? It->second.c_str() : "<unknown>";
+  };
+  auto PrintUniqueTraces = [&]() {
+    for (auto &KV : UniqueTraces) {
+      const UniqueTrace &T = KV.second;
+      if (!T.Seen) {
+        fprintf(stderr, "WARNING: missing stack trace %u of process %u with "
+                        "%llu occurrences.\n", (uint32_t)KV.first,
+                (uint32_t)(KV.first >> 32), (unsigned long long)T.Count);
+        continue;
+      }
+      printf("# count %llu\n", (unsigned long long)T.Count);
+      PrintTrace(GetFuncName(T.FuncId), T.Frames.data(), T.Frames.size());
+      NumTraces += T.Count;
+      NumUnique++;
+    }
+    UniqueTraces.clear();
+  };
+
+  size_t Pos = 0;
+  while (Pos + sizeof(RecordHeader) <= Size) {
+    RecordHeader H;
+    memcpy(&H, Data + Pos, sizeof(H));
+    if (!H.Words || Pos + H.Words * 8ULL > Size) {
+      fprintf(stderr, "Error: truncated or corrupt record at offset %zu\n",
+              Pos);
+      return 1;
+    }
+    const char *Payload = Data + Pos + sizeof(H);
+    Pos += H.Words * 8ULL;
+    if (RecordPayloadSize(H) < MinPayloadSize(H.Kind)) {
+      if (H.Kind == kRecHeader) {
+        fprintf(stderr, "Error: \"%s\" is not a wrap2trace file\n", argv[1]);
+        return 1;
+      }
+      NumShort++;
+      continue;
+    }
+
+    switch (H.Kind) {
+    case kRecHeader: {
+      uint64_t Magic;
+      uint32_t Version;
+      memcpy(&Magic, Payload, sizeof(Magic));
+      memcpy(&Version, Payload + sizeof(Magic), sizeof(Version));
+      if (Magic != W2T_MAGIC) {
+        fprintf(stderr, "Error: \"%s\" is not a wrap2trace file\n", argv[1]);
+        return 1;
+      }
+      if (Version != W2T_VERSION) {
+        fprintf(stderr, "Error: \"%s\" was written in format version %u, "
+                        "not %u\n", argv[1], Version, W2T_VERSION);
+        return 1;
+      }
+      FuncNames.clear();
+      break;
+    }
+    case kRecFuncName:
+      FuncNames[H.Arg] = std::string(Payload,
+                                     strnlen(Payload, RecordPayloadSize(H)));
+      break;
+    case kRecTrace: {
+      std::vector<uint64_t> Frames(RecordPayloadSize(H) / 8);
+      memcpy(Frames.data(), Payload, RecordPayloadSize(H));
+      PrintTrace(GetFuncName(H.Arg), Frames.data(), Frames.size());
+      NumTraces++;
+      break;
+    }
+    case kRecCompressed: {
+      uint64_t Hash;
+      memcpy(&Hash, Payload, sizeof(Hash));
+      PrintCompressedStackTrace(stdout, GetFuncName(H.Arg), Hash, H.Aux);
+      NumTraces++;
+      break;
+    }
+    case kRecUniqueTrace: {
+      uint32_t Ids[2]; // Pid, function id.
+      memcpy(Ids, Payload, sizeof(Ids));
+      UniqueTrace &T = UniqueTraces[(uint64_t)Ids[0] << 32 | H.Arg];
+      T.FuncId = Ids[1];
+      T.Seen = true;
+      T.Frames.resize(RecordPayloadSize(H) / 8 - 1);
+      memcpy(T.Frames.data(), Payload + 8, RecordPayloadSize(H) - 8);
+      break;
+    }
+    case kRecTraceCount: {
+      uint64_t PidCount[2];
+      memcpy(PidCount, Payload, sizeof(PidCount));
+      UniqueTraces[PidCount[0] << 32 | H.Arg].Count += PidCount[1];
+      break;
+    }
+    case kRecSampling: {
+      uint64_t P[4];
+      memcpy(P, Payload, sizeof(P));
+      PrintSamplingPolicy(stdout, GetFuncName(H.Arg), P[0], P[1], P[2], P[3]);
+      break;
+    }
+    case kRecHashLayout: {
+      std::vector<uint64_t> Depths(RecordPayloadSize(H) / 8);
+      memcpy(Depths.data(), Payload, Depths.size() * 8);
+      PrintHashLayout(stdout, Depths.data(),
+                      std::min<size_t>(H.Arg, Depths.size()));
+      break;
+    }
+    case kRecCallCounts: {
+      uint64_t Counts[2];
+      memcpy(Counts, Payload, sizeof(Counts));
+      PrintCallCounts(stdout, GetFuncName(H.Arg), Counts[0], Counts[1]);
+      break;
+    }
+    case kRecOverflow: {
+      uint64_t Count;
+      memcpy(&Count, Payload, sizeof(Count));
+      NumDropped += Count;
+      break;
+    }
+    case kRecModule: {
+      uint64_t Range[3]; // Bias, start, end.
+      memcpy(Range, Payload, sizeof(Range));
+      const char *Path = Payload + sizeof(Range);
+      printf("# module %u 0x%llx 0x%llx 0x%llx %.*s\n", H.Arg,
+             (unsigned long long)Range[0], (unsigned long long)Range[1],
+             (unsigned long long)Range[2],
+             (int)strnlen(Path, RecordPayloadSize(H) - sizeof(Range)), Path);
+      break;
+    }
+    default:
+      // Unknown record kinds are skipped.
+      break;
+    }
+  }
+
+  PrintUniqueTraces();
+
+  fprintf(stderr, "%llu stack traces read.\n", (unsigned long long)NumTraces);
+  if (NumUnique)
+    fprintf(stderr, "%llu unique stack traces with counts.\n",
+            (unsigned long long)NumUnique);
+  if (NumShort)
+    fprintf(stderr, "WARNING: %llu records shorter than their kind were "
+                    "skipped.\n", (unsigned long long)NumShort);
+  if (NumDropped)
+    fprintf(stderr, "WARNING: %llu stack traces were dropped due to ring "
+                    "buffer overflow.\n", (unsigned long long)NumDropped);
+  return 0;
+}
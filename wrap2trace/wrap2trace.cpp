@@ -2,99 +2,1451 @@
 // stack trace collectiong/printing implementation.
 
 // Compile this to an object file with:
-//   clang++ -fPIC -fno-omit-frame-pointer wrap2trace.cpp -c -o wrap2trace.o
+//   clang++ -msse4.2 -fPIC -fno-omit-frame-pointer wrap2trace.cpp -c -o wrap2trace.o
 // Link wrap2trace.o to the software to be instrumented with following flags:
-//   -Wl,--wrap=malloc,--wrap=free wrap2trace.o -ldl
+//   -Wl,--wrap=malloc,--wrap=free wrap2trace.o -ldl -lpthread
+// Any function listed in wrapped_funcs.def can be wrapped the same way, e.g.,
+// --wrap=mmap,--wrap=read,--wrap=pthread_mutex_lock,--wrap=_Znwm. Each one
+// has a capture policy, set in wrapped_funcs.def at compile time: full stack
+// traces, stack trace hashes, sampled stack traces or call counts only (see
+// CapturePolicy). Optionally, add --wrap=dlopen,--wrap=dlclose to refresh
+// the module map right when DSOs are loaded or unloaded.
+//
+// Alternatively, build a shared library to be preloaded into programs that
+// can't be relinked, with the following (one command line):
+//   clang++ -msse4.2 -fPIC -fno-omit-frame-pointer -DWRAP2TRACE_PRELOAD
+//     -shared wrap2trace.cpp -o libwrap2trace.so -ldl -lpthread
+//   LD_PRELOAD=libwrap2trace.so ./program
+// It replaces malloc, free, calloc, realloc, posix_memalign, aligned_alloc,
+// memalign, valloc, pvalloc and operator new/delete for the whole process,
+// including the shared libraries.
+//
+// Frames are printed as offsets in the module they belong to. The table of
+// loaded modules is printed as "# module ID BIAS START END PATH" lines.
+// By default, stack traces are printed to stderr as text. If the
+// WRAP2TRACE_OUTPUT environment variable names a file, stack traces are
+// instead written as binary records (see trace_format.hpp) to per-thread
+// ring buffers, and a background thread drains the rings to that file.
+// Use w2t_dump to convert the file to the text format. Other variables:
+//   WRAP2TRACE_RING_SIZE : per-thread ring size in bytes (default 1 MiB)
+//   WRAP2TRACE_DRAIN_MS  : drain interval in milliseconds (default 10)
+//
+// Stack traces are unwound by walking the frame pointers. The following
+// variables apply to both text and binary output:
+//   WRAP2TRACE_MAX_DEPTH : maximum number of frames unwound (default 100)
+//   WRAP2TRACE_UNWIND    : set to "backtrace" to unwind with backtrace(),
+//                          or to "nocache" to translate every frame on
+//                          every call (see UnwindCache)
+//   WRAP2TRACE_MODE      : set to "hash" to emit compressed stack traces,
+//                          i.e., the function, the stack trace hash (see
+//                          common/st_hash.hpp) and the depth, instead of
+//                          the frames, or to "dedup" to emit each unique
+//                          stack trace once, with occurrence counts
+//   WRAP2TRACE_MED_HASH_IDX : medium hash index of the stack trace hash
+//                          (default 4), must match the one given to
+//                          st_reconst
+//   WRAP2TRACE_HASH_CHECKPOINTS : checkpoint depths of the stack trace
+//                          hash instead, e.g., "8,16,24,32"; printed as a
+//                          "# hash-checkpoints" line
+//   WRAP2TRACE_TABLE_SIZE : number of unique stack traces kept in "dedup"
+//                          mode (default 65536)
+//   WRAP2TRACE_COUNT_MS  : interval in milliseconds at which occurrence
+//                          counts are written in "dedup" mode (default
+//                          1000); counts are always written at exit
+//
+// Sampling (see sampler.hpp) applies to the functions with the "Sampled"
+// policy, and is off by default, i.e., every call is recorded. A call is
+// recorded if all of the policies set accept it:
+//   WRAP2TRACE_SAMPLE_EVERY : record 1 in N calls of each function
+//   WRAP2TRACE_SAMPLE_EVERY_<ID> : same, for one function, where ID is
+//                          its id in wrapped_funcs.def in upper case,
+//                          e.g., WRAP2TRACE_SAMPLE_EVERY_FREE
+//   WRAP2TRACE_SAMPLE_BYTES : record malloc calls at exponentially
+//                          distributed byte intervals with this mean
+//   WRAP2TRACE_SAMPLE_RATE : record at most this many calls per second per
+//                          thread (token bucket)
+//   WRAP2TRACE_SAMPLE_BURST : token bucket capacity (default: the rate)
+// The settings are part of the output ("# sampling" lines), and so are the
+// number of calls seen and recorded per function at exit ("# calls"
+// lines), to scale the counts back up.
 
+#include <cctype>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <execinfo.h> // backtrace()
-#include <dlfcn.h> // dladdr1(), link with -ldl
-#include <link.h>
+#include <dlfcn.h> // link with -ldl
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <new>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/st_hash.hpp"
+#include "module_map.hpp"
+#include "trace_format.hpp"
+#include "sampler.hpp"
+#include "trace_ring.hpp"
+#include "trace_table.hpp"
+
 extern "C" {
 
 #define MAX_STACK_TRACE_SIZE 100
 
-// static uintptr_t Hash(uintptr_t *StackTrace, size_t StackTraceSize) {
-//   uintptr_t Res = 0;
-//   for (size_t I = 0; I < StackTraceSize; I++)
-//     Res = __builtin_ia32_crc32di(Res, StackTrace[I]);
-//   return Res & 0xfffff;
-// }
+// Functions wrapped by this file, listed in wrapped_funcs.def. Ids are
+// used in the binary output.
+enum WrappedFunc : uint32_t {
+#define WRAP2TRACE_FUNC(ID, NAME, POLICY, RET, PARAMS, ARGS, SIZE) kWrap##ID,
+#include "wrapped_funcs.def"
+#undef WRAP2TRACE_FUNC
+  kNumWrappedFuncs
+};
+
+static const char *const WrappedFuncNames[kNumWrappedFuncs] = {
+#define WRAP2TRACE_FUNC(ID, NAME, POLICY, RET, PARAMS, ARGS, SIZE) \
+  "__wrap_" #NAME,
+#include "wrapped_funcs.def"
+#undef WRAP2TRACE_FUNC
+};
+
+// Used to name per-function environment variables.
+static const char *const WrappedFuncIds[kNumWrappedFuncs] = {
+#define WRAP2TRACE_FUNC(ID, NAME, POLICY, RET, PARAMS, ARGS, SIZE) #ID,
+#include "wrapped_funcs.def"
+#undef WRAP2TRACE_FUNC
+};
+
+// What a wrapper does on each call, chosen per function at compile time.
+// Wrappers only contain the code of their policy.
+enum CapturePolicy {
+  // Record the stack trace as set by WRAP2TRACE_MODE.
+  kCaptureFull,
+  // Record the compressed stack trace (function, hash, depth), whatever
+  // WRAP2TRACE_MODE is.
+  kCaptureHash,
+  // Same as kCaptureFull, if the sampling policies accept the call.
+  kCaptureSampled,
+  // Only count the calls; they are reported at exit as "# calls" lines.
+  kCaptureCounter,
+};
+
+static constexpr CapturePolicy WrappedFuncPolicies[kNumWrappedFuncs] = {
+#define WRAP2TRACE_FUNC(ID, NAME, POLICY, RET, PARAMS, ARGS, SIZE) \
+  kCapture##POLICY,
+#include "wrapped_funcs.def"
+#undef WRAP2TRACE_FUNC
+};
+
+#define DEFAULT_RING_SIZE (1 << 20)
+#define DEFAULT_DRAIN_MS 10
+#define DEFAULT_MED_HASH_IDX 4
+#define DEFAULT_TABLE_SIZE (1 << 16)
+#define DEFAULT_COUNT_MS 1000
+
+enum OutputMode {
+  kModeFull,  // All frames of every stack trace.
+  kModeHash,  // Compressed stack traces (function, hash, depth).
+  kModeDedup, // Unique stack traces and their occurrence counts.
+};
+
+// Runtime configuration, read once at startup.
+static struct {
+  int OutFd = -1;  // Binary output file; -1 for text output to stderr.
+  uint64_t RingSize = DEFAULT_RING_SIZE;
+  unsigned DrainMs = DEFAULT_DRAIN_MS;
+  // Maximum number of frames unwound, at most MAX_STACK_TRACE_SIZE.
+  size_t MaxDepth = MAX_STACK_TRACE_SIZE;
+  // Use backtrace() instead of walking the frame pointers.
+  bool UseBacktrace = false;
+  // Reuse the translated frames of the previous stack trace of the thread.
+  bool UseUnwindCache = true;
+  OutputMode Mode = kModeFull;
+  // Checkpoint depths of the hashes, from WRAP2TRACE_HASH_CHECKPOINTS, or
+  // a single one at WRAP2TRACE_MED_HASH_IDX.
+  STHashLayout HashLayout = {};
+  uint64_t TableSize = DEFAULT_TABLE_SIZE;
+  unsigned CountMs = DEFAULT_COUNT_MS;
+  // Whether any sampling policy is set.
+  bool Sample = false;
+  // Whether calls are counted, i.e., Sample is set or some functions have
+  // the kCaptureCounter policy.
+  bool CountCalls = false;
+  SamplingPolicy<kNumWrappedFuncs> Sampling = {};
+} Config;
+
+// Set while the thread records a stack trace, initializes wrap2trace or
+// drains the rings, so that the calls of the wrapped functions made by
+// wrap2trace itself, or by the libraries it calls, are not recorded. With
+// LD_PRELOAD, every malloc() of the process goes through the wrappers.
+static __thread bool InWrapper __attribute__((tls_model("initial-exec")));
 
 /////////////////////////////////////
 /* Stack trace collection/printing */
 /////////////////////////////////////
 
+// Bounds of the stack of the current thread, set on first use. Frame
+// pointers outside of [StackLo, StackHi) end the unwinding.
+static __thread uintptr_t StackLo __attribute__((tls_model("initial-exec")));
+static __thread uintptr_t StackHi __attribute__((tls_model("initial-exec")));
+
+static bool InitStackBounds() {
+  pthread_attr_t Attr;
+  void *Addr;
+  size_t Size;
+  if (pthread_getattr_np(pthread_self(), &Attr))
+    return false;
+  bool Ok = !pthread_attr_getstack(&Attr, &Addr, &Size);
+  pthread_attr_destroy(&Attr);
+  if (!Ok)
+    return false;
+  StackLo = (uintptr_t)Addr;
+  StackHi = (uintptr_t)Addr + Size;
+  return true;
+}
+
+// Unwind the stack by following the frame pointer chain. Requires the
+// program (and the caller of the wrapper) to be compiled with
+// -fno-omit-frame-pointer. Like backtrace(), the first entry is the current
+// pc, followed by one return address per frame. Returns the number of
+// entries written, or 0 if the stack bounds of the thread are unknown.
+__attribute__((always_inline)) static size_t FramePointerUnwind(
+    void **StackTrace, size_t kMaxStackTraceSize) {
+  if (__builtin_expect(!StackHi, 0) && !InitStackBounds())
+    return 0;
+
+  void *PC;
+  asm volatile("leaq 0(%%rip), %0" : "=r"(PC));
+  StackTrace[0] = PC;
+  size_t Size = 1;
+
+  // Each frame holds the caller's frame pointer followed by the return
+  // address. Frames must be aligned, within the stack bounds, and move
+  // towards the stack bottom.
+  uintptr_t FP = (uintptr_t)__builtin_frame_address(0);
+  while (Size < kMaxStackTraceSize) {
+    if (FP < StackLo || FP + 2 * sizeof(uintptr_t) > StackHi ||
+        FP % sizeof(uintptr_t))
+      break;
+    uintptr_t *Frame = (uintptr_t *)FP;
+    if (!Frame[1])
+      break;
+    StackTrace[Size++] = (void *)Frame[1];
+    if (Frame[0] <= FP)
+      break;
+    FP = Frame[0];
+  }
+
+  // glibc is built without frame pointers, so the chain ends at the return
+  // address into the caller of main() (or of the thread start routine).
+  // backtrace() finds two more frames below it; add placeholders for them
+  // so that the same number of frames is cut off from the bottom.
+  for (int I = 0; I < 2 && Size < kMaxStackTraceSize; I++)
+    StackTrace[Size++] = nullptr;
+  return Size;
+}
+
+static void OnNewModule(uint32_t Id, const ModuleInfo &M);
+
+// The return addresses of the last stack trace unwound by the thread, from
+// the bottom of the stack up, and their translations. Consecutive calls
+// often come from the same outer context, so the return address at the same
+// distance from the bottom of the stack is often the same as last time: its
+// translation is then copied from the cache instead of being looked up in
+// the module map again. The frame pointer chain is still walked to the end
+// on every call: a frame found in the previous stack trace says nothing
+// about the frames below it (e.g., X has the same frame in main->D1->C->X
+// and main->D2->C->X), so each frame is only reused if its own return
+// address matches.
+//
+// Entries are valid for the module snapshot they were translated with; the
+// cache is cleared when the snapshot changes.
+struct UnwindCache {
+  const ModuleSnapshot *Modules;
+  size_t Size; // Entries written since the cache was last cleared.
+  uintptr_t Ret[MAX_STACK_TRACE_SIZE]; // 0 if empty.
+  uint64_t Frame[MAX_STACK_TRACE_SIZE];
+};
+static __thread UnwindCache LastUnwind
+    __attribute__((tls_model("initial-exec")));
+
+// Same as FramePointerUnwind() followed by translating the frames (except
+// the current pc, which is always cut off), reusing the translations of
+// the previous call from UnwindCache.
+__attribute__((always_inline)) static size_t CachedFramePointerUnwind(
+    void **StackTrace, size_t kMaxStackTraceSize) {
+  if (__builtin_expect(!StackHi, 0) && !InitStackBounds())
+    return 0;
+
+  void *PC;
+  asm volatile("leaq 0(%%rip), %0" : "=r"(PC));
+  StackTrace[0] = PC;
+  size_t Size = 1;
+
+  UnwindCache &C = LastUnwind;
+  const ModuleSnapshot *Modules = CurrentModules.load(std::memory_order_acquire);
+  if (C.Modules != Modules) {
+    memset(C.Ret, 0, C.Size * sizeof(C.Ret[0]));
+    C.Size = 0;
+    C.Modules = Modules;
+  }
+
+  // See FramePointerUnwind().
+  uintptr_t FP = (uintptr_t)__builtin_frame_address(0);
+  while (Size < kMaxStackTraceSize) {
+    if (FP < StackLo || FP + 2 * sizeof(uintptr_t) > StackHi ||
+        FP % sizeof(uintptr_t))
+      break;
+    uintptr_t *Frame = (uintptr_t *)FP;
+    if (!Frame[1])
+      break;
+    StackTrace[Size++] = (void *)Frame[1];
+    if (Frame[0] <= FP)
+      break;
+    FP = Frame[0];
+  }
+
+  // Translate the frames, indexing the cache from the last frame unwound.
+  // If the chain was cut at kMaxStackTraceSize, the indices are off and
+  // fewer frames match, but the translations reused are still right.
+  for (size_t I = 1; I < Size; I++) {
+    size_t Idx = Size - 1 - I;
+    uintptr_t Ret = (uintptr_t)StackTrace[I];
+    if (C.Ret[Idx] != Ret) {
+      C.Ret[Idx] = Ret;
+      C.Frame[Idx] = TranslateAddress(Ret, OnNewModule);
+    }
+    StackTrace[I] = (void *)C.Frame[Idx];
+  }
+  if (Size - 1 > C.Size)
+    C.Size = Size - 1;
+
+  // See FramePointerUnwind().
+  for (int I = 0; I < 2 && Size < kMaxStackTraceSize; I++)
+    StackTrace[Size++] = nullptr;
+  return Size;
+}
+
 __attribute__((always_inline)) static size_t GetCurrentStackTrace(
-    void **StackTrace, size_t kMaxStackTraceSize, bool translate) { 
-  uintptr_t BackTraceSize = backtrace(StackTrace, kMaxStackTraceSize);
-  
-  // TODO: Translating memory addresses to object addresses can be
-  // eliminated by using ASLR offset and DSO load addresses are known.
-  // After the mapping, one still needs which DSOs are loaded to
-  // reconstruct the call graph thus the full stack trace.
-  // Solution is to keep discard below mapping and keep track of DSOs
-  // loaded, and ASLR offset.
+    void **StackTrace, size_t kMaxStackTraceSize, bool translate) {
+  uintptr_t BackTraceSize = 0;
+  if (translate && Config.UseUnwindCache && !Config.UseBacktrace) {
+    BackTraceSize = CachedFramePointerUnwind(StackTrace, kMaxStackTraceSize);
+    if (BackTraceSize)
+      return BackTraceSize;
+  }
+  if (!Config.UseBacktrace)
+    BackTraceSize = FramePointerUnwind(StackTrace, kMaxStackTraceSize);
+  if (!BackTraceSize)
+    BackTraceSize = backtrace(StackTrace, kMaxStackTraceSize);
+
+  // Translate memory addresses to (module id, offset in the module) pairs
+  // using the module map, which keeps track of the loaded DSOs and their
+  // load addresses (see module_map.hpp). The module table is part of the
+  // output, so that the call graph of each module can be used later.
   if (translate) {
-    for (int I = 0; I < BackTraceSize; I++) {
-      Dl_info info;
-      struct link_map *map;
-      if ( dladdr1(StackTrace[I], &info, (void**)&map, RTLD_DL_LINKMAP) ) {
-        if (map->l_addr) {
-          // There is difference between the memory and the object addresses.
-          uintptr_t realdiff;
-          if (StackTrace[I] >= (void *) map->l_addr)
-            realdiff = (uintptr_t)StackTrace[I] - (uintptr_t)map->l_addr;
-          else
-            realdiff = (uintptr_t)map->l_addr - (uintptr_t)StackTrace[I];
-          StackTrace[I] = (void*)realdiff;
-        }
-      }
-    }
+    for (size_t I = 0; I < BackTraceSize; I++)
+      if (StackTrace[I])
+        StackTrace[I] = (void *)TranslateAddress((uintptr_t)StackTrace[I],
+                                                 OnNewModule);
   }
 
   return BackTraceSize;
 }
 
+// Cutting off the last one and first two frames as: last one is for
+// unwinder itself, first two are (generally) before main(). This avoids
+// the need for finding addresses to glibc calls that happen before main.
+// Intermediate frames might still include calls from DSOs; these are
+// printed as "MODULE_ID:OFFSET".
+#define STACK_TRACE_SKIP_TOP 1
+#define STACK_TRACE_SKIP_BOTTOM 2
+
+// Unwind and translate the current stack trace, and cut off the frames
+// above. The remaining frames start at StackTrace + STACK_TRACE_SKIP_TOP.
+// Returns the number of remaining frames.
+__attribute__((always_inline))
+static size_t GetTrimmedStackTrace(void **StackTrace) {
+  size_t StackTraceSize = GetCurrentStackTrace(StackTrace, Config.MaxDepth, true);
+  return StackTraceSize > STACK_TRACE_SKIP_TOP + STACK_TRACE_SKIP_BOTTOM
+       ? StackTraceSize - STACK_TRACE_SKIP_TOP - STACK_TRACE_SKIP_BOTTOM
+       : 0;
+}
+
+static void PrintTrace(const char *At, const uint64_t *Frames,
+                       size_t NumFrames) {
+  fprintf(stderr, "%s ", At);
+  for (size_t i = 0; i < NumFrames; i++) {
+      PrintFrame(stderr, Frames[i]);
+      fputc(' ', stderr);
+  }
+  fprintf(stderr, "\n");
+}
+
 __attribute__((always_inline))
 static void PrintStackTrace(const char *At) {
   void* StackTrace[MAX_STACK_TRACE_SIZE];
-  size_t StackTraceSize = GetCurrentStackTrace(StackTrace, MAX_STACK_TRACE_SIZE, true);
-
-  // Notice: duplicate stack traces might get printed as we don't check for
-  // duplicates right now. Holding a { Hash: IsSeen } mapping might help,
-  // however, it would deduplicate the traces with the same hash -- not 
-  // necessarily the same traces as two different trace might share the
-  // trace (undesired). To evaluate the compression method, keep printing
-  // all stack traces and do any deduplication during reconstruction.
-  fprintf(stderr, "%s ", At);
+  size_t NumFrames = GetTrimmedStackTrace(StackTrace);
 
-  // Cutting off the last one and first two frames as: last one is for
-  // backtrace() call, first two are (generally) before main(). This avoids
-  // the need for finding addresses to glibc calls that happen before main.
-  // This is not a solution to all DSO related issues -- intermediate frames
-  // might still include calls from DSOs.
-  for (size_t i = 1; i < StackTraceSize - 2; i++)
-      fprintf(stderr, "%p ", StackTrace[i]);
-  fprintf(stderr, "\n");
+  // Every occurrence is printed; see EmitStackTrace() for "dedup" mode,
+  // which compares the frames and prints each unique stack trace once.
+  PrintTrace(At, (uint64_t *)(StackTrace + STACK_TRACE_SKIP_TOP), NumFrames);
+}
+
+// Compute the hash of the current stack trace, with the same frames as
+// PrintStackTrace() prints. Returns the number of frames hashed.
+//
+// The hash is computed from the top of the stack, so the hash of the outer
+// frames depends on the inner ones, and it can't be reused from the unwind
+// cache; hashing is one CRC32 per frame though.
+__attribute__((always_inline))
+static size_t GetCompressedStackTrace(uint64_t *Hash) {
+  void* StackTrace[MAX_STACK_TRACE_SIZE];
+  size_t NumFrames = GetTrimmedStackTrace(StackTrace);
+  *Hash = ::Hash((uintptr_t *)(StackTrace + STACK_TRACE_SKIP_TOP), NumFrames,
+                 Config.HashLayout);
+  return NumFrames;
+}
+
+//////////////////////////////////////
+/* Binary output through ring buffers */
+//////////////////////////////////////
+
+static pthread_once_t InitOnce = PTHREAD_ONCE_INIT;
+static std::atomic<bool> Initialized;
+static std::atomic<bool> ShuttingDown;
+
+// All rings ever created. Rings are never unmapped; rings of exited threads
+// are reused by new threads.
+static std::atomic<TraceRing *> Rings;
+static std::atomic<uint32_t> NumRings;
+static pthread_key_t RingKey;
+
+// Ring of the current thread. Set to a dummy value after the thread released
+// its ring (i.e., during thread exit) so that late calls are not recorded.
+#define RING_RELEASED ((TraceRing *)1)
+static __thread TraceRing *CurrentRing
+    __attribute__((tls_model("initial-exec")));
+
+// Records lost because the calling thread had no usable ring.
+static std::atomic<uint64_t> LostRecords;
+// Total number of records dropped due to ring overflow.
+static uint64_t TotalDropped;
+
+static pthread_t DrainThread;
+
+// Pid of the process, as written in the file header.
+static uint32_t ProcessId;
+
+static void ReleaseRing(void *Ring) {
+  CurrentRing = RING_RELEASED;
+  ((TraceRing *)Ring)->State.store(kRingOrphaned, std::memory_order_release);
+}
+
+static TraceRing *AcquireRing() {
+  for (TraceRing *R = Rings.load(std::memory_order_acquire); R; R = R->Next) {
+    int Expected = kRingFree;
+    if (R->State.load(std::memory_order_relaxed) == kRingFree &&
+        R->State.compare_exchange_strong(Expected, kRingOwned,
+                                         std::memory_order_acquire))
+      return R;
+  }
+
+  TraceRing *R = TraceRing::Create(NumRings.fetch_add(1), Config.RingSize);
+  if (!R)
+    return nullptr;
+  R->State.store(kRingOwned, std::memory_order_relaxed);
+  TraceRing *Head = Rings.load(std::memory_order_relaxed);
+  do {
+    R->Next = Head;
+  } while (!Rings.compare_exchange_weak(Head, R, std::memory_order_release,
+                                        std::memory_order_relaxed));
+  return R;
+}
+
+__attribute__((always_inline))
+static TraceRing *GetCurrentRing() {
+  TraceRing *R = CurrentRing;
+  if (__builtin_expect(R != nullptr, 1))
+    return R == RING_RELEASED ? nullptr : R;
+  R = AcquireRing();
+  if (!R) {
+    CurrentRing = RING_RELEASED;
+    return nullptr;
+  }
+  CurrentRing = R;
+  // Release the ring when the thread exits.
+  pthread_setspecific(RingKey, R);
+  return R;
+}
+
+static void WriteFully(int Fd, struct iovec *Iov, int IovCnt) {
+  while (IovCnt > 0) {
+    ssize_t N = writev(Fd, Iov, IovCnt > IOV_MAX ? IOV_MAX : IovCnt);
+    if (N < 0)
+      return;
+    // Skip the fully written buffers and adjust the partially written one.
+    while (IovCnt > 0 && (size_t)N >= Iov->iov_len) {
+      N -= Iov->iov_len;
+      Iov++;
+      IovCnt--;
+    }
+    if (IovCnt > 0) {
+      Iov->iov_base = (char *)Iov->iov_base + N;
+      Iov->iov_len -= N;
+    }
+  }
+}
+
+#define DRAIN_BATCH 256
+
+// Write out the published contents of all rings. Only called from the drain
+// thread, or at exit after the drain thread is stopped.
+static void DrainRings() {
+  // Each ring contributes at most 2 buffers (its contents might wrap
+  // around) and an overflow record.
+  struct iovec Iov[DRAIN_BATCH * 3];
+  struct {
+    RecordHeader H;
+    uint64_t Count;
+  } Overflows[DRAIN_BATCH];
+  TraceRing *Drained[DRAIN_BATCH];
+  uint64_t NewTails[DRAIN_BATCH];
+  int IovCnt = 0, NumDrained = 0, NumOverflows = 0;
+
+  auto Flush = [&]() {
+    WriteFully(Config.OutFd, Iov, IovCnt);
+    for (int I = 0; I < NumDrained; I++) {
+      TraceRing *R = Drained[I];
+      R->Tail.store(NewTails[I], std::memory_order_release);
+      // Recycle the rings of exited threads once they are empty.
+      int Expected = kRingOrphaned;
+      if (R->Head.load(std::memory_order_acquire) == NewTails[I])
+        R->State.compare_exchange_strong(Expected, kRingFree);
+    }
+    IovCnt = NumDrained = NumOverflows = 0;
+  };
+
+  for (TraceRing *R = Rings.load(std::memory_order_acquire); R; R = R->Next) {
+    uint64_t Head = R->Head.load(std::memory_order_acquire);
+    uint64_t Tail = R->Tail.load(std::memory_order_relaxed);
+    uint64_t Dropped = R->Dropped.load(std::memory_order_relaxed);
+
+    if (Dropped != R->DroppedReported) {
+      auto &O = Overflows[NumOverflows++];
+      O.H = RecordHeader{kRecOverflow, 0, 2, R->Id};
+      O.Count = Dropped - R->DroppedReported;
+      TotalDropped += O.Count;
+      R->DroppedReported = Dropped;
+      Iov[IovCnt++] = {&O, sizeof(O)};
+    }
+    if (Head != Tail) {
+      uint64_t Off = Tail & (R->Size - 1);
+      uint64_t Len = Head - Tail;
+      uint64_t First = Len < R->Size - Off ? Len : R->Size - Off;
+      Iov[IovCnt++] = {R->Data + Off, First};
+      if (First < Len)
+        Iov[IovCnt++] = {R->Data, Len - First};
+    }
+    Drained[NumDrained] = R;
+    NewTails[NumDrained++] = Head;
+
+    if (NumDrained == DRAIN_BATCH)
+      Flush();
+  }
+  Flush();
+}
+
+static void WriteTraceCounts(bool AtExit);
+
+static void *DrainLoop(void *) {
+  InWrapper = true;
+  struct timespec Interval = {(time_t)(Config.DrainMs / 1000),
+                              (long)(Config.DrainMs % 1000) * 1000000};
+  unsigned SinceCounts = 0;
+  while (!ShuttingDown.load(std::memory_order_acquire)) {
+    nanosleep(&Interval, nullptr);
+    DrainRings();
+    SinceCounts += Config.DrainMs;
+    if (Config.Mode == kModeDedup && SinceCounts >= Config.CountMs) {
+      WriteTraceCounts(false);
+      SinceCounts = 0;
+    }
+  }
+  return nullptr;
+}
+
+static void WriteRecord(int Fd, RecordHeader H, const void *Payload) {
+  struct iovec Iov[2] = {{&H, sizeof(H)},
+                         {(void *)Payload, RecordPayloadSize(H)}};
+  WriteFully(Fd, Iov, 2);
+}
+
+static void WriteSamplingPolicy();
+static void WriteHashLayout();
+
+static void WriteFileHeader() {
+  struct {
+    uint64_t Magic;
+    uint32_t Version;
+    uint32_t Pid;
+  } Payload = {W2T_MAGIC, W2T_VERSION, ProcessId = getpid()};
+  WriteRecord(Config.OutFd, RecordHeader{kRecHeader, 0, 3, 0}, &Payload);
+
+  for (uint32_t I = 0; I < kNumWrappedFuncs; I++) {
+    char Name[256] = {};
+    size_t Len = strlen(WrappedFuncNames[I]);
+    memcpy(Name, WrappedFuncNames[I], Len);
+    uint16_t Words = 1 + (Len + 1 + 7) / 8;
+    WriteRecord(Config.OutFd, RecordHeader{kRecFuncName, 0, Words, I}, Name);
+  }
+
+  if (Config.Sample)
+    WriteSamplingPolicy();
+  if (Config.Mode == kModeHash)
+    WriteHashLayout();
+
+  // Modules seen so far, e.g., by the parent process before fork().
+  for (uint32_t I = 0; I < NumModules; I++)
+    OnNewModule(I, Modules[I]);
+}
+
+static void OnNewModule(uint32_t Id, const ModuleInfo &M) {
+  if (Config.OutFd < 0) {
+    fprintf(stderr, "# module %u 0x%lx 0x%lx 0x%lx %s\n", Id,
+            (unsigned long)M.Bias, (unsigned long)M.Start,
+            (unsigned long)M.End, M.Name);
+    return;
+  }
+  struct {
+    uint64_t Bias, Start, End;
+    char Name[MODULE_NAME_SIZE + 8];
+  } Payload = {M.Bias, M.Start, M.End, {}};
+  size_t Len = strnlen(M.Name, MODULE_NAME_SIZE - 1);
+  memcpy(Payload.Name, M.Name, Len);
+  uint16_t Words = 1 + 3 + (Len + 1 + 7) / 8;
+  WriteRecord(Config.OutFd, RecordHeader{kRecModule, 0, Words, Id}, &Payload);
+}
+
+////////////////////////////////////
+/* Deduplication of stack traces */
+////////////////////////////////////
+
+// Unique stack traces seen in "dedup" mode. The index of an entry is its
+// trace id in the output.
+static TraceTable Traces;
+
+static uint32_t TraceId(const TraceEntry &E) {
+  return &E - Traces.Entries;
+}
+
+// Write the kRecUniqueTrace record of entry E directly to the output file.
+static void WriteUniqueTrace(const TraceEntry &E) {
+  RecordHeader H{kRecUniqueTrace, 0, (uint16_t)(2 + E.NumFrames), TraceId(E)};
+  uint32_t Ids[2] = {ProcessId, E.FuncId};
+  struct iovec Iov[3] = {{&H, sizeof(H)},
+                         {Ids, sizeof(Ids)},
+                         {(void *)E.Frames, E.NumFrames * sizeof(uint64_t)}};
+  WriteFully(Config.OutFd, Iov, 3);
+}
+
+// Write the occurrence counts accumulated since the last call, as
+// kRecTraceCount records. Only called from the drain thread, or at exit
+// after the drain thread is stopped. Counts of stack traces whose
+// kRecUniqueTrace record was not written yet (as the ring was full) are
+// kept for later, except at exit, where the record is written first.
+static void WriteTraceCounts(bool AtExit) {
+  struct {
+    RecordHeader H;
+    uint64_t Pid;
+    uint64_t Count;
+  } Counts[DRAIN_BATCH];
+  int NumCounts = 0;
+
+  auto Flush = [&]() {
+    struct iovec Iov = {Counts, NumCounts * sizeof(Counts[0])};
+    WriteFully(Config.OutFd, &Iov, 1);
+    NumCounts = 0;
+  };
+
+  for (uint64_t I = 0; I < Traces.Size(); I++) {
+    TraceEntry &E = Traces.Entries[I];
+    if (E.State.load(std::memory_order_acquire) != kEntryReady)
+      continue;
+    if (!E.Emitted.load(std::memory_order_acquire)) {
+      if (!AtExit || E.Emitted.exchange(true))
+        continue;
+      WriteUniqueTrace(E);
+    }
+    uint64_t Count = E.Count.exchange(0, std::memory_order_relaxed);
+    if (!Count)
+      continue;
+    Counts[NumCounts++] = {RecordHeader{kRecTraceCount, 0, 3, TraceId(E)},
+                           ProcessId, Count};
+    if (NumCounts == DRAIN_BATCH)
+      Flush();
+  }
+  Flush();
+}
+
+// Print the unique stack traces and their occurrence counts in the text
+// format: a "# count N" line followed by the stack trace.
+static void PrintTraceCounts() {
+  for (uint64_t I = 0; I < Traces.Size(); I++) {
+    TraceEntry &E = Traces.Entries[I];
+    if (E.State.load(std::memory_order_acquire) != kEntryReady)
+      continue;
+    uint64_t Count = E.Count.exchange(0, std::memory_order_relaxed);
+    if (!Count)
+      continue;
+    fprintf(stderr, "# count %llu\n", (unsigned long long)Count);
+    PrintTrace(WrappedFuncNames[E.FuncId], E.Frames, E.NumFrames);
+  }
+}
+
+// The stack traces seen by the parent are kept, but their counts belong to
+// the parent, and the child writes its own output, so they are re-emitted.
+// The entries being written by other threads of the parent are never
+// finished in the child.
+static void ResetTraceCounts() {
+  Traces.FailUnfinished();
+  for (uint64_t I = 0; I < Traces.Size(); I++) {
+    Traces.Entries[I].Count.store(0, std::memory_order_relaxed);
+    Traces.Entries[I].Emitted.store(false, std::memory_order_relaxed);
+  }
+}
+
+//////////////
+/* Sampling */
+//////////////
+
+static uint64_t GetEnvUInt(const char *Name, uint64_t Default) {
+  const char *Val = getenv(Name);
+  return Val && *Val ? strtoull(Val, nullptr, 0) : Default;
+}
+
+static __thread Sampler<kNumWrappedFuncs> ThreadSampler
+    __attribute__((tls_model("initial-exec")));
+
+// Number of calls seen and sampled by the current thread, added to the
+// totals every SAMPLE_COUNT_FLUSH calls and when the thread exits.
+struct CallCounts {
+  bool Registered; // Whether the counts are flushed at thread exit.
+  uint64_t Seen[kNumWrappedFuncs];
+  uint64_t Sampled[kNumWrappedFuncs];
+};
+static __thread CallCounts ThreadCalls
+    __attribute__((tls_model("initial-exec")));
+static std::atomic<uint64_t> TotalSeen[kNumWrappedFuncs];
+static std::atomic<uint64_t> TotalSampled[kNumWrappedFuncs];
+static pthread_key_t CallCountsKey;
+
+#define SAMPLE_COUNT_FLUSH 4096
+
+static void FlushCallCounts(void * = nullptr) {
+  for (uint32_t F = 0; F < kNumWrappedFuncs; F++) {
+    TotalSeen[F].fetch_add(ThreadCalls.Seen[F], std::memory_order_relaxed);
+    TotalSampled[F].fetch_add(ThreadCalls.Sampled[F],
+                              std::memory_order_relaxed);
+    ThreadCalls.Seen[F] = ThreadCalls.Sampled[F] = 0;
+  }
+}
+
+__attribute__((always_inline))
+static void CountCall(WrappedFunc Func, bool Sampled) {
+  if (__builtin_expect(!ThreadCalls.Registered, 0)) {
+    ThreadCalls.Registered = true;
+    pthread_setspecific(CallCountsKey, &ThreadCalls);
+  }
+  ThreadCalls.Sampled[Func] += Sampled;
+  if (__builtin_expect(++ThreadCalls.Seen[Func] == SAMPLE_COUNT_FLUSH, 0))
+    FlushCallCounts();
+}
+
+static void InitThreadSampler() {
+  struct timespec Ts;
+  clock_gettime(CLOCK_MONOTONIC, &Ts);
+  ThreadSampler.Init(Config.Sampling, (uintptr_t)&ThreadSampler ^
+                                      (Ts.tv_sec * NS_PER_SEC + Ts.tv_nsec));
+}
+
+// Whether the call of Func allocating Size bytes (0 for functions without a
+// size) is to be recorded.
+__attribute__((always_inline))
+static bool ShouldSample(WrappedFunc Func, size_t Size) {
+  if (__builtin_expect(!ThreadSampler.Initialized, 0))
+    InitThreadSampler();
+  bool Sampled = ThreadSampler.ShouldSample(Config.Sampling, Func, Size);
+  CountCall(Func, Sampled);
+  return Sampled;
+}
+
+static void WriteSamplingPolicy() {
+  const SamplingPolicy<kNumWrappedFuncs> &P = Config.Sampling;
+  for (uint32_t F = 0; F < kNumWrappedFuncs; F++) {
+    if (WrappedFuncPolicies[F] != kCaptureSampled)
+      continue;
+    uint64_t Every = P.Every[F] > 1 ? P.Every[F] : 1;
+    if (Config.OutFd < 0) {
+      PrintSamplingPolicy(stderr, WrappedFuncNames[F], Every, P.MeanBytes,
+                          P.Rate, P.Burst);
+      continue;
+    }
+    uint64_t Payload[4] = {Every, P.MeanBytes, P.Rate, P.Burst};
+    WriteRecord(Config.OutFd, RecordHeader{kRecSampling, 0, 5, F}, Payload);
+  }
+}
+
+// Write the number of calls seen and sampled per function called. Calls of
+// other threads still running and not flushed yet are not included.
+static void WriteCallCounts() {
+  FlushCallCounts();
+  for (uint32_t F = 0; F < kNumWrappedFuncs; F++) {
+    uint64_t Payload[2] = {TotalSeen[F].load(), TotalSampled[F].load()};
+    if (!Payload[0])
+      continue;
+    if (Config.OutFd < 0)
+      PrintCallCounts(stderr, WrappedFuncNames[F], Payload[0], Payload[1]);
+    else
+      WriteRecord(Config.OutFd, RecordHeader{kRecCallCounts, 0, 3, F},
+                  Payload);
+  }
+}
+
+// The calls of the parent are reported by the parent.
+static void ResetCallCounts() {
+  for (uint32_t F = 0; F < kNumWrappedFuncs; F++) {
+    TotalSeen[F].store(0, std::memory_order_relaxed);
+    TotalSampled[F].store(0, std::memory_order_relaxed);
+    ThreadCalls.Seen[F] = ThreadCalls.Sampled[F] = 0;
+  }
+}
+
+// Read the sampling policies from the environment. They apply to the
+// functions with the kCaptureSampled policy.
+static void InitSampling() {
+  SamplingPolicy<kNumWrappedFuncs> &P = Config.Sampling;
+  uint64_t Every = GetEnvUInt("WRAP2TRACE_SAMPLE_EVERY", 1);
+  for (uint32_t F = 0; F < kNumWrappedFuncs; F++) {
+    if (WrappedFuncPolicies[F] != kCaptureSampled)
+      continue;
+    // "Malloc" -> "WRAP2TRACE_SAMPLE_EVERY_MALLOC"
+    char Name[64] = "WRAP2TRACE_SAMPLE_EVERY_";
+    const char *Func = WrappedFuncIds[F];
+    for (size_t I = strlen(Name); *Func && I + 1 < sizeof(Name); I++)
+      Name[I] = toupper(*Func++);
+    P.Every[F] = GetEnvUInt(Name, Every);
+  }
+  P.MeanBytes = GetEnvUInt("WRAP2TRACE_SAMPLE_BYTES", 0);
+  P.Rate = GetEnvUInt("WRAP2TRACE_SAMPLE_RATE", 0);
+  P.Burst = GetEnvUInt("WRAP2TRACE_SAMPLE_BURST", P.Rate);
+  if (P.Rate && !P.Burst)
+    P.Burst = 1;
+
+  Config.Sample = P.Enabled();
+  Config.CountCalls = Config.Sample;
+  for (uint32_t F = 0; F < kNumWrappedFuncs; F++)
+    Config.CountCalls |= WrappedFuncPolicies[F] == kCaptureCounter;
+  if (Config.CountCalls) {
+    pthread_key_create(&CallCountsKey, FlushCallCounts);
+    pthread_atfork(nullptr, nullptr, ResetCallCounts);
+  }
+}
+
+// In the child, the rings contain records of the parent (which the parent
+// will write out) and the drain thread is gone.
+static void AtForkChild() {
+  for (TraceRing *R = Rings.load(std::memory_order_relaxed); R; R = R->Next) {
+    R->Tail.store(R->Head.load(std::memory_order_relaxed));
+    R->DroppedReported = R->Dropped.load(std::memory_order_relaxed);
+    if (R != CurrentRing)
+      R->State.store(kRingFree);
+  }
+  TotalDropped = 0;
+  ResetTraceCounts();
+  WriteFileHeader();
+  if (pthread_create(&DrainThread, nullptr, DrainLoop, nullptr))
+    ShuttingDown.store(true);
+}
+
+static void InitHashLayout() {
+  const char *Checkpoints = getenv("WRAP2TRACE_HASH_CHECKPOINTS");
+  if (Checkpoints && *Checkpoints) {
+    if (ParseHashLayout(Checkpoints, Config.HashLayout))
+      return;
+    fprintf(stderr, "wrap2trace: invalid WRAP2TRACE_HASH_CHECKPOINTS \"%s\", "
+                    "using WRAP2TRACE_MED_HASH_IDX instead.\n", Checkpoints);
+  }
+  unsigned MedHashIdx = GetEnvUInt("WRAP2TRACE_MED_HASH_IDX",
+                                   DEFAULT_MED_HASH_IDX);
+  if (!SetHashCheckpoints(Config.HashLayout, &MedHashIdx, 1)) {
+    MedHashIdx = DEFAULT_MED_HASH_IDX;
+    SetHashCheckpoints(Config.HashLayout, &MedHashIdx, 1);
+  }
+}
+
+// Write the checkpoint depths of the hashes, which the search needs to
+// decompress the stack traces.
+static void WriteHashLayout() {
+  const STHashLayout &L = Config.HashLayout;
+  uint64_t Depths[ST_HASH_MAX_CHECKPOINTS];
+  for (unsigned I = 0; I < L.NumCheckpoints; I++)
+    Depths[I] = L.Depths[I];
+  if (Config.OutFd < 0)
+    PrintHashLayout(stderr, Depths, L.NumCheckpoints);
+  else
+    WriteRecord(Config.OutFd,
+                RecordHeader{kRecHashLayout, 0,
+                             (uint16_t)(1 + L.NumCheckpoints),
+                             L.NumCheckpoints},
+                Depths);
+}
+
+static void Init() {
+  const char *Mode = getenv("WRAP2TRACE_MODE");
+  if (Mode && !strcmp(Mode, "hash"))
+    Config.Mode = kModeHash;
+  else if (Mode && !strcmp(Mode, "dedup"))
+    Config.Mode = kModeDedup;
+  InitHashLayout();
+  Config.MaxDepth = GetEnvUInt("WRAP2TRACE_MAX_DEPTH", MAX_STACK_TRACE_SIZE);
+  if (Config.MaxDepth > MAX_STACK_TRACE_SIZE)
+    Config.MaxDepth = MAX_STACK_TRACE_SIZE;
+  const char *Unwind = getenv("WRAP2TRACE_UNWIND");
+  Config.UseBacktrace = Unwind && !strcmp(Unwind, "backtrace");
+  Config.UseUnwindCache = !(Unwind && !strcmp(Unwind, "nocache"));
+  InitSampling();
+
+  if (Config.Mode == kModeDedup) {
+    Config.TableSize = GetEnvUInt("WRAP2TRACE_TABLE_SIZE", DEFAULT_TABLE_SIZE);
+    Config.CountMs = GetEnvUInt("WRAP2TRACE_COUNT_MS", DEFAULT_COUNT_MS);
+    // Round the table size up to a power of two. The frame arena has room
+    // for unique stack traces of 32 frames on average; both are mapped
+    // lazily, so only the used part takes memory.
+    if (Config.TableSize < 1024)
+      Config.TableSize = 1024;
+    Config.TableSize = 1ULL << (64 - __builtin_clzll(Config.TableSize - 1));
+    if (!Traces.Create(Config.TableSize, Config.TableSize * 32)) {
+      fprintf(stderr, "wrap2trace: can't allocate the stack trace table, "
+                      "printing all stack traces instead.\n");
+      Config.Mode = kModeFull;
+    }
+  }
+
+  const char *OutPath = getenv("WRAP2TRACE_OUTPUT");
+  if (OutPath && *OutPath) {
+    Config.RingSize = GetEnvUInt("WRAP2TRACE_RING_SIZE", DEFAULT_RING_SIZE);
+    Config.DrainMs = GetEnvUInt("WRAP2TRACE_DRAIN_MS", DEFAULT_DRAIN_MS);
+    // Round the ring size up to a power of two.
+    if (Config.RingSize < 4096)
+      Config.RingSize = 4096;
+    Config.RingSize = 1ULL << (64 - __builtin_clzll(Config.RingSize - 1));
+
+    Config.OutFd = open(OutPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0644);
+    if (Config.OutFd < 0) {
+      fprintf(stderr, "wrap2trace: can't open \"%s\", printing stack traces "
+                      "to stderr instead.\n", OutPath);
+    } else {
+      WriteFileHeader();
+      pthread_key_create(&RingKey, ReleaseRing);
+      pthread_atfork(nullptr, nullptr, AtForkChild);
+      if (pthread_create(&DrainThread, nullptr, DrainLoop, nullptr)) {
+        fprintf(stderr, "wrap2trace: can't create the drain thread, printing "
+                        "stack traces to stderr instead.\n");
+        close(Config.OutFd);
+        Config.OutFd = -1;
+      }
+    }
+  }
+  if (Config.OutFd < 0 && Config.Mode == kModeDedup)
+    pthread_atfork(nullptr, nullptr, ResetTraceCounts);
+  if (Config.OutFd < 0 && Config.Sample)
+    WriteSamplingPolicy();
+  if (Config.OutFd < 0 && Config.Mode == kModeHash)
+    WriteHashLayout();
+  RefreshModules(OnNewModule);
+  Initialized.store(true, std::memory_order_release);
+}
+
+__attribute__((constructor))
+static void InitWrap2Trace() {
+  InWrapper = true;
+  pthread_once(&InitOnce, Init);
+  InWrapper = false;
+}
+
+__attribute__((destructor))
+static void FiniWrap2Trace() {
+  if (Config.OutFd < 0) {
+    if (Config.Mode == kModeDedup)
+      PrintTraceCounts();
+    if (Config.CountCalls)
+      WriteCallCounts();
+    return;
+  }
+  if (ShuttingDown.exchange(true))
+    return;
+  pthread_join(DrainThread, nullptr);
+  DrainRings();
+  if (Config.Mode == kModeDedup)
+    WriteTraceCounts(true);
+  if (Config.CountCalls)
+    WriteCallCounts();
+  uint64_t Lost = LostRecords.load();
+  if (TotalDropped || Lost)
+    fprintf(stderr, "wrap2trace: WARNING: %llu stack traces were dropped due "
+                    "to ring buffer overflow, %llu could not be recorded.\n",
+                    (unsigned long long)TotalDropped,
+                    (unsigned long long)Lost);
+}
+
+__attribute__((always_inline))
+static void WriteStackTrace(WrappedFunc Func) {
+  TraceRing *Ring = GetCurrentRing();
+  if (!Ring || ShuttingDown.load(std::memory_order_relaxed)) {
+    LostRecords.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  void* StackTrace[MAX_STACK_TRACE_SIZE];
+  size_t NumFrames = GetTrimmedStackTrace(StackTrace);
+  RecordHeader H{kRecTrace, 0, (uint16_t)(1 + NumFrames), Func};
+  Ring->Write(H, StackTrace + STACK_TRACE_SKIP_TOP);
+}
+
+static_assert(STACK_TRACE_SKIP_TOP >= 1, "No room for the ids");
+
+// Count an occurrence of the current stack trace in the table, and write
+// the stack trace if it is seen for the first time. Stack traces that don't
+// fit in the table are written in full.
+__attribute__((always_inline))
+static void WriteDedupStackTrace(WrappedFunc Func) {
+  TraceRing *Ring = GetCurrentRing();
+  if (!Ring || ShuttingDown.load(std::memory_order_relaxed)) {
+    LostRecords.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  void* StackTrace[MAX_STACK_TRACE_SIZE];
+  size_t NumFrames = GetTrimmedStackTrace(StackTrace);
+  uint64_t *Frames = (uint64_t *)(StackTrace + STACK_TRACE_SKIP_TOP);
+  bool IsNew;
+  TraceEntry *E = Traces.Insert(Func, Frames, NumFrames, IsNew);
+  if (!E) {
+    Ring->Write(RecordHeader{kRecTrace, 0, (uint16_t)(1 + NumFrames), Func},
+                Frames);
+    return;
+  }
+
+  // Emit the stack trace once. If the ring is full, the next occurrence
+  // (or the final count flush) tries again.
+  if (E->Emitted.load(std::memory_order_relaxed) ||
+      E->Emitted.exchange(true, std::memory_order_acquire))
+    return;
+  // The payload is the pid and the function id followed by the frames; the
+  // ids go to the slot of the skipped top frame.
+  uint32_t Ids[2] = {ProcessId, Func};
+  memcpy(&Frames[-1], Ids, sizeof(Ids));
+  RecordHeader H{kRecUniqueTrace, 0, (uint16_t)(2 + NumFrames), TraceId(*E)};
+  if (!Ring->Write(H, Frames - 1))
+    E->Emitted.store(false, std::memory_order_release);
 }
 
-//////////////////////////////
-/* Wrappers for malloc/free */
-//////////////////////////////
+// Text output in "dedup" mode: the table is printed at exit.
+__attribute__((always_inline))
+static void CountStackTrace(WrappedFunc Func) {
+  void* StackTrace[MAX_STACK_TRACE_SIZE];
+  size_t NumFrames = GetTrimmedStackTrace(StackTrace);
+  uint64_t *Frames = (uint64_t *)(StackTrace + STACK_TRACE_SKIP_TOP);
+  bool IsNew;
+  if (!Traces.Insert(Func, Frames, NumFrames, IsNew))
+    PrintTrace(WrappedFuncNames[Func], Frames, NumFrames);
+}
+
+__attribute__((always_inline))
+static void WriteCompressedStackTrace(WrappedFunc Func) {
+  TraceRing *Ring = GetCurrentRing();
+  if (!Ring || ShuttingDown.load(std::memory_order_relaxed)) {
+    LostRecords.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  uint64_t Hash;
+  size_t Depth = GetCompressedStackTrace(&Hash);
+  RecordHeader H{kRecCompressed, (uint8_t)Depth, 2, Func};
+  Ring->Write(H, &Hash);
+}
 
-void *__real_malloc(size_t);
-void __real_free(void*);
+__attribute__((always_inline))
+static void EmitCompressedStackTrace(WrappedFunc Func) {
+  if (Config.OutFd >= 0) {
+    WriteCompressedStackTrace(Func);
+  } else {
+    uint64_t Hash;
+    size_t Depth = GetCompressedStackTrace(&Hash);
+    PrintCompressedStackTrace(stderr, WrappedFuncNames[Func], Hash, Depth);
+  }
+}
 
-void *__wrap_malloc(size_t size) {
-  PrintStackTrace("__wrap_malloc");
-  return __real_malloc(size);
+// Record the current stack trace in the configured mode.
+__attribute__((always_inline))
+static void EmitStackTrace(WrappedFunc Func) {
+  switch (Config.Mode) {
+  case kModeHash:
+    EmitCompressedStackTrace(Func);
+    break;
+  case kModeDedup:
+    if (Config.OutFd >= 0)
+      WriteDedupStackTrace(Func);
+    else
+      CountStackTrace(Func);
+    break;
+  case kModeFull:
+    if (Config.OutFd >= 0)
+      WriteStackTrace(Func);
+    else
+      PrintStackTrace(WrappedFuncNames[Func]);
+    break;
+  }
 }
 
-void __wrap_free(void* ptr) {
-  PrintStackTrace("__wrap_free");
-  __real_free(ptr);
+// Per-policy body of the wrappers. Record(Func, Size) handles a call of
+// Func with a size of Size bytes (0 if Func has no size argument). Making
+// the policy a template argument rather than a runtime setting keeps the
+// code of the other policies out of the wrappers, e.g., free() with the
+// counter policy never unwinds nor reads the sampling settings.
+extern "C++" {
+
+template <CapturePolicy Policy> struct Capture;
+
+template <> struct Capture<kCaptureFull> {
+  __attribute__((always_inline))
+  static void Record(WrappedFunc Func, size_t) { EmitStackTrace(Func); }
+};
+
+template <> struct Capture<kCaptureHash> {
+  __attribute__((always_inline))
+  static void Record(WrappedFunc Func, size_t) {
+    EmitCompressedStackTrace(Func);
+  }
+};
+
+template <> struct Capture<kCaptureSampled> {
+  __attribute__((always_inline))
+  static void Record(WrappedFunc Func, size_t Size) {
+    if (!Config.Sample || ShouldSample(Func, Size))
+      EmitStackTrace(Func);
+  }
+};
+
+template <> struct Capture<kCaptureCounter> {
+  __attribute__((always_inline))
+  static void Record(WrappedFunc Func, size_t) { CountCall(Func, false); }
+};
+
+// Handle a call of the wrapped function Func according to its policy,
+// unless the call is made by wrap2trace itself.
+template <WrappedFunc Func>
+__attribute__((always_inline))
+static void RecordCall(size_t Size) {
+  if (InWrapper)
+    return;
+  InWrapper = true;
+  if (__builtin_expect(!Initialized.load(std::memory_order_acquire), 0))
+    pthread_once(&InitOnce, Init);
+  Capture<WrappedFuncPolicies[Func]>::Record(Func, Size);
+  InWrapper = false;
+}
+
+} // extern "C++"
+
+#ifndef WRAP2TRACE_PRELOAD
+
+//////////////////////////////////////////////////
+/* Wrappers for the functions in wrapped_funcs.def */
+//////////////////////////////////////////////////
+
+// The __real_ symbols are weak, so that only the functions given to --wrap
+// need to be defined; the other wrappers are never called.
+#define WRAP2TRACE_FUNC(ID, NAME, POLICY, RET, PARAMS, ARGS, SIZE)            \
+  RET __real_##NAME PARAMS __attribute__((weak));                             \
+  RET __wrap_##NAME PARAMS {                                                  \
+    RecordCall<kWrap##ID>(SIZE);                                              \
+    return __real_##NAME ARGS;                                                \
+  }
+#include "wrapped_funcs.def"
+#undef WRAP2TRACE_FUNC
+
+//////////////////////////////////////////////////////////////
+/* Wrappers for dlopen/dlclose, to keep the module map exact */
+//////////////////////////////////////////////////////////////
+
+// Only used if linked with -Wl,--wrap=dlopen,--wrap=dlclose. Otherwise,
+// the module map is refreshed when an address in a new module is seen.
+void *__real_dlopen(const char *, int) __attribute__((weak));
+int __real_dlclose(void *) __attribute__((weak));
+
+// RefreshModules() may call wrapped functions (e.g., mmap), hence the guard.
+void *__wrap_dlopen(const char *filename, int flags) {
+  void *Handle = __real_dlopen(filename, flags);
+  if (!InWrapper && Initialized.load(std::memory_order_acquire)) {
+    InWrapper = true;
+    RefreshModules(OnNewModule);
+    InWrapper = false;
+  }
+  return Handle;
+}
+
+int __wrap_dlclose(void *handle) {
+  int Res = __real_dlclose(handle);
+  if (!InWrapper && Initialized.load(std::memory_order_acquire)) {
+    InWrapper = true;
+    RefreshModules(OnNewModule);
+    InWrapper = false;
+  }
+  return Res;
 }
 
 } // extern "C"
+
+#else // WRAP2TRACE_PRELOAD
+
+/////////////////////////////////////////////////////////
+/* Interposed allocation functions, for LD_PRELOAD use */
+/////////////////////////////////////////////////////////
+
+// The functions below replace the ones of the C library for the whole
+// process. The next definitions (i.e., the C library ones) are looked up
+// with dlsym(RTLD_NEXT) on first use. dlsym() itself allocates memory,
+// which is served from a static bootstrap arena and never freed. The
+// pointers are published by RealResolved, set once they are all written.
+
+static void *(*RealMalloc)(size_t);
+static void (*RealFree)(void *);
+static void *(*RealCalloc)(size_t, size_t);
+static void *(*RealRealloc)(void *, size_t);
+static int (*RealPosixMemalign)(void **, size_t, size_t);
+static void *(*RealAlignedAlloc)(size_t, size_t);
+static void *(*RealMemalign)(size_t, size_t);
+static void *(*RealValloc)(size_t);
+static void *(*RealPvalloc)(size_t);
+static std::atomic<bool> RealResolved;
+
+#define BOOTSTRAP_ARENA_SIZE (64 << 10)
+#define BOOTSTRAP_ALIGN 16
+
+// Each block is preceded by its size, in a BOOTSTRAP_ALIGN sized header.
+alignas(BOOTSTRAP_ALIGN) static char BootstrapArena[BOOTSTRAP_ARENA_SIZE];
+static std::atomic<size_t> BootstrapUsed;
+
+// Zeroed memory, as the arena is never reused.
+static void *BootstrapAlloc(size_t Size, size_t Align = BOOTSTRAP_ALIGN) {
+  size_t Need = BOOTSTRAP_ALIGN + Size + Align;
+  size_t Off = BootstrapUsed.fetch_add(Need, std::memory_order_relaxed);
+  if (Off + Need > BOOTSTRAP_ARENA_SIZE)
+    return nullptr;
+  uintptr_t P = (uintptr_t)BootstrapArena + Off + BOOTSTRAP_ALIGN;
+  P = (P + Align - 1) & ~(uintptr_t)(Align - 1);
+  ((size_t *)P)[-1] = Size;
+  return (void *)P;
+}
+
+static bool IsBootstrap(const void *P) {
+  return (const char *)P >= BootstrapArena &&
+         (const char *)P < BootstrapArena + BOOTSTRAP_ARENA_SIZE;
+}
+
+// Copy the contents of the bootstrap block Old to New, a block of Size bytes.
+static void MoveBootstrapBlock(void *New, const void *Old, size_t Size) {
+  size_t OldSize = ((const size_t *)Old)[-1];
+  memcpy(New, Old, OldSize < Size ? OldSize : Size);
+}
+
+// Returns false while the lookup is in progress, i.e., for the allocations
+// made by dlsym().
+static bool ResolveRealFunctions() {
+  static std::atomic<bool> Resolving;
+  if (RealResolved.load(std::memory_order_acquire))
+    return true;
+  if (Resolving.exchange(true))
+    return false;
+  RealMalloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+  RealFree = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+  RealCalloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+  RealRealloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+  RealPosixMemalign =
+      (int (*)(void **, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+  RealAlignedAlloc =
+      (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "aligned_alloc");
+  RealMemalign = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "memalign");
+  RealValloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "valloc");
+  RealPvalloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "pvalloc");
+  if (!RealMalloc || !RealFree || !RealCalloc || !RealRealloc ||
+      !RealPosixMemalign || !RealAlignedAlloc || !RealMemalign ||
+      !RealValloc || !RealPvalloc) {
+    static const char Msg[] = "wrap2trace: can't find the allocation "
+                              "functions of the C library.\n";
+    write(2, Msg, sizeof(Msg) - 1);
+    abort();
+  }
+  RealResolved.store(true, std::memory_order_release);
+  return true;
+}
+
+__attribute__((always_inline)) static bool HaveRealFunctions() {
+  return __builtin_expect(RealResolved.load(std::memory_order_acquire), 1) ||
+         ResolveRealFunctions();
+}
+
+void *malloc(size_t size) {
+  if (!HaveRealFunctions())
+    return BootstrapAlloc(size);
+  RecordCall<kWrapMalloc>(size);
+  return RealMalloc(size);
+}
+
+void free(void *ptr) {
+  if (__builtin_expect(IsBootstrap(ptr), 0))
+    return;
+  if (!HaveRealFunctions())
+    return;
+  RecordCall<kWrapFree>(0);
+  RealFree(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  size_t Total;
+  if (__builtin_mul_overflow(nmemb, size, &Total))
+    return nullptr;
+  if (!HaveRealFunctions())
+    return BootstrapAlloc(Total);
+  RecordCall<kWrapCalloc>(Total);
+  return RealCalloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (!HaveRealFunctions()) {
+    void *New = BootstrapAlloc(size);
+    if (New && IsBootstrap(ptr))
+      MoveBootstrapBlock(New, ptr, size);
+    return New;
+  }
+  RecordCall<kWrapRealloc>(size);
+  if (__builtin_expect(IsBootstrap(ptr), 0)) {
+    // Move the block out of the arena.
+    void *New = RealMalloc(size);
+    if (New)
+      MoveBootstrapBlock(New, ptr, size);
+    return New;
+  }
+  return RealRealloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (!HaveRealFunctions()) {
+    *memptr = BootstrapAlloc(size, alignment);
+    return *memptr ? 0 : ENOMEM;
+  }
+  RecordCall<kWrapPosixMemalign>(size);
+  return RealPosixMemalign(memptr, alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (!HaveRealFunctions())
+    return BootstrapAlloc(size, alignment);
+  RecordCall<kWrapAlignedAlloc>(size);
+  return RealAlignedAlloc(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  if (!HaveRealFunctions())
+    return BootstrapAlloc(size, alignment);
+  RecordCall<kWrapMemalign>(size);
+  return RealMemalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+  if (!HaveRealFunctions())
+    return BootstrapAlloc(size, sysconf(_SC_PAGESIZE));
+  RecordCall<kWrapValloc>(size);
+  return RealValloc(size);
+}
+
+// Like valloc(), with the size rounded up to a multiple of the page size.
+void *pvalloc(size_t size) {
+  if (!HaveRealFunctions()) {
+    size_t PageSize = sysconf(_SC_PAGESIZE);
+    return BootstrapAlloc((size + PageSize - 1) & ~(PageSize - 1), PageSize);
+  }
+  RecordCall<kWrapPvalloc>(size);
+  return RealPvalloc(size);
+}
+
+} // extern "C"
+
+// operator new/delete call the C library functions directly, so that each
+// allocation is recorded once.
+template <WrappedFunc Func>
+__attribute__((always_inline))
+static void *OperatorNew(size_t Size, bool NoThrow) {
+  if (!HaveRealFunctions())
+    return BootstrapAlloc(Size);
+  RecordCall<Func>(Size);
+  for (;;) {
+    if (void *P = RealMalloc(Size ? Size : 1))
+      return P;
+    std::new_handler Handler = std::get_new_handler();
+    if (!Handler) {
+      if (NoThrow)
+        return nullptr;
+      throw std::bad_alloc();
+    }
+    Handler();
+  }
+}
+
+template <WrappedFunc Func>
+__attribute__((always_inline))
+static void OperatorDelete(void *Ptr) {
+  if (__builtin_expect(IsBootstrap(Ptr), 0))
+    return;
+  if (!HaveRealFunctions())
+    return;
+  RecordCall<Func>(0);
+  RealFree(Ptr);
+}
+
+void *operator new(size_t size) {
+  return OperatorNew<kWrapNew>(size, false);
+}
+void *operator new[](size_t size) {
+  return OperatorNew<kWrapNewArray>(size, false);
+}
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return OperatorNew<kWrapNew>(size, true);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return OperatorNew<kWrapNewArray>(size, true);
+}
+void operator delete(void *ptr) noexcept { OperatorDelete<kWrapDelete>(ptr); }
+void operator delete[](void *ptr) noexcept {
+  OperatorDelete<kWrapDeleteArray>(ptr);
+}
+void operator delete(void *ptr, size_t) noexcept {
+  OperatorDelete<kWrapDeleteSized>(ptr);
+}
+void operator delete[](void *ptr, size_t) noexcept {
+  OperatorDelete<kWrapDeleteArraySized>(ptr);
+}
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  OperatorDelete<kWrapDelete>(ptr);
+}
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  OperatorDelete<kWrapDeleteArray>(ptr);
+}
+
+#endif // WRAP2TRACE_PRELOAD